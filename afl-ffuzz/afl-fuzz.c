@@ -60,8 +60,16 @@
 #  include <sys/sysctl.h>
 #endif /* __APPLE__ || __FreeBSD__ || __OpenBSD__ */
 
+#ifdef __x86_64__
+#  include <immintrin.h>
+#endif /* __x86_64__ */
+
 #include "afl-parrel-qemu.h"
 
+#ifdef CONFIG_S2E
+#  include <sys/inotify.h>
+#endif /* CONFIG_S2E */
+
 /* For systems that have sched_setaffinity; right now just Linux, but one
    can hope... */
 
@@ -126,11 +134,19 @@ EXP_ST u8  skip_deterministic,        /* Skip deterministic stages?       */
 
 #ifdef CONFIG_S2E
 u8              parallel_qemu_num = 1;     /* How many qemu instances parallel */
+u8              parallel_qemu_max;         /* Scale qemus up to this (0: fixed)*/
+u32             qemu_restarts;             /* Qemus restarted by the supervisor*/
 QemuInstance*   allQemus;                  /* Collection of all qemu instances */
 QemuInstance*   curQemu;                   /* Current free qemu instance       */
-u32             qemu_quene_fd;             /* Fd of qemu queue as FIFO         */
-u8*             ReadArray;                 /* An shared array for ready qemus  */
+QemuDoneRing*   DoneRing;                  /* Shared completion ring of qemus  */
 static u8       use_stuckhelper;          /* Whether do we need a stuck helper*/
+static u32      qemu_batch = 1;            /* Mutants dispatched per qemu test */
+static u32      qemu_hang_sec = QEMU_HANG_TIMEOUT; /* Least time a test may take */
+static s32      symbex_watch_fd = -1;      /* inotify watch on symbex_dir      */
+static u8       symbex_rescan;             /* Watch overflowed, rescan the dir */
+static u32      symbex_dupes;              /* Symbex testcases seen before     */
+static u8*      sync_virgin;               /* Virgin map shared with peers     */
+static u32      sync_skipped;              /* Peer entries skipped as known    */
 u8*             stuck_helper_dir;          /* Pid for fuzzy stuck helper       */
 #endif
 
@@ -146,32 +162,40 @@ static s32 forksrv_pid,               /* PID of the fork server           */
 
 EXP_ST u8* trace_bits;                /* SHM with instrumentation bitmap  */
 
-#ifdef CONFIG_S2E
-EXP_ST u8* virgin_bits;               /* Regions yet untouched by fuzzing  */
-#else
-EXP_ST u8  virgin_bits[MAP_SIZE];     /* Regions yet untouched by fuzzing */
-#endif
-EXP_ST u8  virgin_hang[MAP_SIZE],     /* Bits we haven't seen in hangs    */
-           virgin_crash[MAP_SIZE];    /* Bits we haven't seen in crashes  */
+u32 map_size = MAP_SIZE;              /* Size of the coverage map         */
 
-#ifndef CONFIG_S2E
-static u8  var_bytes[MAP_SIZE];       /* Bytes that appear to be variable */
-#endif
+EXP_ST u8* virgin_bits;               /* Regions yet untouched by fuzzing */
+EXP_ST u8* virgin_hang,               /* Bits we haven't seen in hangs    */
+         * virgin_crash;              /* Bits we haven't seen in crashes  */
+
+static u8* var_bytes;                 /* Bytes that appear to be variable */
 
 static s32 shm_id;                    /* ID of the SHM region             */
 
 #ifdef CONFIG_S2E
 static s32 virgin_shm_id;             /* ID of the SHM region for virgin  */
+static s32 drill_shm_id;              /* ID of the SHM region of branches
+                                         drilled by the qemus             */
 #endif
 
 #ifdef CONFIG_S2E
 u8 isAfterWait;                      /* Flag marks after waiting all qemus */
 u8 currentQemuAfterWait;
+
+static u8* batch_buf;                 /* Mutants waiting to be dispatched  */
+static u32 batch_n,                   /* Number of mutants in batch_buf    */
+           batch_len;                 /* Length of each of them            */
+static u8  batch_stage;               /* Stage the mutants come from       */
+static struct queue_entry* batch_cur; /* Parent of the mutants             */
+static s32 batch_off[QEMUBATCH_MAX];  /* Modified offset of each mutant    */
+static u8  batch_holding;             /* Testcase joined a batch, no run   */
 #endif
 
 #ifdef CONFIG_S2E
 u8*     g_eff_map = 0;                /* Global effctor map              */
 u32     g_eff_cnt   = 1;
+static u32* sig_pos;                  /* Input bytes feeding sym branches */
+static u32  sig_cnt;                  /* Number of entries in sig_pos     */
 #endif
 
 static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
@@ -252,6 +276,10 @@ static s32 cpu_aff = -1;       	      /* Selected CPU core                */
 
 static FILE* plot_file;               /* Gnuplot output file              */
 
+#ifdef CONFIG_S2E
+static FILE* qemu_file;               /* Per-qemu telemetry output file   */
+#endif
+
 struct queue_entry {
 
   u8* fname;                          /* File name for the test case      */
@@ -276,6 +304,13 @@ struct queue_entry {
   u8* trace_mini;                     /* Trace bytes, if kept             */
   u32 tc_ref;                         /* Trace bytes ref count            */
 
+#ifdef CONFIG_S2E
+  u8* cal_trace;                      /* Trace of the first cal. run      */
+  u32 cal_pending,                    /* Calibration runs dispatched      */
+      cal_done;                       /* Calibration runs reported back   */
+  u64 cal_us;                         /* Total time of those runs (us)    */
+#endif
+
   struct queue_entry *next,           /* Next element, if any             */
                      *next_100;       /* 100 elements ahead               */
 
@@ -286,8 +321,8 @@ static struct queue_entry *queue,     /* Fuzzing queue (linked list)      */
                           *queue_top, /* Top of the list                  */
                           *q_prev100; /* Previous 100 marker              */
 
-static struct queue_entry*
-  top_rated[MAP_SIZE];                /* Top entries for bitmap bytes     */
+static struct queue_entry**
+  top_rated;                          /* Top entries for bitmap bytes     */
 
 struct extra_data {
   u8* data;                           /* Dictionary token data            */
@@ -417,6 +452,75 @@ static inline u32 UR(u32 limit) {
 }
 
 
+#ifdef CONFIG_S2E
+
+/* Read the significant offsets TestcaseFilter collected for inputs of len
+   bytes into sig_pos. Returns their number. */
+
+static u32 load_sig_offsets(u32 len) {
+
+  u8  fn[64];
+  u8* map;
+  u32 i, map_len = (len + 7) >> 3;
+  s32 fd;
+  struct flock lk;
+
+  sig_cnt = 0;
+
+  sprintf(fn, OFFS_DIR "/%u.map", len);
+  fd = open(fn, O_RDONLY);
+  if (fd < 0) return 0;
+
+  /* TestcaseFilter updates the map under a write lock, do not read it half
+     written. The lock goes away with the descriptor. */
+
+  memset(&lk, 0, sizeof(lk));
+  lk.l_type   = F_RDLCK;
+  lk.l_whence = SEEK_SET;
+
+  if (fcntl(fd, F_SETLKW, &lk)) {
+    close(fd);
+    return 0;
+  }
+
+  map = ck_alloc_nozero(map_len);
+
+  if (read(fd, map, map_len) == (s32)map_len) {
+
+    sig_pos = ck_realloc(sig_pos, len * sizeof(u32));
+
+    for (i = 0; i < len; i++)
+      if (map[i >> 3] & (1 << (i & 7))) sig_pos[sig_cnt++] = i;
+
+  }
+
+  ck_free(map);
+  close(fd);
+
+  return sig_cnt;
+
+}
+
+/* Random position below limit for havoc, on a significant byte
+   SIG_HAVOC_PERC% of the time if there are any. */
+
+static u32 havoc_pos(u32 limit) {
+
+  if (sig_cnt && UR(100) < SIG_HAVOC_PERC) {
+
+    u32 pos = sig_pos[UR(sig_cnt)];
+    if (pos < limit) return pos;
+
+  }
+
+  return UR(limit);
+
+}
+
+#else
+#  define havoc_pos(_l) UR(_l)
+#endif /* ^CONFIG_S2E */
+
 /* Shuffle an array of pointers. Might be slightly biased. */
 
 static void shuffle_ptrs(void** ptrs, u32 cnt) {
@@ -762,8 +866,6 @@ static void mark_as_det_done(struct queue_entry* q) {
 
 }
 
-/* Regard every test case as deterministic one and give up variable check */
-#ifndef CONFIG_S2E
 /* Mark as variable. Create symlinks if possible to make it easier to examine
    the files. */
 
@@ -788,7 +890,6 @@ static void mark_as_variable(struct queue_entry* q) {
   q->var_behavior = 1;
 
 }
-#endif
 
 /* Mark / unmark as redundant (edge-only). This is not used for restoring state,
    but may be useful for post-processing datasets. */
@@ -895,7 +996,7 @@ EXP_ST void write_bitmap(void) {
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+  ck_write(fd, virgin_bits, map_size, fname);
 
   close(fd);
   ck_free(fname);
@@ -911,13 +1012,27 @@ EXP_ST void read_bitmap(u8* fname) {
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_read(fd, virgin_bits, MAP_SIZE, fname);
+  ck_read(fd, virgin_bits, map_size, fname);
 
   close(fd);
 
 }
 
 
+/* On x86_64, the bitmap scans below come in SSE2 (always there) and AVX2
+   flavors, the latter picked at runtime if the host has it (see main()).
+   The vector code only looks for the few interesting chunks of the map;
+   bytes within them are still handled by the scalar code. */
+
+#ifdef __x86_64__
+
+static u8 use_avx2;                   /* Bitmap scans may use AVX2        */
+
+#  define AVX2_FN __attribute__((target("avx2,popcnt")))
+
+#endif /* __x86_64__ */
+
+
 /* Check if the current execution path brings anything new to the table.
    Update virgin bits to reflect the finds. Returns 1 if the only change is
    the hit-count for a particular tuple; 2 if there are new tuples seen. 
@@ -926,36 +1041,134 @@ EXP_ST void read_bitmap(u8* fname) {
    This function is called after every exec() on a fairly large buffer, so
    it needs to be fast. We do this in 32-bit and 64-bit flavors. */
 
+#ifdef __x86_64__
+
+static inline void new_bits_word(u64* current, u64* virgin, u8* ret) {
+
+  /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
+     that have not been already cleared from the virgin map - since this will
+     almost always be the case. */
+
+  if (unlikely(*current) && unlikely(*current & *virgin)) {
+
+    if (likely(*ret < 2)) {
+
+      u8* cur = (u8*)current;
+      u8* vir = (u8*)virgin;
+
+      /* Looks like we have not found any new bytes yet; see if any non-zero
+         bytes in current[] are pristine in virgin[]. */
+
+      if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+          (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
+          (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
+          (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff)) *ret = 2;
+      else *ret = 1;
+
+    }
+
+    *virgin &= ~*current;
+
+  }
+
+}
+
+
+static AVX2_FN u8 new_bits_avx2(u64* current, u64* virgin) {
+
+  u32 i = map_size >> 5;
+  u8  ret = 0;
+
+  while (i--) {
+
+    __m256i c = _mm256_loadu_si256((__m256i*)current);
+    __m256i v = _mm256_loadu_si256((__m256i*)virgin);
+
+    if (unlikely(!_mm256_testz_si256(c, v))) {
+
+      new_bits_word(current,     virgin,     &ret);
+      new_bits_word(current + 1, virgin + 1, &ret);
+      new_bits_word(current + 2, virgin + 2, &ret);
+      new_bits_word(current + 3, virgin + 3, &ret);
+
+    }
+
+    current += 4;
+    virgin  += 4;
+
+  }
+
+  return ret;
+
+}
+
+
+static u8 new_bits_sse2(u64* current, u64* virgin) {
+
+  __m128i zero = _mm_setzero_si128();
+  u32 i = map_size >> 4;
+  u8  ret = 0;
+
+  while (i--) {
+
+    __m128i cv = _mm_and_si128(_mm_loadu_si128((__m128i*)current),
+                               _mm_loadu_si128((__m128i*)virgin));
+
+    if (unlikely(_mm_movemask_epi8(_mm_cmpeq_epi8(cv, zero)) != 0xffff)) {
+
+      new_bits_word(current,     virgin,     &ret);
+      new_bits_word(current + 1, virgin + 1, &ret);
+
+    }
+
+    current += 2;
+    virgin  += 2;
+
+  }
+
+  return ret;
+
+}
+
+
 static inline u8 has_new_bits(u8* virgin_map) {
 
+  u8 ret;
+
 #ifdef CONFIG_S2E
 	if (!curQemu)
 		FATAL("Current qemu is NULL?!");
-#endif
-
-#ifdef __x86_64__
 
-#ifdef CONFIG_S2E
   u64* current = (u64*)(curQemu->trace_bits);
 #else
   u64* current = (u64*)trace_bits;
 #endif
   u64* virgin  = (u64*)virgin_map;
 
-  u32  i = (MAP_SIZE >> 3);
+  if (use_avx2) ret = new_bits_avx2(current, virgin);
+  else ret = new_bits_sse2(current, virgin);
+
+  if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+
+  return ret;
+
+}
 
 #else
 
+static inline u8 has_new_bits(u8* virgin_map) {
+
 #ifdef CONFIG_S2E
+	if (!curQemu)
+		FATAL("Current qemu is NULL?!");
+
   u32* current = (u32*)(curQemu->trace_bits);
 #else
   u32* current = (u32*)trace_bits;
 #endif
   u32* virgin  = (u32*)virgin_map;
 
-  u32  i = (MAP_SIZE >> 2);
-
-#endif /* ^__x86_64__ */
+  u32  i = (map_size >> 2);
 
   u8   ret = 0;
 
@@ -975,22 +1188,10 @@ static inline u8 has_new_bits(u8* virgin_map) {
         /* Looks like we have not found any new bytes yet; see if any non-zero
            bytes in current[] are pristine in virgin[]. */
 
-#ifdef __x86_64__
-
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
-            (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
-            (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff)) ret = 2;
-        else ret = 1;
-
-#else
-
         if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
             (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff)) ret = 2;
         else ret = 1;
 
-#endif /* ^__x86_64__ */
-
       }
 
       *virgin &= ~*current;
@@ -1008,14 +1209,46 @@ static inline u8 has_new_bits(u8* virgin_map) {
 
 }
 
+#endif /* ^__x86_64__ */
+
 
 /* Count the number of bits set in the provided bitmap. Used for the status
    screen several times every second, does not have to be fast. */
 
+#ifdef __x86_64__
+
+static u32 count_bits(u8* mem) {
+
+  u64* ptr = (u64*)mem;
+  u32  i   = (map_size >> 3);
+  u32  ret = 0;
+
+  while (i--) {
+
+    u64 v = *(ptr++);
+
+    /* This gets called on the inverse, virgin bitmap; optimize for sparse
+       data. */
+
+    if (v == 0xffffffffffffffffULL) {
+      ret += 64;
+      continue;
+    }
+
+    ret += __builtin_popcountll(v);
+
+  }
+
+  return ret;
+
+}
+
+#else
+
 static u32 count_bits(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1040,6 +1273,79 @@ static u32 count_bits(u8* mem) {
 
 }
 
+#endif /* ^__x86_64__ */
+
+
+#ifdef __x86_64__
+
+/* Count the bytes of the bitmap that differ from b; count_bytes() and
+   count_non_255_bytes() are both just that. */
+
+static AVX2_FN u32 count_ne_avx2(u8* mem, u8 b) {
+
+  __m256i pat = _mm256_set1_epi8(b);
+  u32 i   = map_size >> 5;
+  u32 ret = 0;
+
+  while (i--) {
+
+    u32 eq = _mm256_movemask_epi8(
+               _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)mem), pat));
+
+    ret += 32 - __builtin_popcount(eq);
+    mem += 32;
+
+  }
+
+  return ret;
+
+}
+
+
+static u32 count_ne_sse2(u8* mem, u8 b) {
+
+  __m128i pat = _mm_set1_epi8(b);
+  u32 i   = map_size >> 4;
+  u32 ret = 0;
+
+  while (i--) {
+
+    u32 eq = _mm_movemask_epi8(
+               _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)mem), pat));
+
+    /* Optimize for sparse maps, no need for a popcount then. */
+
+    if (eq != 0xffff) ret += 16 - __builtin_popcount(eq);
+    mem += 16;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Count the number of bytes set in the bitmap. Called fairly sporadically,
+   mostly to update the status screen or calibrate and examine confirmed
+   new paths. */
+
+static u32 count_bytes(u8* mem) {
+
+  return use_avx2 ? count_ne_avx2(mem, 0) : count_ne_sse2(mem, 0);
+
+}
+
+
+/* Count the number of non-255 bytes set in the bitmap. Used strictly for the
+   status screen, several calls per second or so. */
+
+static u32 count_non_255_bytes(u8* mem) {
+
+  return use_avx2 ? count_ne_avx2(mem, 0xff) : count_ne_sse2(mem, 0xff);
+
+}
+
+#else
 
 #define FF(_b)  (0xff << ((_b) << 3))
 
@@ -1050,7 +1356,7 @@ static u32 count_bits(u8* mem) {
 static u32 count_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1076,7 +1382,7 @@ static u32 count_bytes(u8* mem) {
 static u32 count_non_255_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1098,12 +1404,66 @@ static u32 count_non_255_bytes(u8* mem) {
 
 }
 
+#endif /* ^__x86_64__ */
+
 
 /* Destructively simplify trace by eliminating hit count information
    and replacing it with 0x80 or 0x01 depending on whether the tuple
    is hit or not. Called on every new crash or hang, should be
    reasonably fast. */
 
+#ifdef __x86_64__
+
+/* Branch-free: every byte becomes 0x01 where it was zero, 0x80 elsewhere. */
+
+static AVX2_FN void simplify_trace_avx2(u64* mem) {
+
+  __m256i zero = _mm256_setzero_si256();
+  __m256i hit  = _mm256_set1_epi8(0x80);
+  __m256i miss = _mm256_set1_epi8(0x01);
+  u32 i = map_size >> 5;
+
+  while (i--) {
+
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)mem), zero);
+
+    _mm256_storeu_si256((__m256i*)mem, _mm256_blendv_epi8(hit, miss, eq));
+    mem += 4;
+
+  }
+
+}
+
+
+static void simplify_trace_sse2(u64* mem) {
+
+  __m128i zero = _mm_setzero_si128();
+  __m128i hit  = _mm_set1_epi8(0x80);
+  __m128i miss = _mm_set1_epi8(0x01);
+  u32 i = map_size >> 4;
+
+  while (i--) {
+
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)mem), zero);
+
+    _mm_storeu_si128((__m128i*)mem, _mm_or_si128(_mm_and_si128(eq, miss),
+                                                 _mm_andnot_si128(eq, hit)));
+    mem += 2;
+
+  }
+
+}
+
+
+static void simplify_trace(u64* mem) {
+
+  if (use_avx2) simplify_trace_avx2(mem);
+  else simplify_trace_sse2(mem);
+
+}
+
+#else
+
 static const u8 simplify_lookup[256] = { 
 
   [0]         = 1,
@@ -1111,173 +1471,492 @@ static const u8 simplify_lookup[256] = {
 
 };
 
-#ifdef __x86_64__
+static void simplify_trace(u32* mem) {
+
+  u32 i = map_size >> 2;
+
+  while (i--) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (unlikely(*mem)) {
+
+      u8* mem8 = (u8*)mem;
+
+      mem8[0] = simplify_lookup[mem8[0]];
+      mem8[1] = simplify_lookup[mem8[1]];
+      mem8[2] = simplify_lookup[mem8[2]];
+      mem8[3] = simplify_lookup[mem8[3]];
+
+    } else *mem = 0x01010101;
+
+    mem++;
+  }
+
+}
+
+#endif /* ^__x86_64__ */
+
+
+/* Destructively classify execution counts in a trace. This is used as a
+   preprocessing step for any newly acquired traces. Called on every exec,
+   must be fast. */
+
+static const u8 count_class_lookup8[256] = {
+
+  [0]           = 0,
+  [1]           = 1,
+  [2]           = 2,
+  [3]           = 4,
+  [4 ... 7]     = 8,
+  [8 ... 15]    = 16,
+  [16 ... 31]   = 32,
+  [32 ... 127]  = 64,
+  [128 ... 255] = 128
+
+};
+
+static u16 count_class_lookup16[65536];
+
+
+static void init_count_class16(void) {
+
+  u32 b1, b2;
+
+  for (b1 = 0; b1 < 256; b1++) 
+    for (b2 = 0; b2 < 256; b2++)
+      count_class_lookup16[(b1 << 8) + b2] = 
+        (count_class_lookup8[b1] << 8) |
+        count_class_lookup8[b2];
+
+}
+
+
+#ifdef __x86_64__
+
+/* The word is rebuilt and stored as a whole, so that the fused pass below
+   may read it back as u64 right away without tripping over aliasing. */
+
+static inline void classify_word(u64* mem) {
+
+  u64 v = *mem;
+
+  /* Optimize for sparse bitmaps. */
+
+  if (unlikely(v)) {
+
+    *mem = (u64)count_class_lookup16[(u16)v] |
+           ((u64)count_class_lookup16[(u16)(v >> 16)] << 16) |
+           ((u64)count_class_lookup16[(u16)(v >> 32)] << 32) |
+           ((u64)count_class_lookup16[(u16)(v >> 48)] << 48);
+
+  }
+
+}
+
+
+static AVX2_FN void classify_counts_avx2(u64* mem) {
+
+  u32 i = map_size >> 5;
+
+  while (i--) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)mem);
+
+    if (unlikely(!_mm256_testz_si256(v, v))) {
+
+      classify_word(mem);
+      classify_word(mem + 1);
+      classify_word(mem + 2);
+      classify_word(mem + 3);
+
+    }
+
+    mem += 4;
+
+  }
+
+}
+
+
+static void classify_counts_sse2(u64* mem) {
+
+  __m128i zero = _mm_setzero_si128();
+  u32 i = map_size >> 4;
+
+  while (i--) {
+
+    __m128i v = _mm_loadu_si128((__m128i*)mem);
+
+    if (unlikely(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)) {
+
+      classify_word(mem);
+      classify_word(mem + 1);
+
+    }
+
+    mem += 2;
+
+  }
+
+}
+
+
+static inline void classify_counts(u64* mem) {
+
+  if (use_avx2) classify_counts_avx2(mem);
+  else classify_counts_sse2(mem);
+
+}
+
+#else
+
+static inline void classify_counts(u32* mem) {
+
+  u32 i = map_size >> 2;
+
+  while (i--) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (unlikely(*mem)) {
+
+      u16* mem16 = (u16*)mem;
+
+      mem16[0] = count_class_lookup16[mem16[0]];
+      mem16[1] = count_class_lookup16[mem16[1]];
+
+    }
+
+    mem++;
+
+  }
+
+}
+
+#endif /* ^__x86_64__ */
+
+
+#ifdef CONFIG_S2E
+
+/* Qemu trace maps come with a bitmap of the lines FuzzyS2E touched (see
+   afl-parrel-qemu.h), the rest of the map is zero. The passes below only
+   visit those lines. Index of the first touched line from line on: */
+
+static inline u32 next_dirty_line(u8* dirty, u32 line) {
+
+  u32  lines = map_size >> TRACE_LINE_SHIFT;
+  u64* w     = (u64*)dirty;
+  u32  i     = line >> 6;
+  u64  bits;
+
+  if (line >= lines) return lines;
+
+  bits = w[i] & (~0ULL << (line & 63));
+
+  while (!bits) {
+
+    if (++i >= (lines >> 6)) return lines;
+    bits = w[i];
+
+  }
+
+  return (i << 6) + __builtin_ctzll(bits);
+
+}
+
+#define FOR_DIRTY_LINES(_dirty, _l) \
+  for (_l = next_dirty_line(_dirty, 0); _l < (map_size >> TRACE_LINE_SHIFT); \
+       _l = next_dirty_line(_dirty, _l + 1))
+
+
+static inline u8 line_is_zero(u8* line) {
+
+  u64* w = (u64*)line;
+  u64  v = 0;
+  u32  i;
+
+  for (i = 0; i < (TRACE_LINE_SIZE >> 3); i++) v |= w[i];
+
+  return !v;
+
+}
+
+
+/* Zero the touched lines of a trace map before the next test. */
+
+static void reset_trace(u8* trace, u8* dirty) {
+
+  u32 l;
+
+  FOR_DIRTY_LINES(dirty, l)
+    memset(trace + (l << TRACE_LINE_SHIFT), 0, TRACE_LINE_SIZE);
+
+  memset(dirty, 0, TRACE_DIRTY_SIZE(map_size));
+
+}
+
+
+/* count_bytes() of a trace map. */
+
+static u32 count_trace_bytes(u8* trace, u8* dirty) {
+
+  u32 l, i, ret = 0;
+
+  FOR_DIRTY_LINES(dirty, l) {
+
+    u8* line = trace + (l << TRACE_LINE_SHIFT);
+
+    for (i = 0; i < TRACE_LINE_SIZE; i++)
+      if (line[i]) ret++;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Checksum of a trace map: hash32() chained over its non-zero lines, each
+   seeded with the line index. This stands in for hash32() of the whole map
+   in S2E mode; touched lines may have wrapped back to zero, hence the
+   check. */
+
+static u32 trace_cksum(u8* trace, u8* dirty) {
+
+  u32 l, h = HASH_CONST;
+
+  FOR_DIRTY_LINES(dirty, l) {
+
+    u8* line = trace + (l << TRACE_LINE_SHIFT);
+
+    if (!line_is_zero(line)) h = hash32(line, TRACE_LINE_SIZE, h ^ l);
+
+  }
+
+  return h;
+
+}
+
+
+/* classify_counts() on the touched lines of a trace, then has_new_bits()
+   against virgin_map unless that is NULL and, if cksum is given,
+   trace_cksum() of the classified trace - all in a single pass. This is
+   what every completed test goes through. Elsewhere, the trace must belong
+   to curQemu. */
+
+#ifdef __x86_64__
+
+static AVX2_FN u8 classify_check_avx2(u64* current, u64* virgin, u64* h1,
+                                      u32 n) {
+
+  u32 j;
+  u8  ret = 0;
+
+  while (n--) {
+
+    __m256i c = _mm256_loadu_si256((__m256i*)current);
+
+    if (unlikely(!_mm256_testz_si256(c, c))) {
+
+      for (j = 0; j < 4; j++) classify_word(current + j);
+
+      c = _mm256_loadu_si256((__m256i*)current);
+
+      if (virgin && unlikely(!_mm256_testz_si256(c,
+                               _mm256_loadu_si256((__m256i*)virgin))))
+        for (j = 0; j < 4; j++) new_bits_word(current + j, virgin + j, &ret);
+
+    }
+
+    if (h1)
+      for (j = 0; j < 4; j++) *h1 = hash64_round(*h1, current[j]);
+
+    current += 4;
+    if (virgin) virgin += 4;
+
+  }
+
+  return ret;
+
+}
+
+
+static u8 classify_check_sse2(u64* current, u64* virgin, u64* h1, u32 n) {
+
+  __m128i zero = _mm_setzero_si128();
+  u8  ret = 0;
+
+  while (n--) {
+
+    __m128i c = _mm_loadu_si128((__m128i*)current);
+
+    if (unlikely(_mm_movemask_epi8(_mm_cmpeq_epi8(c, zero)) != 0xffff)) {
+
+      classify_word(current);
+      classify_word(current + 1);
+
+      if (virgin) {
+
+        c = _mm_and_si128(_mm_loadu_si128((__m128i*)current),
+                          _mm_loadu_si128((__m128i*)virgin));
+
+        if (unlikely(_mm_movemask_epi8(_mm_cmpeq_epi8(c, zero)) != 0xffff)) {
+          new_bits_word(current,     virgin,     &ret);
+          new_bits_word(current + 1, virgin + 1, &ret);
+        }
+
+      }
+
+    }
+
+    if (h1) {
+      *h1 = hash64_round(*h1, current[0]);
+      *h1 = hash64_round(*h1, current[1]);
+    }
+
+    current += 2;
+    if (virgin) virgin += 2;
+
+  }
+
+  return ret;
 
-static void simplify_trace(u64* mem) {
+}
 
-  u32 i = MAP_SIZE >> 3;
 
-  while (i--) {
+static u8 classify_and_check(u8* trace, u8* dirty, u8* virgin_map,
+                             u32* cksum) {
 
-    /* Optimize for sparse bitmaps. */
+  u32 l, h = HASH_CONST;
+  u8  ret = 0;
 
-    if (unlikely(*mem)) {
+  FOR_DIRTY_LINES(dirty, l) {
 
-      u8* mem8 = (u8*)mem;
+    u32  off = l << TRACE_LINE_SHIFT;
+    u64* cur = (u64*)(trace + off);
+    u64* vir = virgin_map ? (u64*)(virgin_map + off) : NULL;
 
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
-      mem8[4] = simplify_lookup[mem8[4]];
-      mem8[5] = simplify_lookup[mem8[5]];
-      mem8[6] = simplify_lookup[mem8[6]];
-      mem8[7] = simplify_lookup[mem8[7]];
+    /* Same as hash32(line, TRACE_LINE_SIZE, h ^ l). */
 
-    } else *mem = 0x0101010101010101ULL;
+    u64  h1  = (u32)(h ^ l ^ TRACE_LINE_SIZE);
+    u8   r;
 
-    mem++;
+    if (use_avx2)
+      r = classify_check_avx2(cur, vir, cksum ? &h1 : NULL, TRACE_LINE_SIZE >> 5);
+    else
+      r = classify_check_sse2(cur, vir, cksum ? &h1 : NULL, TRACE_LINE_SIZE >> 4);
 
-  }
+    if (r > ret) ret = r;
 
-}
+    if (cksum && !line_is_zero((u8*)cur)) h = hash64_final(h1);
 
-#else
+  }
 
-static void simplify_trace(u32* mem) {
+  if (cksum) *cksum = h;
 
-  u32 i = MAP_SIZE >> 2;
+  if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
 
-  while (i--) {
+  return ret;
 
-    /* Optimize for sparse bitmaps. */
+}
 
-    if (unlikely(*mem)) {
+#else
 
-      u8* mem8 = (u8*)mem;
+static u8 classify_and_check(u8* trace, u8* dirty, u8* virgin_map,
+                             u32* cksum) {
 
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
+  classify_counts((u32*)trace);
 
-    } else *mem = 0x01010101;
+  if (cksum) *cksum = trace_cksum(trace, dirty);
 
-    mem++;
-  }
+  return virgin_map ? has_new_bits(virgin_map) : 0;
 
 }
 
 #endif /* ^__x86_64__ */
 
+#endif /* CONFIG_S2E */
 
-/* Destructively classify execution counts in a trace. This is used as a
-   preprocessing step for any newly acquired traces. Called on every exec,
-   must be fast. */
-
-static const u8 count_class_lookup8[256] = {
 
-  [0]           = 0,
-  [1]           = 1,
-  [2]           = 2,
-  [3]           = 4,
-  [4 ... 7]     = 8,
-  [8 ... 15]    = 16,
-  [16 ... 31]   = 32,
-  [32 ... 127]  = 64,
-  [128 ... 255] = 128
+/* Get rid of shared memory (atexit handler). */
 
-};
+static void remove_shm(void) {
 
-static u16 count_class_lookup16[65536];
+  shmctl(shm_id, IPC_RMID, NULL);
 
+#ifdef CONFIG_S2E
+  shmctl(virgin_shm_id, IPC_RMID, NULL);
+  shmctl(drill_shm_id, IPC_RMID, NULL);
 
-static void init_count_class16(void) {
+  /* Created by the qemus after we started, look it up again. */
 
-  u32 b1, b2;
+  key_t edge_shmkey = ftok("/tmp/aflvirgin", 'e');
+  s32 edge_shm_id;
 
-  for (b1 = 0; b1 < 256; b1++) 
-    for (b2 = 0; b2 < 256; b2++)
-      count_class_lookup16[(b1 << 8) + b2] = 
-        (count_class_lookup8[b1] << 8) |
-        count_class_lookup8[b2];
+  if (edge_shmkey >= 0 && (edge_shm_id = shmget(edge_shmkey, 0, 0600)) >= 0)
+    shmctl(edge_shm_id, IPC_RMID, NULL);
+#endif
 
 }
 
 
-#ifdef __x86_64__
-
-static inline void classify_counts(u64* mem) {
-
-  u32 i = MAP_SIZE >> 3;
+/* Compact trace bytes into a smaller bitmap. We effectively just drop the
+   count information here. This is called only sporadically, for some
+   new paths. */
 
-  while (i--) {
+#ifdef __x86_64__
 
-    /* Optimize for sparse bitmaps. */
+/* The byte mask of a vector is exactly the bits it compacts to. */
 
-    if (unlikely(*mem)) {
+static AVX2_FN void minimize_bits_avx2(u8* dst, u8* src) {
 
-      u16* mem16 = (u16*)mem;
+  __m256i zero = _mm256_setzero_si256();
+  u32 i;
 
-      mem16[0] = count_class_lookup16[mem16[0]];
-      mem16[1] = count_class_lookup16[mem16[1]];
-      mem16[2] = count_class_lookup16[mem16[2]];
-      mem16[3] = count_class_lookup16[mem16[3]];
+  for (i = 0; i < map_size; i += 32) {
 
-    }
+    u32 nz = ~_mm256_movemask_epi8(
+               _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(src + i)), zero));
 
-    mem++;
+    if (nz) *(u32*)(dst + (i >> 3)) |= nz;
 
   }
 
 }
 
-#else
-
-static inline void classify_counts(u32* mem) {
-
-  u32 i = MAP_SIZE >> 2;
-
-  while (i--) {
-
-    /* Optimize for sparse bitmaps. */
 
-    if (unlikely(*mem)) {
+static void minimize_bits_sse2(u8* dst, u8* src) {
 
-      u16* mem16 = (u16*)mem;
+  __m128i zero = _mm_setzero_si128();
+  u32 i;
 
-      mem16[0] = count_class_lookup16[mem16[0]];
-      mem16[1] = count_class_lookup16[mem16[1]];
+  for (i = 0; i < map_size; i += 16) {
 
-    }
+    u16 nz = ~_mm_movemask_epi8(
+               _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(src + i)), zero));
 
-    mem++;
+    if (nz) *(u16*)(dst + (i >> 3)) |= nz;
 
   }
 
 }
 
-#endif /* ^__x86_64__ */
-
 
-/* Get rid of shared memory (atexit handler). */
-
-static void remove_shm(void) {
+static void minimize_bits(u8* dst, u8* src) {
 
-  shmctl(shm_id, IPC_RMID, NULL);
+  if (use_avx2) minimize_bits_avx2(dst, src);
+  else minimize_bits_sse2(dst, src);
 
 }
 
-
-/* Compact trace bytes into a smaller bitmap. We effectively just drop the
-   count information here. This is called only sporadically, for some
-   new paths. */
+#else
 
 static void minimize_bits(u8* dst, u8* src) {
 
   u32 i = 0;
 
-  while (i < MAP_SIZE) {
+  while (i < map_size) {
 
     if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
     i++;
@@ -1286,6 +1965,8 @@ static void minimize_bits(u8* dst, u8* src) {
 
 }
 
+#endif /* ^__x86_64__ */
+
 
 /* When we bump into a new path, we call this to see if the path appears
    more "favorable" than any of the existing ones. The purpose of the
@@ -1305,7 +1986,7 @@ static void update_bitmap_score(struct queue_entry* q) {
   /* For every byte set in trace_bits[], see if there is a previous winner,
      and how it compares to us. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
 
     if (trace_bits[i]) {
 
@@ -1331,7 +2012,7 @@ static void update_bitmap_score(struct queue_entry* q) {
        q->tc_ref++;
 
        if (!q->trace_mini) {
-         q->trace_mini = ck_alloc(MAP_SIZE >> 3);
+         q->trace_mini = ck_alloc(map_size >> 3);
          minimize_bits(q->trace_mini, trace_bits);
        }
 
@@ -1351,14 +2032,16 @@ static void update_bitmap_score(struct queue_entry* q) {
 static void cull_queue(void) {
 
   struct queue_entry* q;
-  static u8 temp_v[MAP_SIZE >> 3];
+  static u8* temp_v;
   u32 i;
 
   if (dumb_mode || !score_changed) return;
 
   score_changed = 0;
 
-  memset(temp_v, 255, MAP_SIZE >> 3);
+  if (!temp_v) temp_v = ck_alloc_nozero(map_size >> 3);
+
+  memset(temp_v, 255, map_size >> 3);
 
   queued_favored  = 0;
   pending_favored = 0;
@@ -1373,10 +2056,10 @@ static void cull_queue(void) {
   /* Let's see if anything in the bitmap isn't captured in temp_v.
      If yes, and if it has a top_rated[] contender, let's use it. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
     if (top_rated[i] && (temp_v[i >> 3] & (1 << (i & 7)))) {
 
-      u32 j = MAP_SIZE >> 3;
+      u32 j = map_size >> 3;
 
       /* Remove all bits belonging to the current entry from temp_v. */
 
@@ -1401,21 +2084,77 @@ static void cull_queue(void) {
 }
 
 
+#ifdef CONFIG_S2E
+
+/* Pick the coverage map size from AFL_MAP_SIZE and hand it to the qemus,
+   which size their trace maps after MAP_SIZE_ENV_VAR. Large full-system
+   targets see far fewer edge collisions with a bigger map. */
+
+static void setup_map_size(void) {
+
+  u8* env = getenv("AFL_MAP_SIZE");
+  u8* str;
+
+  if (env) {
+
+    u64 sz = 0;
+    u8  suffix = 0;
+
+    if (sscanf(env, "%llu%c", &sz, &suffix) < 1) FATAL("Bad value of AFL_MAP_SIZE");
+
+    switch (suffix) {
+
+      case 0: break;
+      case 'k': case 'K': sz <<= 10; break;
+      case 'm': case 'M': sz <<= 20; break;
+      default: FATAL("Bad value of AFL_MAP_SIZE");
+
+    }
+
+    if (sz < MAP_SIZE || sz > MAP_SIZE_MAX || (sz & (sz - 1)))
+      FATAL("AFL_MAP_SIZE must be a power of two between %u and %u",
+            MAP_SIZE, MAP_SIZE_MAX);
+
+    map_size = sz;
+
+  }
+
+  str = alloc_printf("%u", map_size);
+  setenv(MAP_SIZE_ENV_VAR, str, 1);
+  ck_free(str);
+
+}
+
+#endif /* CONFIG_S2E */
+
+
 /* Configure shared memory and virgin_bits. This is called at startup. */
 
 EXP_ST void setup_shm(void) {
 
   u8* shm_str;
 
+#ifdef CONFIG_S2E
+  setup_map_size();
+#else
+  virgin_bits  = ck_alloc_nozero(map_size);
+#endif
+
+  virgin_hang  = ck_alloc_nozero(map_size);
+  virgin_crash = ck_alloc_nozero(map_size);
+  var_bytes    = ck_alloc(map_size);
+  top_rated    = ck_alloc(map_size * sizeof(struct queue_entry*));
+
 #ifndef CONFIG_S2E
-  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+  if (!in_bitmap) memset(virgin_bits, 255, map_size);
 #endif
 
-  memset(virgin_hang, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
+  memset(virgin_hang, 255, map_size);
+  memset(virgin_crash, 255, map_size);
 
 #ifdef CONFIG_S2E
-  key_t shmkey, virgin_shmkey;
+  key_t shmkey, virgin_shmkey, drill_shmkey, edge_shmkey;
+  s32 edge_shm_id;
   int fd_bitmap = open("/tmp/aflbitmap", O_RDWR|O_CREAT, 0777);
   if (fd_bitmap == -1)
 	  PFATAL("Cannot creat/open aflbitmap file, quitting...");
@@ -1436,16 +2175,28 @@ EXP_ST void setup_shm(void) {
       printf("ftok error:%s\n", strerror(errno));
       PFATAL("ftok() failed");
 }
-  shm_id = shmget(shmkey, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-  virgin_shm_id = shmget(virgin_shmkey, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+  if((drill_shmkey = ftok("/tmp/aflvirgin", 'd')) < 0){
+      printf("ftok error:%s\n", strerror(errno));
+      PFATAL("ftok() failed");
+  }
+
+  /* The qemus number edges in a table they create on first use (FuzzyS2E
+     edgeIds mode). Ids of a previous run mean nothing to this one. */
+
+  if ((edge_shmkey = ftok("/tmp/aflvirgin", 'e')) >= 0 &&
+      (edge_shm_id = shmget(edge_shmkey, 0, 0600)) >= 0)
+    shmctl(edge_shm_id, IPC_RMID, NULL);
+  shm_id = shmget(shmkey, map_size, IPC_CREAT | IPC_EXCL | 0600);
+  virgin_shm_id = shmget(virgin_shmkey, map_size, IPC_CREAT | IPC_EXCL | 0600);
+  drill_shm_id = shmget(drill_shmkey, map_size, IPC_CREAT | IPC_EXCL | 0600);
 #else
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+  shm_id = shmget(IPC_PRIVATE, map_size, IPC_CREAT | IPC_EXCL | 0600);
 #endif
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
 #ifdef CONFIG_S2E
-  if (virgin_shm_id < 0) PFATAL("shmget() failed");
+  if (virgin_shm_id < 0 || drill_shm_id < 0) PFATAL("shmget() failed");
 #endif
 
   atexit(remove_shm);
@@ -1477,7 +2228,21 @@ EXP_ST void setup_shm(void) {
 
   if (!virgin_bits) PFATAL("shmat() failed");
 
-  memset(virgin_bits, 255, MAP_SIZE);
+  if (!in_bitmap) memset(virgin_bits, 255, map_size);
+
+  /* Qemus atomically clear the bits of the branches they generate testcases for,
+     so that no other qemu drills the same branch again. */
+
+  u8* drill_bits = shmat(drill_shm_id, NULL, 0);
+
+  if (drill_bits == (void*)-1) PFATAL("shmat() failed");
+
+  memset(drill_bits, 255, map_size);
+  shmdt(drill_bits);
+
+  virgin_shm_str = alloc_printf("%d", drill_shm_id);
+  if (!dumb_mode) setenv(DRILL_SHM_ENV_VAR, virgin_shm_str, 1);
+  ck_free(virgin_shm_str);
 
 #endif
 
@@ -2374,7 +3139,15 @@ EXP_ST void init_forkserver(char** argv) {
  * only happens when checking qemu status in writing test case. */
 
 static u8 run_target(char** argv) {
-    memset(curQemu->trace_bits, 0, MAP_SIZE);
+    if (batch_holding) { // the testcase only joined the pending batch
+        batch_holding = 0;
+        return FAULT_NONE;
+    }
+
+    u32 k;
+    for (k = 0; k < curQemu->batch_n; k++)
+        reset_trace(curQemu->trace_base + k * map_size,
+                    curQemu->dirty_base + k * TRACE_DIRTY_SIZE(map_size));
     MEM_BARRIER();
 
     s32 res;
@@ -2405,7 +3178,12 @@ static u8 run_target(char** argv) {
         break;// never reach here
     }
     curQemu->start_us = get_cur_time_us();
-    ReadArray[curQemu->pid] = 0;
+    curQemu->alive_us = curQemu->start_us;
+    curQemu->hang_us = MAX((u64)qemu_hang_sec * 1000000,
+                           (u64)exec_tmout * 1000 * curQemu->batch_n * QEMU_HANG_MULT);
+    if (curQemu->stats)
+        curQemu->drill_mark = curQemu->stats->drilled + curQemu->stats->drill_skipped;
+    curQemu->busy = 1;
     curQemu->handled = 0;
     if ((res = write(CTRLPIPE(curQemu->pid) + 1, tmp, 4)) != 4) {
         if (stop_soon) return 0;
@@ -2432,7 +3210,7 @@ static u8 run_target(char** argv) {
      must prevent any earlier operations from venturing into that
      territory. */
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   /* If we're running in "dumb" mode, we can't rely on the fork server
@@ -2624,27 +3402,161 @@ static void check_qemu_tracebits(QemuInstance* qemu)
 {
     // avoid compiler accesses registers and cache.
     MEM_BARRIER();
-    // set the loop bucket
+    // set the loop bucket, and check for new coverage while at it
+    qemu->new_bits = classify_and_check(qemu->trace_bits, qemu->dirty,
+        qemu->fault == crash_mode ? virgin_bits : NULL,
+        qemu->cur_stage == STAGE_CALIBRATE ? &qemu->cksum : NULL);
+    if (qemu->cur_stage == STAGE_SYNC) {
+        syncing_party = qemu->sync_party;
+        syncing_case = qemu->sync_case;
+    }
+    u8 res = save_if_interesting(NULL, (qemu->out_file), (qemu->len), qemu->fault, qemu);
+    if (qemu->cur_stage == STAGE_SYNC) {
+        queued_imported += res;
+        syncing_party = 0;
+    } else
+        queued_discovered += res;
+}
+
+#ifdef __x86_64__
+
+/* Flag the bytes where two traces differ in var_bytes, a vector at a time like
+   the bitmap scans. */
+
+static AVX2_FN void mark_var_bytes_avx2(u8* first, u8* cur) {
+
+  u32 i, n = map_size >> 5;
+
+  for (i = 0; i < n; i++) {
+
+    u32 ne = ~_mm256_movemask_epi8(
+               _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(first + (i << 5))),
+                                 _mm256_loadu_si256((__m256i*)(cur + (i << 5)))));
+
+    while (unlikely(ne)) {
+      var_bytes[(i << 5) + __builtin_ctz(ne)] = 1;
+      ne &= ne - 1;
+    }
+
+  }
+
+}
+
+
+static void mark_var_bytes_sse2(u8* first, u8* cur) {
+
+  u32 i, n = map_size >> 4;
+
+  for (i = 0; i < n; i++) {
+
+    u32 ne = 0xffff ^ _mm_movemask_epi8(
+               _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(first + (i << 4))),
+                              _mm_loadu_si128((__m128i*)(cur + (i << 4)))));
+
+    while (unlikely(ne)) {
+      var_bytes[(i << 4) + __builtin_ctz(ne)] = 1;
+      ne &= ne - 1;
+    }
+
+  }
+
+}
+
+#endif /* __x86_64__ */
+
+
+static void mark_var_bytes(u8* first, u8* cur) {
+
 #ifdef __x86_64__
-    classify_counts((u64*)qemu->trace_bits);
+
+  if (use_avx2) mark_var_bytes_avx2(first, cur);
+  else mark_var_bytes_sse2(first, cur);
+
 #else
-    classify_counts((u32*) qemu->trace_bits);
+
+  u32 i, j;
+
+  for (i = 0; i < (map_size >> 2); i++) {
+
+    if (((u32*)first)[i] == ((u32*)cur)[i]) continue;
+
+    for (j = 0; j < 4; j++)
+      if (first[(i << 2) + j] != cur[(i << 2) + j]) var_bytes[(i << 2) + j] = 1;
+
+  }
+
 #endif /* ^__x86_64__ */
-    u8 res = save_if_interesting(NULL, (qemu->out_file), (qemu->len), qemu->fault, qemu);
-    queued_discovered += res;
 
-    if (qemu->out_file) {
-        free(qemu->out_file); // avoid memory leak
-        qemu->out_file = NULL;
+}
+
+/*
+ * Wrap up the calibration of q once every dispatched run is accounted for. If
+ * none of them executed, the entry is left for fuzz_one() to calibrate again.
+ */
+static void calibrate_finish(struct queue_entry* q)
+{
+    if (!q->cal_done) {
+        q->cal_failed++;
+        return;
+    }
+
+    q->exec_us = q->cal_us / q->cal_done;
+    q->cal_failed = 0;
+
+    total_cal_us += q->cal_us;
+    total_cal_cycles += q->cal_done;
+    total_bitmap_size += q->bitmap_size;
+    total_bitmap_entries++;
+
+    update_bitmap_score(q);
+
+    ck_free(q->cal_trace);
+    q->cal_trace = NULL;
+}
+
+/*
+ * Fold one calibration run into its queue entry. A trace that differs from the
+ * first run's marks the entry variable; the differing bytes are found with the
+ * bitmap scans' vector code. Calibration runs bypass the testcase filter, but without an input
+ * buffer qemu cannot tell them apart; runs reported redundant did not execute
+ * and are not counted.
+ */
+static void calibrate_done(QemuInstance* qemu)
+{
+    struct queue_entry* q = qemu->cur_queue;
+
+    if (!q || q->cal_done >= q->cal_pending) return;
+
+    if (qemu->fault == FAULT_REDUNDANT) {
+        q->cal_pending--;
+    } else if (!q->cal_done++) {
+        q->cal_us = qemu->stop_us - qemu->start_us;
+        q->exec_cksum = qemu->cksum;
+        q->bitmap_size = count_trace_bytes(qemu->trace_bits, qemu->dirty);
+        q->cal_trace = ck_alloc_nozero(map_size);
+        memcpy(q->cal_trace, qemu->trace_bits, map_size);
+    } else {
+        q->cal_us += qemu->stop_us - qemu->start_us;
+        if (qemu->cksum != q->exec_cksum) {
+            mark_var_bytes(q->cal_trace, qemu->trace_bits);
+            var_byte_count = count_bytes(var_bytes);
+            if (!q->var_behavior) {
+                mark_as_variable(q);
+                queued_variable++;
+            }
+        }
     }
-    qemu->len = 0;
-    qemu->cur_queue = NULL;
+
+    if (q->cal_done < q->cal_pending) return;
+
+    calibrate_finish(q);
 }
 
 static void do_extra_handles(QemuInstance* qemu)
 {
     switch (qemu->cur_stage) {
         case STAGE_CALIBRATE:
+            calibrate_done(qemu);
             break;
         case STAGE_SYNC:
             if (!sync_id)
@@ -2692,145 +3604,187 @@ static void do_extra_handles(QemuInstance* qemu)
 // When finding a qemu has finished its job, try to analyze the result.
 void handle_onetestdone(QemuInstance* done_qemu) {
     //OKF("start onetestdone.");
-    check_qemu_tracebits(done_qemu);
-    do_extra_handles(done_qemu);
+    curQemu = done_qemu; // has_new_bits() looks at curQemu
+    if (done_qemu->batch_n > 1) {
+        // One result per mutant, each with its own trace map
+        u8* files = done_qemu->out_file;
+        u64 start_us = done_qemu->start_us;
+        u32 k;
+        for (k = 0; k < done_qemu->batch_n; k++) {
+            QemuBatchResult* res = &done_qemu->input_buf->results[k];
+            done_qemu->trace_bits = done_qemu->trace_base + k * map_size;
+            done_qemu->dirty = done_qemu->dirty_base + k * TRACE_DIRTY_SIZE(map_size);
+            done_qemu->out_file = files + k * done_qemu->len;
+            done_qemu->fault = res->fault;
+            done_qemu->mod_off = done_qemu->batch_off[k];
+            done_qemu->stop_us = done_qemu->start_us + res->exec_us;
+            check_qemu_tracebits(done_qemu);
+            do_extra_handles(done_qemu);
+            done_qemu->start_us += res->exec_us;
+            total_execs++;
+        }
+        done_qemu->trace_bits = done_qemu->trace_base;
+        done_qemu->dirty = done_qemu->dirty_base;
+        done_qemu->out_file = files;
+        done_qemu->start_us = start_us;
+    } else {
+        check_qemu_tracebits(done_qemu);
+        do_extra_handles(done_qemu);
+        total_execs++;
+    }
+    if (done_qemu->out_file) {
+        free(done_qemu->out_file); // avoid memory leak
+        done_qemu->out_file = NULL;
+    }
+    done_qemu->len = 0;
     done_qemu->cur_queue = NULL;
     done_qemu->handled = 1;
-    total_execs++;
     //show_stats();
     //OKF("end onetestdone.");
     return;
 }
 
-/* Write modified data to file for testing. If out_file is set, the old file
-   is unlinked and a new one is created. Otherwise, out_fd is rewound and
-   truncated. */
 /*
- * Change Log:
- * When writing test case to file, first check which qemu is ready then write file to its
- *    test case directory.
+ * Block until some qemu reports back through the completion ring, then mark it
+ * as free and fill in the stop time and fault of its last test.
  */
+static QemuInstance* wait_qemu_done(void) {
+    QemuDoneRecord rec;
+    u8 i;
+    while (1) {
+        PARAL_QEMU(Supervise)();
+        if (!PARAL_QEMU(PopDone)(&rec, QEMURING_WAIT_MS))
+            continue;
+        for (i = 0; i < parallel_qemu_num; i++) {
+            if (rec.pid == allQemus[i].pid)
+                break;
+        }
+        // Left behind by a qemu that has been restarted or retired since.
+        if (i >= parallel_qemu_num)
+            continue;
+        QemuInstance* qemu = &allQemus[i];
+        if (!qemu->trace_base) // ready handshake
+            PARAL_QEMU(attachTracebits)(qemu);
+        if (qemu->start_us) { // not the first run
+            qemu->stop_us = qemu->start_us + rec.exec_us;
+            PARAL_QEMU(RecordPhase)(qemu->stats, QPHASE_DISPATCH,
+                                    get_cur_time_us() - qemu->start_us);
+        }
+        qemu->fault = rec.fault;
+        qemu->busy = 0;
+        return qemu;
+    }
+}
 
-#define GETQUEUEITEM(_buffer, _pid, _fault, _exectime) \
-    do { \
-		char* token = strtok(_buffer, "|"); \
-		if (!token) {                   \
-		    _pid = _fault = _exectime = 0; \
-		    break;                      \
-		}                           \
-		_pid        = atoi(token); \
-		token       = strtok(NULL, "|"); \
-		_fault      = atoi(token); \
-		token       = strtok(NULL, "|"); \
-		_exectime   = atol(token); \
-    }while(0)
+static void flush_batch(void);
 
-#endif
+/*
+ * The supervisor is about to restart a qemu with a test in flight, whose result
+ * will never come. A lost calibration run is not waited for any longer.
+ */
+void process_lost_qemu(QemuInstance* qemu) {
+    struct queue_entry* q = qemu->cur_queue;
 
-#ifdef CONFIG_S2E
+    if (qemu->cur_stage != STAGE_CALIBRATE || !q || q->cal_done >= q->cal_pending)
+        return;
+
+    if (--q->cal_pending <= q->cal_done) calibrate_finish(q);
+}
 
 /*
  * After waiting for all qemus are free, some unhandled qemus will be processed through this
  * procedure so that we are NOT missing critical results before next test starts.
  */
 void process_unhandled_qemus(void) {
-    int tarQemuPid;
-    u8 fault, i;
-    u64 execTime;
-    while (1) {
-        u8 buffer[FIFOBUFFERSIZE + 1];
-        if(read(qemu_quene_fd, buffer, FIFOBUFFERSIZE) == -1) {
-            if(errno == EAGAIN) //XXX: unexpected interrupt
-                break;
-        } else {
-            tarQemuPid = 0;
-            fault = 0;
-            execTime = 0;
-            GETQUEUEITEM(buffer, tarQemuPid, fault, execTime);
-            i = 0;
-            while (i < parallel_qemu_num) {
-                if(tarQemuPid == allQemus[i].pid){
-                    if (allQemus[i].handled){
-                        i++;
-                        continue;
-                    }
-                    QemuInstance* tmp_qemu = &allQemus[i];
-                    if (tmp_qemu && tmp_qemu->out_file){
-                        tmp_qemu->stop_us = tmp_qemu->start_us + execTime;
-                        tmp_qemu->fault = fault;
-                        handle_onetestdone(tmp_qemu);
-                    }
-                    break;
-                }
-                i++;
-            }
+    u8 i = 0;
+    flush_batch();
+    while (i < parallel_qemu_num) {
+        if (!allQemus[i].busy) {
+            i++;
+            continue;
         }
+        QemuInstance* tmp_qemu = wait_qemu_done();
+        if (!tmp_qemu->handled && tmp_qemu->out_file)
+            handle_onetestdone(tmp_qemu);
+        i = 0;
     }
 }
 
-
+/* Write modified data to file for testing. If out_file is set, the old file
+   is unlinked and a new one is created. Otherwise, out_fd is rewound and
+   truncated. */
 /*
- * When writing testcase in multi-qemu mode, first check which qemu is free,
- * then parse the corresponding testcase directory and throw testcase there.
+ * Change Log:
+ * When writing test case to file, first check which qemu is ready then write file to its
+ *    test case directory.
+ */
+
+/*
+ * Pick the qemu to feed next: round robin right after all qemus were waited for,
+ * otherwise the first one reporting back. Its previous result is analyzed here.
  */
-//FIXME: bad goto
-static void write_to_testcase(void* mem, u32 len, struct queue_entry* cur, u8 cur_stage, u32 off) {
-  u8 buffer[FIFOBUFFERSIZE + 1];
-  int tarQemuPid = 0;
-  u8 fault = 0;
-  u64 execTime = 0;
+static QemuInstance* next_free_qemu(void) {
+  QemuInstance* qemu;
   if (isAfterWait){
-      curQemu = &allQemus[currentQemuAfterWait++];
+      qemu = &allQemus[currentQemuAfterWait++];
       if (currentQemuAfterWait == parallel_qemu_num) {
           isAfterWait = 0;
           currentQemuAfterWait = 0;
       }
-      goto write;
+      if (!qemu->busy) {
+          if (qemu->start_us && !qemu->handled)
+              handle_onetestdone(qemu); // Perform result analysis here!
+          return qemu;
+      }
+      // Restarted while we were waiting for the others, it is still booting.
+      isAfterWait = 0;
+      currentQemuAfterWait = 0;
   }
 
-  while(!tarQemuPid){
-	  memset(buffer, '\0', sizeof(buffer));
-	  if(read(qemu_quene_fd, buffer, FIFOBUFFERSIZE) == -1) { // we should be blocked here so that we can get a free qemu
-		  //if(errno == EAGAIN) //XXX: avoid interrupt
-	      sleep(0.001);
-	      continue;
-	  }
-	  GETQUEUEITEM(buffer, tarQemuPid, fault, execTime);
-  }
   /*
    *  Touch this means all qemu are free and already handled, so what
    *  needs to done is only to feed the qemus. This also will not bring starvation
    *  because mutation is much more faster than perform a real test in full system mode.
+   *  A free qemu may get retired when scaling down, then we wait for another one.
    */
-  u8 i = 0;
-  while (i < parallel_qemu_num) {
-      if(tarQemuPid == allQemus[i].pid){
-          curQemu = &allQemus[i];
-          break;
-      }
-      i++;
-  }
-  if(curQemu->start_us){ // not the first run
-      curQemu->stop_us = curQemu->start_us + execTime;
-  }
-  if (i >= parallel_qemu_num)
-  // Assert target qemu id is available now.
-      FATAL("Cannot find the target qemu, quitting.");
-  while(!ReadArray[curQemu->pid]) {
-      sleep(0.001);
-  }
+  do {
+      qemu = wait_qemu_done();
+      if (qemu->start_us && !qemu->handled)
+          handle_onetestdone(qemu); // Perform result analysis here!
+  } while (PARAL_QEMU(Rescale)(qemu));
 
-write:
-  curQemu->cur_queue = cur;
-  curQemu->cur_stage = cur_stage;
-  curQemu->fault = fault;
+  return qemu;
+}
 
+/*
+ * Hand count testcases of len bytes each to the input buffer of curQemu, or
+ * write the single testcase to its directory if it does not fit.
+ */
+static void put_testcase(void* mem, u32 len, u32 count) {
 
-  if (curQemu->start_us && !curQemu->handled)
-	  handle_onetestdone(curQemu); // Perform result analysis here!
+  curQemu->out_file = (u8*)malloc(len * count); // freed when checking qemu's tracebits.
+  memcpy(curQemu->out_file, mem, len * count);
+  curQemu->len = len;
+  curQemu->batch_n = count;
 
-  if (cur_stage == STAGE_FLIP8)
-      curQemu->mod_off = off;
+  QemuInputBuf* ib = curQemu->input_buf;
+  u32 flags = curQemu->cur_stage == STAGE_CALIBRATE ? INPUTSHM_F_CALIBRATE : 0;
+
+  if (ib && len * count <= INPUTSHM_SIZE) {
+      // Fill the spare half, then flip so that qemu never sees a partial testcase.
+      u32 spare = ib->cur ^ 1;
+      memcpy(ib->buf[spare].data, mem, len * count);
+      ib->buf[spare].len = len;
+      ib->buf[spare].count = count;
+      ib->buf[spare].flags = flags;
+      MEM_BARRIER();
+      ib->cur = spare;
+      ib->seq++;
+      return;
+  }
+
+  if (count > 1)
+      FATAL("Batch of %u testcases does not fit in the input buffer", count);
 
   u8 tc_out_file[128];
   sprintf(tc_out_file, "%s%s", curQemu->testcaseDir, basename(out_file));
@@ -2839,13 +3793,111 @@ write:
   s32 fd = open(tc_out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
   if (fd < 0) PFATAL("Unable to create '%s'", tc_out_file);
 
-  curQemu->out_file = (u8*)malloc(len); // freed when checking qemu's tracebits.
-  memcpy(curQemu->out_file, mem, len);
-  curQemu->len = len;
-
   ck_write(fd, mem, len, tc_out_file);
 
   close(fd);
+
+  if (ib) {
+      u32 spare = ib->cur ^ 1;
+      ib->buf[spare].len = INPUTSHM_INFILE;
+      ib->buf[spare].count = 1;
+      ib->buf[spare].flags = flags;
+      MEM_BARRIER();
+      ib->cur = spare;
+      ib->seq++;
+  }
+}
+
+/* Deterministic stages keep the length of the parent, so their mutants can be batched. */
+
+static u8 batchable_stage(u8 stage) {
+  return stage >= STAGE_FLIP1 && stage <= STAGE_INTEREST32;
+}
+
+/* Dispatch the pending batch, if any, to the next free qemu. A qemu without an
+   input buffer can only take one testcase at a time, so it gets the mutants
+   one by one, as do whichever qemus are free next. */
+
+static void flush_batch(void) {
+
+  u32 n = batch_n, k;
+
+  if (!batch_n) return;
+
+  curQemu = next_free_qemu();
+
+  if (!curQemu->input_buf) {
+
+    batch_n = 0;
+
+    for (k = 0; k < n; k++) {
+
+      if (k) curQemu = next_free_qemu();
+      curQemu->cur_queue = batch_cur;
+      curQemu->cur_stage = batch_stage;
+      if (batch_stage == STAGE_FLIP8)
+        curQemu->mod_off = batch_off[k];
+      put_testcase(batch_buf + k * batch_len, batch_len, 1);
+
+      run_target(NULL);
+
+    }
+
+    return;
+
+  }
+
+  curQemu->cur_queue = batch_cur;
+  curQemu->cur_stage = batch_stage;
+  memcpy(curQemu->batch_off, batch_off, sizeof(s32) * batch_n);
+  put_testcase(batch_buf, batch_len, batch_n);
+  batch_n = 0;
+
+  run_target(NULL);
+
+}
+
+/*
+ * When writing testcase in multi-qemu mode, first check which qemu is free,
+ * then parse the corresponding testcase directory and throw testcase there.
+ * With batching on, mutants of the deterministic stages are collected first
+ * and dispatched qemu_batch at a time.
+ */
+static void write_to_testcase(void* mem, u32 len, struct queue_entry* cur, u8 cur_stage, u32 off) {
+
+  if (qemu_batch > 1 && batchable_stage(cur_stage) &&
+      len * qemu_batch <= INPUTSHM_SIZE) {
+
+    if (batch_n && (batch_cur != cur || batch_stage != cur_stage || batch_len != len))
+      flush_batch();
+
+    if (!batch_buf) batch_buf = ck_alloc(INPUTSHM_SIZE);
+
+    memcpy(batch_buf + batch_n * len, mem, len);
+    batch_off[batch_n++] = cur_stage == STAGE_FLIP8 ? (s32)off : -1;
+    batch_len   = len;
+    batch_cur   = cur;
+    batch_stage = cur_stage;
+
+    if (batch_n == qemu_batch) {
+      flush_batch();
+    }
+
+    batch_holding = 1;
+    return;
+
+  }
+
+  flush_batch();
+
+  curQemu = next_free_qemu();
+  curQemu->cur_queue = cur;
+  curQemu->cur_stage = cur_stage;
+
+  if (cur_stage == STAGE_FLIP8)
+      curQemu->mod_off = off;
+
+  put_testcase(mem, len, 1);
 }
 
 #else
@@ -2921,7 +3973,7 @@ static void show_stats(void);
 static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
                          u32 handicap, u8 from_queue) {
 
-  static u8 first_trace[MAP_SIZE];
+  static u8* first_trace;
 
   u8  fault = 0, new_bits = 0, var_detected = 0,
       first_run = (q->exec_cksum == 0);
@@ -2950,7 +4002,9 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
   if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
     init_forkserver(argv);
 
-  if (q->exec_cksum) memcpy(first_trace, trace_bits, MAP_SIZE);
+  if (!first_trace) first_trace = ck_alloc_nozero(map_size);
+
+  if (q->exec_cksum) memcpy(first_trace, trace_bits, map_size);
 
   start_us = get_cur_time_us();
 
@@ -2974,7 +4028,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
       goto abort_calibration;
     }
 
-    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    cksum = hash32(trace_bits, map_size, HASH_CONST);
 
     if (q->exec_cksum != cksum) {
 
@@ -2985,7 +4039,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 
         u32 i;
 
-        for (i = 0; i < MAP_SIZE; i++) {
+        for (i = 0; i < map_size; i++) {
 
           if (!var_bytes[i] && first_trace[i] != trace_bits[i]) {
 
@@ -3001,7 +4055,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
       } else {
 
         q->exec_cksum = cksum;
-        memcpy(first_trace, trace_bits, MAP_SIZE);
+        memcpy(first_trace, trace_bits, map_size);
 
       }
 
@@ -3065,10 +4119,11 @@ abort_calibration:
 }
 
 #else
-// Assume the case has no variable behavior, so execute each just once time.
 /*
- * Calibration updates some global variables lile total_cal_us, while this update should be processed
- * when checking qemu traces in order to obtain correct score.
+ * Dispatch CAL_CYCLES_S2E runs of the case, which land on whichever qemus are
+ * free, and return without waiting. calibrate_done() folds the results in as
+ * they come back and updates the entry and the global counters once the last
+ * one has arrived.
  */
 static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
                          u32 handicap, u8 from_queue) {
@@ -3095,11 +4150,32 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
   if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
     init_forkserver(argv);
 
-  write_to_testcase(use_mem, q->len, q, STAGE_CALIBRATE, 0);
+  /* A calibration that never completed may have left its first trace. */
+  ck_free(q->cal_trace);
+  q->cal_trace = NULL;
 
-  fault = run_target(argv);
+  q->handicap    = handicap;
+  q->cal_pending = CAL_CYCLES_S2E;
+  q->cal_done    = 0;
+  q->cal_us      = 0;
+
+  stage_max = CAL_CYCLES_S2E;
+
+  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
+
+    write_to_testcase(use_mem, q->len, q, STAGE_CALIBRATE, 0);
+
+    fault = run_target(argv);
+
+    if (stop_soon) {
+      /* Do not wait for runs that never went out. */
+      q->cal_pending -= stage_max - stage_cur - 1;
+      if (q->cal_done >= q->cal_pending) calibrate_finish(q);
+      break;
+    }
+
+  }
 
-  q->cal_failed  = 0;
   stage_name = old_sn;
   stage_cur  = old_sc;
   stage_max  = old_sm;
@@ -3119,7 +4195,7 @@ static void check_map_coverage(void) {
 
   if (count_bytes(trace_bits) < 100) return;
 
-  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
+  for (i = map_size >> 1; i < map_size; i++)
     if (trace_bits[i]) return;
 
   WARNF("Recompile binary with newer version of afl to improve coverage!");
@@ -3375,6 +4451,37 @@ static void link_or_copy(u8* old_path, u8* new_path) {
 
 static void nuke_resume_dir(void);
 
+#ifdef CONFIG_S2E
+
+/* Make a queue entry visible to peers as queue/.state/ids/<id>, so that they
+   can pick up new entries by id without listing the queue. The shared virgin
+   map is updated first: once a peer sees the id, the coverage is in there. */
+
+static void publish_queue_entry(u8* fn, u32 id) {
+
+  u8* idfn;
+
+  if (!sync_id) return;
+
+  if (sync_virgin) {
+
+    u64* g = (u64*)sync_virgin;
+    u64* l = (u64*)virgin_bits;
+    u32  i = (map_size >> 3);
+
+    while (i--)
+      if (g[i] & ~l[i]) __sync_fetch_and_and(&g[i], l[i]);
+
+  }
+
+  idfn = alloc_printf("%s/queue/.state/ids/%06u", out_dir, id);
+  if (link(fn, idfn) && errno != EEXIST) PFATAL("Unable to link '%s'", idfn);
+  ck_free(idfn);
+
+}
+
+#endif /* CONFIG_S2E */
+
 /* Create hard links for input test cases in the output directory, choosing
    good names and pivoting accordingly. */
 
@@ -3461,6 +4568,7 @@ static void pivot_inputs(void) {
     if(strcmp(q->fname,nfn)){
     	remove(q->fname);
     }
+    publish_queue_entry(nfn, id);
 #endif
     ck_free(q->fname);
     q->fname = nfn;
@@ -3598,7 +4706,14 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
     /* Keep only if there are new bits in the map, add to queue for
        future fuzzing, etc. */
 
-    if (!(hnb = has_new_bits(virgin_bits))) {
+#ifdef CONFIG_S2E
+    /* Already checked along with classify_counts(). */
+    hnb = qemu->new_bits;
+#else
+    hnb = has_new_bits(virgin_bits);
+#endif
+
+    if (!hnb) {
       if (crash_mode) total_crashes++;
 #ifdef CONFIG_S2E
       qemu->cover_new = 0;
@@ -3606,6 +4721,14 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
       return 0;
     }    
 
+#ifdef CONFIG_S2E
+    qemu->cover_new = 1;
+
+    /* Calibrated entries are queued already, see calibrate_done(). */
+
+    if (qemu->cur_stage == STAGE_CALIBRATE) return 0;
+#endif
+
 #ifndef SIMPLE_FILES
 
     fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
@@ -3617,10 +4740,6 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
 #endif /* ^!SIMPLE_FILES */
 
-#ifdef CONFIG_S2E
-    qemu->cover_new = 1;
-    if (qemu->cur_stage != STAGE_CALIBRATE) // avoid repeating adding to queue at startup
-#endif
     add_to_queue(fn, len, 0);
 
     if (hnb == 2) {
@@ -3629,25 +4748,18 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
     }
 
 #ifndef CONFIG_S2E
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    queue_top->exec_cksum = hash32(trace_bits, map_size, HASH_CONST);
 #endif
 
 
 #ifdef CONFIG_S2E
     /* Calculate average execution here to keep path with the update of queue_top. */
-    struct queue_entry * q_mod;
-    if (qemu->cur_stage == STAGE_CALIBRATE) {
-        if (!qemu->cur_queue)
-            PFATAL("current queue should be set for calibration");
-        q_mod = qemu->cur_queue;
-    } else {
-        q_mod = queue_top;
-    }
+    struct queue_entry * q_mod = queue_top;
     q_mod->exec_us = (qemu->stop_us - qemu->start_us);
-    q_mod->bitmap_size = count_bytes(qemu->trace_bits);
-    q_mod->handicap = (qemu->cur_stage == STAGE_CALIBRATE) ? 0 : queue_cycle -1;
+    q_mod->bitmap_size = count_trace_bytes(qemu->trace_bits, qemu->dirty);
+    q_mod->handicap = queue_cycle -1;
     q_mod->cal_failed = 0;
-    q_mod->exec_cksum = hash32(qemu->trace_bits, MAP_SIZE, HASH_CONST);
+    q_mod->exec_cksum = trace_cksum(qemu->trace_bits, qemu->dirty);
     /* Give up calibration when combining with symbex. */
 	total_cal_us += qemu->stop_us - qemu->start_us;
     total_cal_cycles += 1; // trick: regard current test as the calibration, so we add only 1
@@ -3669,6 +4781,10 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
     ck_write(fd, mem, len, fn);
     close(fd);
 
+#ifdef CONFIG_S2E
+    publish_queue_entry(fn, queued_paths - 1);
+#endif
+
     keeping = 1;
 
   }
@@ -3694,6 +4810,8 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 #else
         simplify_trace((u32*)curQemu->trace_bits);
 #endif /* ^__x86_64__ */
+        /* Untouched bytes are now 1s, so the next reset must cover them. */
+        memset(curQemu->dirty, 0xff, TRACE_DIRTY_SIZE(map_size));
 #else
 #ifdef __x86_64__
         simplify_trace((u64*)trace_bits);
@@ -3741,6 +4859,8 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 #else
         simplify_trace((u32*)curQemu->trace_bits);
 #endif /* ^__x86_64__ */
+        /* Untouched bytes are now 1s, so the next reset must cover them. */
+        memset(curQemu->dirty, 0xff, TRACE_DIRTY_SIZE(map_size));
 #else
 #ifdef __x86_64__
         simplify_trace((u64*)trace_bits);
@@ -3936,6 +5056,56 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              exec_tmout, use_banner, orig_cmdline);
              /* ignore errors */
 
+#ifdef CONFIG_S2E
+
+  /* Totals over all qemus, see qemu_data for the per-qemu figures. */
+
+  u64 q_cases = 0, q_redundant = 0, q_filtered = 0, q_drilled = 0,
+      q_solve_us = 0, q_exec_us = 0, q_execs = 0, q_edges = 0,
+      q_collisions = 0;
+  u8 i;
+
+  for (i = 0; i < parallel_qemu_num; i++) {
+
+    QemuStats* qs = allQemus[i].stats;
+    if (!qs) continue;
+
+    q_cases     += qs->testcases;
+    q_redundant += qs->redundant;
+    q_filtered  += qs->phase[QPHASE_FILTER].count;
+    q_drilled   += qs->drilled;
+    q_solve_us  += qs->phase[QPHASE_SOLVE].total_us;
+    q_exec_us   += qs->phase[QPHASE_EXEC].total_us;
+    q_execs     += qs->phase[QPHASE_EXEC].count;
+
+    /* Every qemu sees about the same edges, they are not summed up. */
+
+    if (qs->edges > q_edges) q_edges = qs->edges;
+    q_collisions += qs->collisions;
+
+  }
+
+  fprintf(f, "qemu_count        : %u\n"
+             "qemu_testcases    : %llu\n"
+             "qemu_redundant    : %llu\n"
+             "qemu_filter_hit   : %0.02f%%\n"
+             "qemu_drilled      : %llu\n"
+             "qemu_solve_ms     : %llu\n"
+             "qemu_avg_exec_us  : %llu\n"
+             "qemu_restarts     : %u\n"
+             "symbex_dupes      : %u\n"
+             "sync_skipped      : %u\n"
+             "map_size          : %u\n"
+             "qemu_edges        : %llu\n"
+             "qemu_collisions   : %llu\n",
+             parallel_qemu_num, q_cases, q_redundant,
+             q_filtered ? ((double)q_redundant) * 100 / q_filtered : 0,
+             q_drilled, q_solve_us / 1000,
+             q_execs ? q_exec_us / q_execs : 0, qemu_restarts, symbex_dupes, sync_skipped,
+             map_size, q_edges, q_collisions);
+
+#endif /* CONFIG_S2E */
+
   fclose(f);
 
 }
@@ -3979,6 +5149,47 @@ static void maybe_update_plot_file(double bitmap_cvg, double eps) {
 }
 
 
+#ifdef CONFIG_S2E
+
+/* Append one line per qemu to qemu_data. */
+
+static void update_qemu_file(void) {
+
+  u64 now = get_cur_time() / 1000;
+  u8 i;
+
+  /* Fields in the file:
+
+     unix_time, qemu_pid, testcases, redundant, drilled, drill_skipped,
+     then p50/p99 (us) of wait, filter, copy, exec, tell, solve, dispatch */
+
+  for (i = 0; i < parallel_qemu_num; i++) {
+
+    QemuStats* qs = allQemus[i].stats;
+    u32 ph;
+
+    if (!qs) continue;
+
+    fprintf(qemu_file, "%llu, %u, %llu, %llu, %llu, %llu", now,
+            allQemus[i].pid, qs->testcases, qs->redundant, qs->drilled,
+            qs->drill_skipped);
+
+    for (ph = 0; ph < QPHASE_COUNT; ph++)
+      fprintf(qemu_file, ", %llu, %llu",
+              PARAL_QEMU(PhasePercentile)(&qs->phase[ph], 50),
+              PARAL_QEMU(PhasePercentile)(&qs->phase[ph], 99));
+
+    fprintf(qemu_file, "\n"); /* ignore errors */
+
+  }
+
+  fflush(qemu_file);
+
+}
+
+#endif /* CONFIG_S2E */
+
+
 
 /* A helper function for maybe_delete_out_dir(), deleting all prefixed
    files in a directory. */
@@ -4268,6 +5479,12 @@ static void maybe_delete_out_dir(void) {
   if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
   ck_free(fn);
 
+#ifdef CONFIG_S2E
+  fn = alloc_printf("%s/queue/.state/ids", out_dir);
+  if (delete_files(fn, NULL)) goto dir_cleanup_failed;
+  ck_free(fn);
+#endif /* CONFIG_S2E */
+
   /* Then, get rid of the .state subdirectory itself (should be empty by now)
      and everything matching <out_dir>/queue/id:*. */
 
@@ -4372,6 +5589,12 @@ static void maybe_delete_out_dir(void) {
   if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
   ck_free(fn);
 
+#ifdef CONFIG_S2E
+  fn = alloc_printf("%s/qemu_data", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+#endif
+
   OKF("Output dir cleanup successful.");
 
   /* Wow... is that all? If yes, celebrate! */
@@ -4455,7 +5678,7 @@ static void show_stats(void) {
   /* Do some bitmap stats. */
 
   t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+  t_byte_ratio = ((double)t_bytes * 100) / map_size;
 
   if (t_bytes) 
     stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
@@ -4479,6 +5702,9 @@ static void show_stats(void) {
 
     last_plot_ms = cur_ms;
     maybe_update_plot_file(t_byte_ratio, avg_exec);
+#ifdef CONFIG_S2E
+    update_qemu_file();
+#endif
  
   }
 
@@ -4495,7 +5721,7 @@ static void show_stats(void) {
 
   /* Compute some mildly useful bitmap stats. */
 
-  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+  t_bits = (map_size << 3) - count_bits(virgin_bits);
 
   /* Now, for the visuals... */
 
@@ -4630,7 +5856,7 @@ static void show_stats(void) {
   SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
 
   sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
-          100 / MAP_SIZE, t_byte_ratio);
+          100 / map_size, t_byte_ratio);
 
   SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
        ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
@@ -4986,7 +6212,7 @@ static u32 next_p2(u32 val) {
 static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   static u8 tmp[64];
-  static u8 clean_trace[MAP_SIZE];
+  static u8* clean_trace;
 
   u8  needs_write = 0, fault = 0;
   u32 trim_exec = 0;
@@ -4999,6 +6225,8 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   if (q->len < 5) return 0;
 
+  if (!clean_trace) clean_trace = ck_alloc_nozero(map_size);
+
   stage_name = tmp;
   bytes_trim_in += q->len;
 
@@ -5034,7 +6262,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
       /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       /* If the deletion had no impact on the trace, make it permanent. This
          isn't perfect for variable-path inputs, but we're just making a
@@ -5057,7 +6285,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
         if (!needs_write) {
 
           needs_write = 1;
-          memcpy(clean_trace, trace_bits, MAP_SIZE);
+          memcpy(clean_trace, trace_bits, map_size);
 
         }
 
@@ -5090,7 +6318,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
     ck_write(fd, in_buf, q->len, q->fname);
     close(fd);
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
+    memcpy(trace_bits, clean_trace, map_size);
     update_bitmap_score(q);
 
   }
@@ -5435,111 +6663,268 @@ static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le) {
 
     for (j = 0; j < sizeof(interesting_16) / 2; j++) {
 
-      u32 tval = (old_val & ~(0xffff << (i * 8))) |
-                 (((u16)interesting_16[j]) << (i * 8));
+      u32 tval = (old_val & ~(0xffff << (i * 8))) |
+                 (((u16)interesting_16[j]) << (i * 8));
+
+      if (new_val == tval) return 1;
+
+      /* Continue here only if blen > 2. */
+
+      if (blen > 2) {
+
+        tval = (old_val & ~(0xffff << (i * 8))) |
+               (SWAP16(interesting_16[j]) << (i * 8));
+
+        if (new_val == tval) return 1;
+
+      }
+
+    }
+
+  }
+
+  if (blen == 4 && check_le) {
+
+    /* See if four-byte insertions could produce the same result
+       (LE only). */
+
+    for (j = 0; j < sizeof(interesting_32) / 4; j++)
+      if (new_val == (u32)interesting_32[j]) return 1;
+
+  }
+
+  return 0;
+
+}
+
+#ifdef CONFIG_S2E
+
+/* Symbex testcases waiting to be imported, in arrival order. */
+
+struct symbex_case {
+  u8* name;
+  struct symbex_case* next;
+};
+
+static struct symbex_case *symbex_head, *symbex_tail;
+
+/* Content keys (length << 32 | hash32) of every testcase imported so far.
+   Open addressing, 0 marks a free slot (imported files are never empty). */
+
+static u64* symbex_seen;
+static u32  symbex_seen_size, symbex_seen_cnt;
+
+static u8 symbex_seen_add(u64 key) {
+
+  u32 i;
+
+  if ((symbex_seen_cnt + 1) * 2 > symbex_seen_size) {
+
+    u64* old = symbex_seen;
+    u32  old_size = symbex_seen_size;
+
+    symbex_seen_size = old_size ? old_size * 2 : 1024;
+    symbex_seen      = ck_alloc(symbex_seen_size * sizeof(u64));
+    symbex_seen_cnt  = 0;
+
+    for (i = 0; i < old_size; i++)
+      if (old[i]) symbex_seen_add(old[i]);
+
+    ck_free(old);
+
+  }
+
+  i = (u32)key & (symbex_seen_size - 1);
+
+  while (symbex_seen[i]) {
+    if (symbex_seen[i] == key) return 0;
+    i = (i + 1) & (symbex_seen_size - 1);
+  }
+
+  symbex_seen[i] = key;
+  symbex_seen_cnt++;
+
+  return 1;
+
+}
+
+static void queue_symbex_case(u8* name) {
+
+  struct symbex_case* c;
+  u32 len = strlen(name);
+
+  /* The case generator writes into .tmp and renames from there. */
+
+  if (name[0] == '.' || (len > 4 && !strcmp(name + len - 4, ".tmp")))
+    return;
+
+  c = ck_alloc(sizeof(struct symbex_case));
+  c->name = ck_strdup(name);
+
+  if (symbex_tail) symbex_tail->next = c;
+  else symbex_head = c;
+
+  symbex_tail = c;
+
+}
+
+/* Queue everything currently in symbex_dir. Used when there is no inotify
+   watch, or when the kernel dropped events. */
+
+static void scan_symbex_dir(void) {
+
+  DIR* symdir;
+  struct dirent* qd_ent;
+
+  symdir = opendir(symbex_dir);
+  if (!symdir) PFATAL("Unable to open '%s'", symbex_dir);
+
+  while ((qd_ent = readdir(symdir)))
+    queue_symbex_case((u8*)qd_ent->d_name);
+
+  closedir(symdir);
+
+}
+
+/* Watch symbex_dir for new testcases. FuzzyS2E renames finished cases into
+   place, so IN_MOVED_TO is the usual event; IN_CLOSE_WRITE covers anything
+   else dropping files there. */
+
+static void setup_symbex_watch(void) {
+
+  symbex_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (symbex_watch_fd < 0 ||
+      inotify_add_watch(symbex_watch_fd, symbex_dir,
+                        IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+
+    WARNF("Unable to watch '%s', falling back to directory scans", symbex_dir);
+
+    if (symbex_watch_fd >= 0) close(symbex_watch_fd);
+    symbex_watch_fd = -1;
+
+  }
+
+}
+
+/* Move pending inotify events into the import queue. */
+
+static void poll_symbex_watch(void) {
+
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  s32  n;
 
-      if (new_val == tval) return 1;
+  while ((n = read(symbex_watch_fd, buf, sizeof(buf))) > 0) {
 
-      /* Continue here only if blen > 2. */
+    char* p = buf;
 
-      if (blen > 2) {
+    while (p < buf + n) {
 
-        tval = (old_val & ~(0xffff << (i * 8))) |
-               (SWAP16(interesting_16[j]) << (i * 8));
+      struct inotify_event* ev = (struct inotify_event*)p;
 
-        if (new_val == tval) return 1;
+      if (ev->mask & IN_Q_OVERFLOW) symbex_rescan = 1;
+      else if (ev->len && !(ev->mask & IN_ISDIR)) queue_symbex_case((u8*)ev->name);
 
-      }
+      p += sizeof(struct inotify_event) + ev->len;
 
     }
 
   }
 
-  if (blen == 4 && check_le) {
+}
 
-    /* See if four-byte insertions could produce the same result
-       (LE only). */
+/* Run one symbex testcase unless an identical one was imported before, then
+   delete it. */
 
-    for (j = 0; j < sizeof(interesting_32) / 4; j++)
-      if (new_val == (u32)interesting_32[j]) return 1;
+static void import_symbex_case(char** argv, u8* name) {
 
-  }
+  u8* path;
+  s32 fd;
+  struct stat st;
 
-  return 0;
+  path = alloc_printf("%s/%s", symbex_dir, name);
 
-}
+  /* Duplicate queue entries find the file gone already. */
 
-#ifdef CONFIG_S2E
-void read_symbex_testcases(char ** argv) {
-    DIR* symdir;
-    symdir = opendir(symbex_dir);
-    if (!symdir) PFATAL("Unable to open '%s'", symbex_dir);
+  fd = open(path, O_RDONLY);
 
-    cur_depth = 0;
+  if (fd < 0) {
+    ck_free(path);
+    return;
+  }
 
-    struct dirent* qd_ent;
+  if (fstat(fd, &st))
+    PFATAL("fstat() failed");
 
-    while ((qd_ent = readdir(symdir))) {
+  if (S_ISREG(st.st_mode) && st.st_size && st.st_size <= MAX_FILE) {
 
-        u8* path;
-        s32 fd;
-        struct stat st;
+    u8* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
+    if (mem == MAP_FAILED)
+      PFATAL("Unable to mmap '%s'", path);
 
-        path = alloc_printf("%s/%s", symbex_dir, qd_ent->d_name);
+    if (symbex_seen_add(((u64)st.st_size << 32) |
+                        hash32(mem, st.st_size, HASH_CONST))) {
 
-        /* Allow this to fail in case the other fuzzer is resuming or so... */
+      /* See what happens. We rely on save_if_interesting() to catch major
+         errors and save the test case. */
 
-        fd = open(path, O_RDONLY);
+      write_to_testcase(mem, st.st_size, NULL, STAGE_READSYMBEX, 0);
+      run_target(argv);
 
-        if (fd < 0) {
-            ck_free(path);
-            continue;
-        }
+      if (stop_soon) {
+        munmap(mem, st.st_size);
+        close(fd);
+        ck_free(path);
+        return;
+      }
 
-        if (fstat(fd, &st))
-            PFATAL("fstat() failed");
+      syncing_party = 0;
 
-        /* This also takes care of . and .. */
+    } else symbex_dupes++;
 
-        if (!S_ISREG(st.st_mode) || !st.st_size ) {
+    munmap(mem, st.st_size);
 
-          ck_free(path);
-          close(fd);
-          continue;
+  }
 
-        }
+  if (S_ISREG(st.st_mode) && unlink(path))
+    PFATAL("Unable to delete '%s'", path); // delete file to avoid repeating testing
+
+  ck_free(path);
+  close(fd);
+
+}
 
-        /* Ignore zero-sized or oversized files. */
+/* Import up to SYMBEX_IMPORT_MAX of the testcases symbex has produced since
+   the last call. Each one goes to whichever qemu is free next, so the rest of
+   a large burst waits for the next call rather than holding up fuzzing. */
 
-        if (st.st_size && st.st_size <= MAX_FILE) {
+void read_symbex_testcases(char ** argv) {
 
-            u8 fault;
-            u8* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  u32 imported = 0;
 
-            if (mem == MAP_FAILED)
-                PFATAL("Unable to mmap '%s'", path);
+  cur_depth = 0;
 
-            /* See what happens. We rely on save_if_interesting() to catch major
-             errors and save the test case. */
-            write_to_testcase(mem, st.st_size, NULL, STAGE_READSYMBEX, 0);
-            fault = run_target(argv);
+  if (symbex_watch_fd >= 0) poll_symbex_watch();
 
-            if (stop_soon)
-                return;
+  if (!symbex_head && (symbex_watch_fd < 0 || symbex_rescan)) {
+    symbex_rescan = 0;
+    scan_symbex_dir();
+  }
 
-            syncing_party = 0;
+  while (symbex_head && imported++ < SYMBEX_IMPORT_MAX && !stop_soon) {
 
-            munmap(mem, st.st_size);
+    struct symbex_case* c = symbex_head;
 
-        }
+    symbex_head = c->next;
+    if (!symbex_head) symbex_tail = NULL;
 
-        if (unlink(path)) PFATAL("Unable to delete '%s'", path); // delete file to avoid repeating testing
+    import_symbex_case(argv, c->name);
 
-        ck_free(path);
-        close(fd);
+    ck_free(c->name);
+    ck_free(c);
 
-    }
+  }
 
 }
 #endif
@@ -5775,7 +7160,7 @@ static u8 fuzz_one(char** argv) {
       */
     if (!dumb_mode && (stage_cur & 7) == 7) {
 
-      u32 cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      u32 cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       if (stage_cur == stage_max - 1 && cksum == prev_cksum) {
 
@@ -5937,6 +7322,24 @@ static u8 fuzz_one(char** argv) {
 #endif
   }
 
+#ifdef CONFIG_S2E
+
+  /* Bytes known to feed symbolic branches are worth fuzzing, whatever the
+     walking byte below finds. */
+
+  load_sig_offsets(len);
+
+  for (i = 0; i < sig_cnt; i++) {
+
+    if (!eff_map[EFF_APOS(sig_pos[i])]) {
+      eff_map[EFF_APOS(sig_pos[i])] = 1;
+      g_eff_cnt++;
+    }
+
+  }
+
+#endif /* CONFIG_S2E */
+
   /* Walking byte. */
 
   stage_name  = "bitflip 8/8";
@@ -5957,8 +7360,6 @@ static u8 fuzz_one(char** argv) {
     if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;
 #endif
 
-//TODO: Using significant byte offset collector to fill eff_map when combining with symbex.
-
 #ifndef CONFIG_S2E
     /* We also use this stage to pull off a simple trick: we identify
        bytes that seem to have no effect on the current execution path
@@ -5973,7 +7374,7 @@ static u8 fuzz_one(char** argv) {
          without wasting time on checksums. */
 
       if (!dumb_mode && len >= EFF_MIN_LEN)
-        cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+        cksum = hash32(trace_bits, map_size, HASH_CONST);
       else
         cksum = ~queue_cur->exec_cksum;
 
@@ -6995,14 +8396,14 @@ havoc_stage:
 
           /* Flip a single bit somewhere. Spooky! */
 
-          FLIP_BIT(out_buf, UR(temp_len << 3));
+          FLIP_BIT(out_buf, (havoc_pos(temp_len) << 3) + UR(8));
           break;
 
         case 1: 
 
           /* Set byte to interesting value. */
 
-          out_buf[UR(temp_len)] = interesting_8[UR(sizeof(interesting_8))];
+          out_buf[havoc_pos(temp_len)] = interesting_8[UR(sizeof(interesting_8))];
           break;
 
         case 2:
@@ -7013,12 +8414,12 @@ havoc_stage:
 
           if (UR(2)) {
 
-            *(u16*)(out_buf + UR(temp_len - 1)) =
+            *(u16*)(out_buf + havoc_pos(temp_len - 1)) =
               interesting_16[UR(sizeof(interesting_16) >> 1)];
 
           } else {
 
-            *(u16*)(out_buf + UR(temp_len - 1)) = SWAP16(
+            *(u16*)(out_buf + havoc_pos(temp_len - 1)) = SWAP16(
               interesting_16[UR(sizeof(interesting_16) >> 1)]);
 
           }
@@ -7033,12 +8434,12 @@ havoc_stage:
 
           if (UR(2)) {
   
-            *(u32*)(out_buf + UR(temp_len - 3)) =
+            *(u32*)(out_buf + havoc_pos(temp_len - 3)) =
               interesting_32[UR(sizeof(interesting_32) >> 2)];
 
           } else {
 
-            *(u32*)(out_buf + UR(temp_len - 3)) = SWAP32(
+            *(u32*)(out_buf + havoc_pos(temp_len - 3)) = SWAP32(
               interesting_32[UR(sizeof(interesting_32) >> 2)]);
 
           }
@@ -7049,14 +8450,14 @@ havoc_stage:
 
           /* Randomly subtract from byte. */
 
-          out_buf[UR(temp_len)] -= 1 + UR(ARITH_MAX);
+          out_buf[havoc_pos(temp_len)] -= 1 + UR(ARITH_MAX);
           break;
 
         case 5:
 
           /* Randomly add to byte. */
 
-          out_buf[UR(temp_len)] += 1 + UR(ARITH_MAX);
+          out_buf[havoc_pos(temp_len)] += 1 + UR(ARITH_MAX);
           break;
 
         case 6:
@@ -7067,13 +8468,13 @@ havoc_stage:
 
           if (UR(2)) {
 
-            u32 pos = UR(temp_len - 1);
+            u32 pos = havoc_pos(temp_len - 1);
 
             *(u16*)(out_buf + pos) -= 1 + UR(ARITH_MAX);
 
           } else {
 
-            u32 pos = UR(temp_len - 1);
+            u32 pos = havoc_pos(temp_len - 1);
             u16 num = 1 + UR(ARITH_MAX);
 
             *(u16*)(out_buf + pos) =
@@ -7091,13 +8492,13 @@ havoc_stage:
 
           if (UR(2)) {
 
-            u32 pos = UR(temp_len - 1);
+            u32 pos = havoc_pos(temp_len - 1);
 
             *(u16*)(out_buf + pos) += 1 + UR(ARITH_MAX);
 
           } else {
 
-            u32 pos = UR(temp_len - 1);
+            u32 pos = havoc_pos(temp_len - 1);
             u16 num = 1 + UR(ARITH_MAX);
 
             *(u16*)(out_buf + pos) =
@@ -7115,13 +8516,13 @@ havoc_stage:
 
           if (UR(2)) {
 
-            u32 pos = UR(temp_len - 3);
+            u32 pos = havoc_pos(temp_len - 3);
 
             *(u32*)(out_buf + pos) -= 1 + UR(ARITH_MAX);
 
           } else {
 
-            u32 pos = UR(temp_len - 3);
+            u32 pos = havoc_pos(temp_len - 3);
             u32 num = 1 + UR(ARITH_MAX);
 
             *(u32*)(out_buf + pos) =
@@ -7139,13 +8540,13 @@ havoc_stage:
 
           if (UR(2)) {
 
-            u32 pos = UR(temp_len - 3);
+            u32 pos = havoc_pos(temp_len - 3);
 
             *(u32*)(out_buf + pos) += 1 + UR(ARITH_MAX);
 
           } else {
 
-            u32 pos = UR(temp_len - 3);
+            u32 pos = havoc_pos(temp_len - 3);
             u32 num = 1 + UR(ARITH_MAX);
 
             *(u32*)(out_buf + pos) =
@@ -7161,7 +8562,7 @@ havoc_stage:
              why not. We use XOR with 1-255 to eliminate the
              possibility of a no-op. */
 
-          out_buf[UR(temp_len)] ^= 1 + UR(255);
+          out_buf[havoc_pos(temp_len)] ^= 1 + UR(255);
           break;
 
         case 11 ... 12: {
@@ -7533,9 +8934,251 @@ abandon_entry:
 
 #ifdef CONFIG_S2E
 
-/* Currently cluster is not supported! */
-static void sync_fuzzers(char** argv) {
+/* Map the virgin map shared by every fuzzer in sync_dir. Whoever creates the
+   file initializes it under flock(), so nobody sees it half-filled. */
+
+static void setup_sync_virgin(void) {
+
+  u8* fn;
+  s32 fd;
+  struct stat st;
+
+  if (!sync_id || !getenv(SYNC_VIRGIN_ENV_VAR)) return;
+
+  fn = alloc_printf("%s/.virgin", sync_dir);
+  fd = open(fn, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) PFATAL("Unable to open '%s'", fn);
+
+  if (flock(fd, LOCK_EX)) PFATAL("flock() failed");
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  if (!st.st_size) {
+
+    u8* ones = ck_alloc_nozero(map_size);
+
+    memset(ones, 255, map_size);
+    ck_write(fd, ones, map_size, fn);
+    ck_free(ones);
+
+  } else if (st.st_size != map_size) {
+
+    /* A peer runs with another AFL_MAP_SIZE, the maps cannot be merged. */
+
+    WARNF("'%s' is for another map size, not sharing coverage", fn);
+    close(fd);
+    ck_free(fn);
     return;
+
+  }
+
+  flock(fd, LOCK_UN);
+
+  sync_virgin = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (sync_virgin == MAP_FAILED) PFATAL("Unable to mmap '%s'", fn);
+
+  close(fd);
+  ck_free(fn);
+
+}
+
+/* Whether some peer has covered a tuple we haven't, going by the shared
+   virgin map. If not, none of their entries can add to our coverage. */
+
+static u8 sync_peers_have_new(void) {
+
+  u64* g = (u64*)sync_virgin;
+  u64* l = (u64*)virgin_bits;
+  u32  i = (map_size >> 3);
+
+  while (i--)
+    if (~g[i] & l[i]) return 1;
+
+  return 0;
+
+}
+
+/* Every peer we ever synced from. Names stay allocated, in-flight tests
+   point at them for describe_op(). */
+
+struct sync_peer {
+  u8* name;
+  struct sync_peer* next;
+};
+
+static struct sync_peer* sync_peers;
+
+static u8* sync_peer_name(u8* name) {
+
+  struct sync_peer* p;
+
+  for (p = sync_peers; p; p = p->next)
+    if (!strcmp(p->name, name)) return p->name;
+
+  p = ck_alloc(sizeof(struct sync_peer));
+  p->name = ck_strdup(name);
+  p->next = sync_peers;
+  sync_peers = p;
+
+  return p->name;
+
+}
+
+/* Hand one peer entry to the next free qemu. Results come back through
+   handle_onetestdone() like any other test. */
+
+static void sync_one_case(char** argv, u8* path, u8* party, u32 id) {
+
+  s32 fd;
+  struct stat st;
+
+  /* Allow this to fail in case the other fuzzer is resuming or so... */
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return;
+
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  /* Ignore zero-sized or oversized files. */
+
+  if (S_ISREG(st.st_mode) && st.st_size && st.st_size <= MAX_FILE) {
+
+    u8* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mem == MAP_FAILED) PFATAL("Unable to mmap '%s'", path);
+
+    write_to_testcase(mem, st.st_size, NULL, STAGE_SYNC, 0);
+    curQemu->sync_party = party;
+    curQemu->sync_case  = id;
+    run_target(argv);
+
+    munmap(mem, st.st_size);
+
+    if (!(stage_cur++ % stats_update_freq)) show_stats();
+
+  }
+
+  close(fd);
+
+}
+
+/* Grab interesting test cases from other fuzzers. Peers running this build
+   publish queue/.state/ids/<id>, so only ids from the last one we saw onwards
+   are opened, without listing their queue. Other peers are scanned as usual.
+   Tests are dispatched asynchronously; .synced/ records what was dispatched. */
+
+static void sync_fuzzers(char** argv) {
+
+  DIR* sd;
+  struct dirent* sd_ent;
+  u32 sync_cnt = 0;
+
+  sd = opendir(sync_dir);
+  if (!sd) PFATAL("Unable to open '%s'", sync_dir);
+
+  stage_max = stage_cur = 0;
+  cur_depth = 0;
+
+  while ((sd_ent = readdir(sd)) && !stop_soon) {
+
+    static u8 stage_tmp[128];
+
+    u8 *qd_path, *ids_path, *qd_synced_path, *party, *path;
+    u32 min_accept = 0, next_min_accept, id;
+    s32 id_fd;
+    DIR* qd;
+
+    /* Skip dot files and our own output directory. */
+
+    if (sd_ent->d_name[0] == '.' || !strcmp(sync_id, sd_ent->d_name)) continue;
+
+    qd_path  = alloc_printf("%s/%s/queue", sync_dir, sd_ent->d_name);
+    ids_path = alloc_printf("%s/.state/ids", qd_path);
+
+    if (access(qd_path, X_OK)) {
+      ck_free(qd_path);
+      ck_free(ids_path);
+      continue;
+    }
+
+    party = sync_peer_name(sd_ent->d_name);
+
+    /* Retrieve the ID of the last seen test case. */
+
+    qd_synced_path = alloc_printf("%s/.synced/%s", out_dir, party);
+
+    id_fd = open(qd_synced_path, O_RDWR | O_CREAT, 0600);
+
+    if (id_fd < 0) PFATAL("Unable to create '%s'", qd_synced_path);
+
+    if (read(id_fd, &min_accept, sizeof(u32)) > 0)
+      lseek(id_fd, 0, SEEK_SET);
+
+    next_min_accept = min_accept;
+
+    sprintf(stage_tmp, "sync %u", ++sync_cnt);
+    stage_name = stage_tmp;
+    stage_cur  = 0;
+    stage_max  = 0;
+
+    if (!access(ids_path, X_OK)) {
+
+      /* Find how far the peer got before looking at the shared map, so that
+         all of these entries are accounted for in there. */
+
+      for (id = min_accept; ; id++) {
+
+        path = alloc_printf("%s/%06u", ids_path, id);
+        if (access(path, F_OK)) { ck_free(path); break; }
+        ck_free(path);
+
+      }
+
+      next_min_accept = id;
+
+      if (sync_virgin && !sync_peers_have_new())
+        sync_skipped += next_min_accept - min_accept;
+
+      else for (id = min_accept; id < next_min_accept && !stop_soon; id++) {
+
+        path = alloc_printf("%s/%06u", ids_path, id);
+        sync_one_case(argv, path, party, id);
+        ck_free(path);
+
+      }
+
+    } else if ((qd = opendir(qd_path))) {
+
+      struct dirent* qd_ent;
+
+      while ((qd_ent = readdir(qd)) && !stop_soon) {
+
+        if (qd_ent->d_name[0] == '.' ||
+            sscanf(qd_ent->d_name, CASE_PREFIX "%06u", &id) != 1 ||
+            id < min_accept) continue;
+
+        if (id >= next_min_accept) next_min_accept = id + 1;
+
+        path = alloc_printf("%s/%s", qd_path, qd_ent->d_name);
+        sync_one_case(argv, path, party, id);
+        ck_free(path);
+
+      }
+
+      closedir(qd);
+
+    }
+
+    ck_write(id_fd, &next_min_accept, sizeof(u32), qd_synced_path);
+
+    close(id_fd);
+    ck_free(qd_path);
+    ck_free(ids_path);
+    ck_free(qd_synced_path);
+
+  }
+
+  closedir(sd);
+
 }
 
 #else
@@ -8065,6 +9708,16 @@ EXP_ST void setup_dirs_fds(void) {
   if (mkdir(tmp, 0700)) PFATAL("Unable to create '%s'", tmp);
   ck_free(tmp);
 
+#ifdef CONFIG_S2E
+
+  /* Queue entries by id, for peers to sync from. */
+
+  tmp = alloc_printf("%s/queue/.state/ids/", out_dir);
+  if (mkdir(tmp, 0700)) PFATAL("Unable to create '%s'", tmp);
+  ck_free(tmp);
+
+#endif /* CONFIG_S2E */
+
   /* Sync directory for keeping track of cooperating fuzzers. */
 
   if (sync_id) {
@@ -8110,6 +9763,27 @@ EXP_ST void setup_dirs_fds(void) {
                      "unique_hangs, max_depth, execs_per_sec\n");
                      /* ignore errors */
 
+#ifdef CONFIG_S2E
+
+  /* Per-qemu telemetry. */
+
+  tmp = alloc_printf("%s/qemu_data", out_dir);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", tmp);
+  ck_free(tmp);
+
+  qemu_file = fdopen(fd, "w");
+  if (!qemu_file) PFATAL("fdopen() failed");
+
+  fprintf(qemu_file, "# unix_time, qemu_pid, testcases, redundant, drilled, "
+                     "drill_skipped, wait_p50, wait_p99, filter_p50, "
+                     "filter_p99, copy_p50, copy_p99, exec_p50, exec_p99, "
+                     "tell_p50, tell_p99, solve_p50, solve_p99, "
+                     "dispatch_p50, dispatch_p99\n");
+                     /* ignore errors */
+
+#endif /* CONFIG_S2E */
+
 }
 
 
@@ -8632,7 +10306,7 @@ int main(int argc, char** argv) {
   srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
 
 #ifdef CONFIG_S2E
-  while ((opt = getopt(argc, argv, "+i:o:s:f:m:t:T:dnCB:S:M:x:QP:H")) > 0) // -P(int): number of Multi-S2E. -H: use symbex to assit fuzzing.
+  while ((opt = getopt(argc, argv, "+i:o:s:f:m:t:T:dnCB:S:M:x:QP:Hb:")) > 0) // -P(int): number of Multi-S2E. -H: use symbex to assit fuzzing.
 #else
   while ((opt = getopt(argc, argv, "+i:o:f:m:t:T:dnCB:S:M:x:Q")) > 0)
 #endif
@@ -8784,7 +10458,6 @@ int main(int argc, char** argv) {
         if (in_bitmap) FATAL("Multiple -B options not supported");
 
         in_bitmap = optarg;
-        read_bitmap(in_bitmap);
         break;
 
       case 'C': /* crash mode */
@@ -8816,11 +10489,26 @@ int main(int argc, char** argv) {
         break;
 
 #ifdef CONFIG_S2E
-      case 'P': /* number of multi-s2e instances, default to 1 */
+      case 'P': { /* number of multi-s2e instances, default to 1, or min:max to scale */
 
-        if( atoi(optarg) > 32 )
+        u32 p_min = 0, p_max = 0;
+        if (sscanf(optarg, "%u:%u", &p_min, &p_max) < 1 || !p_min)
+            FATAL("Bad syntax used for -P");
+        if( p_min > 32 || p_max > 32 )
             FATAL("Parallel qemu instances cannot be over than 32.");
-        parallel_qemu_num = atoi(optarg);
+        if (p_max && p_max < p_min)
+            FATAL("Maximum number of qemus is below the minimum.");
+        parallel_qemu_num = p_min;
+        parallel_qemu_max = p_max > p_min ? p_max : 0;
+        break;
+
+      }
+
+      case 'b': /* mutants per qemu test in deterministic stages */
+
+        qemu_batch = atoi(optarg);
+        if (qemu_batch < 1 || qemu_batch > QEMUBATCH_MAX)
+            FATAL("Batch size must be between 1 and %u.", QEMUBATCH_MAX);
         break;
 #endif
       default:
@@ -8832,8 +10520,10 @@ int main(int argc, char** argv) {
 #ifdef CONFIG_S2E
   if (!out_file) FATAL("Outfile must be specified when combining with symbex!");
   if (!symbex_dir) ACTF("Symbex testcase directory must be specified when combining with symbex!");
-  else
+  else {
       cleanupSymbexDir();
+      setup_symbex_watch();
+  }
 #endif
 
   if (optind == argc || !in_dir || !out_dir) usage(argv[0]);
@@ -8860,6 +10550,11 @@ int main(int argc, char** argv) {
 #ifdef CONFIG_S2E
   no_forkserver = 1; // Fork server has been implemented in S2E.
   isAfterWait = 0;
+
+  if (getenv("AFL_QEMU_HANG_TMOUT")) {
+    qemu_hang_sec = atoi(getenv("AFL_QEMU_HANG_TMOUT"));
+    if (!qemu_hang_sec) FATAL("Bad value of AFL_QEMU_HANG_TMOUT");
+  }
 #endif
 
   if (dumb_mode == 2 && no_forkserver)
@@ -8894,15 +10589,24 @@ int main(int argc, char** argv) {
   setup_shm();
   init_count_class16();
 
+  if (in_bitmap) read_bitmap(in_bitmap);
+
+#ifdef __x86_64__
+  use_avx2 = !!__builtin_cpu_supports("avx2");
+#endif /* __x86_64__ */
+
 #ifdef CONFIG_S2E
   PARAL_QEMU(SetupSHM4Ready)();
+  // Qemus boot in the background, each one is used as soon as its handshake arrives.
   PARAL_QEMU(InitQemuQueue)();
-  // Let qemus to create the trace bits bitmap share memory.
-  PARAL_QEMU(setupTracebits)();
 #endif
 
 
   setup_dirs_fds();
+
+#ifdef CONFIG_S2E
+  setup_sync_virgin();
+#endif /* CONFIG_S2E */
   read_testcases();
   load_auto();
 
@@ -33,6 +33,9 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/file.h>
+#include <sys/syscall.h>
+
+#include <linux/futex.h>
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
 #  include <sys/sysctl.h>
@@ -40,13 +43,27 @@
 
 // extern variable from afl-fuzz.c
 extern u8 parallel_qemu_num;
+extern u8 parallel_qemu_max;
+extern u32 qemu_restarts;
+extern u32 map_size;
 extern QemuInstance * allQemus;
-extern u32 qemu_quene_fd;
-extern u8* ReadArray;
+extern QemuDoneRing* DoneRing;
 //extern variable end
 
+static u8  qemu_floor;          // Never scale below the initial count
+static u64 wait_us;             // Time AFL spent sleeping on the ring
+static u64 window_start_us;     // Start of the current scaling window
+static u32 ring_orphans;        // Ring slots dead qemus may have left unpublished
+
 char QEMUEXECUTABLE[256];
 char *qemu_argments[32];
+
+static u64 PARAL_QEMU(now_us)(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+}
         
 /*
  * Parse qemu arguments for afl.
@@ -111,14 +128,15 @@ void PARAL_QEMU(ParseQemuArgs)(char *qemu_args[32], const char * config_filename
 }
 
 /*
- * Set up share memory, which could be used for qemu to inform AFL that a test has done.
- * readyshm is handled in signal's handler.
+ * Set up the completion ring, which is used by qemus to inform AFL that a test has done.
+ * Every slot starts out free for the first lap (seq == slot index).
  */
 void PARAL_QEMU(SetupSHM4Ready)(void)
 {
     void *shm = NULL;
     int shmid;
-    shmid = shmget((key_t) READYSHMID, sizeof(u8)*65536, 0666 | IPC_CREAT);
+    u32 i;
+    shmid = shmget((key_t) READYSHMID, sizeof(QemuDoneRing), 0666 | IPC_CREAT);
     if (shmid == -1) {
         fprintf(stderr, "shmget failed\n");
         exit(EXIT_FAILURE);
@@ -126,8 +144,271 @@ void PARAL_QEMU(SetupSHM4Ready)(void)
     shm = shmat(shmid, (void*) 0, 0);
     if (shm == (void*) -1)
         PFATAL("shmat() failed");
-    OKF("Ready share memory attached at %X.\n", (int) shm);
-    ReadArray = (u8*) shm;
+    OKF("Completion ring attached at %p.\n", shm);
+    DoneRing = (QemuDoneRing*) shm;
+    memset(DoneRing, 0, sizeof(QemuDoneRing));
+    for (i = 0; i < QEMURING_SLOTS; i++)
+        DoneRing->slots[i].seq = i;
+    __sync_synchronize();
+}
+
+/*
+ * Pop the oldest completion record. If none is published yet, sleep on the ring's
+ * futex word; qemus bump it after publishing, so a record that shows up between
+ * the check and the sleep makes FUTEX_WAIT return at once. A claimed slot that is
+ * still unpublished after a whole wait while a qemu has been killed is taken for
+ * the dead qemu's and skipped.
+ */
+u8 PARAL_QEMU(PopDone)(QemuDoneRecord* rec, u32 timeout_ms)
+{
+    struct timespec ts;
+    QemuDoneSlot* slot;
+    u32 pos, seen;
+
+    ts.tv_sec  = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+
+    pos  = DoneRing->tail;
+    slot = &DoneRing->slots[pos % QEMURING_SLOTS];
+
+    while (1) {
+        seen = DoneRing->futex;
+        DoneRing->waiters = 1;
+        __sync_synchronize();
+
+        if (DoneRing->head == pos)
+            ring_orphans = 0; // no claim is pending
+
+        if (slot->seq == pos + 1) {
+            DoneRing->waiters = 0;
+            *rec = slot->rec;
+            __sync_synchronize();
+            slot->seq = pos + QEMURING_SLOTS; // free for the next lap
+            DoneRing->tail = pos + 1;
+            return 1;
+        }
+
+        if (!timeout_ms)
+            break;
+
+        u64 sleep_us = PARAL_QEMU(now_us)();
+        long res = syscall(SYS_futex, &DoneRing->futex, FUTEX_WAIT, seen, &ts, NULL, 0);
+        wait_us += PARAL_QEMU(now_us)() - sleep_us;
+        if (res == -1 && errno == ETIMEDOUT) {
+            if (ring_orphans && slot->seq == pos && DoneRing->head != pos) {
+                WARNF("Skipping completion slot %u left by a dead qemu.", pos);
+                ring_orphans--;
+                slot->seq = pos + QEMURING_SLOTS;
+                DoneRing->tail = ++pos;
+                slot = &DoneRing->slots[pos % QEMURING_SLOTS];
+                continue;
+            }
+            break;
+        }
+    }
+
+    DoneRing->waiters = 0;
+    return 0;
+}
+
+// Input buffers are keyed by per-run directories, so remove them or they pile up.
+static void PARAL_QEMU(removeInputBufs)(void)
+{
+    u8 i;
+    for (i = 0; i < parallel_qemu_num; i++) {
+        if (allQemus[i].input_buf)
+            shmctl(allQemus[i].input_shm_id, IPC_RMID, NULL);
+        if (allQemus[i].stats)
+            shmctl(allQemus[i].stats_shm_id, IPC_RMID, NULL);
+    }
+}
+
+/*
+ * Set up the testcase input buffer of a qemu instance, keyed by its testcase directory.
+ * If it cannot be created, we keep handing testcases over through files.
+ */
+static void PARAL_QEMU(setupInputBuf)(QemuInstance* qemu)
+{
+    key_t shmkey;
+    qemu->input_buf = NULL;
+    qemu->input_shm_id = -1;
+    if ((shmkey = ftok(qemu->testcaseDir, 'i')) < 0) {
+        WARNF("ftok() on '%s' failed, using testcase files", qemu->testcaseDir);
+        return;
+    }
+    int shm_id = shmget(shmkey, sizeof(QemuInputBuf), IPC_CREAT | 0600);
+    if (shm_id < 0) {
+        WARNF("shmget() for input buffer failed, using testcase files");
+        return;
+    }
+    void * __inputbuf = shmat(shm_id, NULL, 0);
+    if (__inputbuf == (void*) -1) {
+        WARNF("shmat() for input buffer failed, using testcase files");
+        return;
+    }
+    qemu->input_buf = (QemuInputBuf*) __inputbuf;
+    qemu->input_shm_id = shm_id;
+    qemu->input_buf->cur = 0;
+    qemu->input_buf->seq = 0;
+    qemu->input_buf->buf[0].len = INPUTSHM_INFILE;
+    qemu->input_buf->buf[1].len = INPUTSHM_INFILE;
+    qemu->input_buf->buf[0].count = 1;
+    qemu->input_buf->buf[1].count = 1;
+    qemu->input_buf->buf[0].flags = 0;
+    qemu->input_buf->buf[1].flags = 0;
+}
+
+/*
+ * Telemetry block of a qemu, keyed like its input buffer. Telemetry is optional,
+ * so failures only leave it NULL.
+ */
+static void PARAL_QEMU(setupStats)(QemuInstance* qemu)
+{
+    key_t shmkey;
+    qemu->stats = NULL;
+    qemu->stats_shm_id = -1;
+    if ((shmkey = ftok(qemu->testcaseDir, 's')) < 0)
+        return;
+    int shm_id = shmget(shmkey, sizeof(QemuStats), IPC_CREAT | 0600);
+    if (shm_id < 0) {
+        WARNF("shmget() for qemu stats failed");
+        return;
+    }
+    void * __stats = shmat(shm_id, NULL, 0);
+    if (__stats == (void*) -1) {
+        WARNF("shmat() for qemu stats failed");
+        return;
+    }
+    memset(__stats, 0, sizeof(QemuStats));
+    qemu->stats = (QemuStats*) __stats;
+    qemu->stats_shm_id = shm_id;
+}
+
+void PARAL_QEMU(RecordPhase)(QemuStats* stats, u32 phase, u64 us)
+{
+    if (!stats)
+        return;
+    QemuPhaseStat* ps = &stats->phase[phase];
+    ps->count++;
+    ps->total_us += us;
+    if (us > ps->max_us)
+        ps->max_us = us;
+    ps->hist[qstat_bucket(us)]++;
+}
+
+u64 PARAL_QEMU(PhasePercentile)(QemuPhaseStat* ps, double pct)
+{
+    u64 total = 0, seen = 0, goal;
+    u32 i;
+    for (i = 0; i < QSTAT_BUCKETS; i++)
+        total += ps->hist[i];
+    if (!total)
+        return 0;
+    goal = (u64)(total * pct / 100);
+    for (i = 0; i < QSTAT_BUCKETS; i++) {
+        seen += ps->hist[i];
+        if (seen > goal)
+            break;
+    }
+    if (i >= QSTAT_BUCKETS)
+        i = QSTAT_BUCKETS - 1;
+    if (i < (1 << QSTAT_SUBBITS))
+        return i;
+    // Lower bound of the bucket
+    u32 msb = (i >> QSTAT_SUBBITS) + QSTAT_SUBBITS - 1;
+    return (1ULL << msb) | ((u64)(i & ((1 << QSTAT_SUBBITS) - 1)) << (msb - QSTAT_SUBBITS));
+}
+
+/*
+ * Start one qemu in the given slot. It counts as busy until its ready handshake
+ * shows up, and its trace bits are attached only then.
+ */
+static void PARAL_QEMU(spawnQemu)(QemuInstance* qemu)
+{
+    // set up control pipe
+    int fd[2];
+    if (pipe(fd) != 0)
+        PFATAL("pipe() failed");
+    pid_t pid = fork();
+    if (pid < 0)
+        PFATAL("fork() failed");
+    if (!pid) {
+        if (dup2(fd[1], CTRLPIPE(getpid()) + 1) < 0
+                            || dup2(fd[0], CTRLPIPE(getpid())) < 0) // Duplicate file descriptor before execv(), otherwise QEMU cannot access pipes forever.
+            exit(EXIT_FAILURE);
+        execv(QEMUEXECUTABLE, qemu_argments);
+        _exit(EXIT_FAILURE); // do not run AFL's atexit handlers in here
+    }
+    INIT_QEMU((*qemu), pid);
+    u8* _tcDir = (u8*) malloc(128);
+    sprintf(_tcDir, "/tmp/afltestcase/%d/", pid);
+    if(access(_tcDir, F_OK))
+        mkdir(_tcDir, 0777);
+    qemu->testcaseDir = _tcDir;
+    qemu->trace_shm_id = -1;
+    qemu->spawn_us = PARAL_QEMU(now_us)();
+    PARAL_QEMU(setupInputBuf)(qemu);
+    PARAL_QEMU(setupStats)(qemu);
+    if (dup2(fd[1], CTRLPIPE(pid) + 1) < 0
+            || dup2(fd[0], CTRLPIPE(pid)) < 0)
+        PFATAL("dup2() failed");
+    if (fd[0] != CTRLPIPE(pid)) close(fd[0]);
+    if (fd[1] != CTRLPIPE(pid) + 1) close(fd[1]);
+    qemu->ctrl_pipe = CTRLPIPE(pid) + 1;
+}
+
+/*
+ * A qemu killed between claiming a ring slot and publishing it leaves the slot
+ * unpublished for good. It held at most one claim, so one unpublished claim in
+ * the ring may be its orphan; PopDone() skips it if it never gets published.
+ */
+static void PARAL_QEMU(noteOrphanSlot)(void)
+{
+    u32 pos;
+    for (pos = DoneRing->tail; pos != DoneRing->head; pos++) {
+        if (DoneRing->slots[pos % QEMURING_SLOTS].seq == pos) {
+            ring_orphans++;
+            return;
+        }
+    }
+}
+
+/*
+ * Kill a qemu and release everything that belongs to it. If it has been reaped
+ * already, its pid may have been reused, so leave that alone.
+ */
+static void PARAL_QEMU(releaseQemu)(QemuInstance* qemu, u8 reaped)
+{
+    char cmd[160];
+    if (!reaped) {
+        kill(qemu->pid, SIGKILL);
+        waitpid(qemu->pid, NULL, 0);
+    }
+    PARAL_QEMU(noteOrphanSlot)();
+    close(CTRLPIPE(qemu->pid));
+    close(CTRLPIPE(qemu->pid) + 1);
+    if (qemu->input_buf) {
+        shmdt(qemu->input_buf);
+        shmctl(qemu->input_shm_id, IPC_RMID, NULL);
+        qemu->input_buf = NULL;
+    }
+    if (qemu->stats) {
+        shmdt(qemu->stats);
+        shmctl(qemu->stats_shm_id, IPC_RMID, NULL);
+        qemu->stats = NULL;
+    }
+    if (qemu->trace_base) {
+        shmdt(qemu->trace_base);
+        shmctl(qemu->trace_shm_id, IPC_RMID, NULL);
+        qemu->trace_base = NULL;
+        qemu->dirty_base = NULL;
+    }
+    snprintf(cmd, sizeof(cmd), "rm -rf %s /tmp/afltracebits/trace_%d",
+             qemu->testcaseDir, qemu->pid);
+    system(cmd);
+    free(qemu->testcaseDir);
+    free(qemu->out_file);
+    qemu->out_file = NULL;
 }
 
 /*
@@ -138,14 +419,6 @@ void PARAL_QEMU(InitQemuQueue)(void)
 {
 	PARAL_QEMU(ParseQemuArgs)(qemu_argments, "s2earg.config");
 
-    system("rm -rf /tmp/afl_qemu_queue");
-	int res = mkfifo(QEMUQUEUE, 0777);
-	if (res != 0)
-		PFATAL("mkfifo() failed");
-    qemu_quene_fd = open(QEMUQUEUE, O_RDONLY|O_NONBLOCK); // we only need one queue here and set mode as read-only
-    if (qemu_quene_fd == -1)
-        PFATAL("Create qemu queue fifo failed.");
-
     if (access("/tmp/afltestcase", F_OK)) // for all testcases
         if (mkdir("/tmp/afltestcase", 0777))
             PFATAL("mkdir() failed");
@@ -157,81 +430,131 @@ void PARAL_QEMU(InitQemuQueue)(void)
     system("rm -rf /tmp/afltestcase/*");
     system("rm -rf /tmp/afltracebits/*");
 
+    // qemu arguments are kept, restarted and added qemus need them later.
     u8 i = 0;
-    allQemus = (QemuInstance*) malloc(parallel_qemu_num * sizeof(QemuInstance));
-    while (i < parallel_qemu_num) {
-        // set up control pipe
-        int fd[2];
-        if (pipe(fd) != 0)
-            PFATAL("pipe() failed");
-        pid_t pid = fork();
-        if (pid < 0)
-            PFATAL("fork() failed");
-        if (!pid) {
-            if (dup2(fd[1], CTRLPIPE(getpid()) + 1) < 0
-                                || dup2(fd[0], CTRLPIPE(getpid())) < 0) // Duplicate file descriptor before execv(), otherwise QEMU cannot access pipes forever.
-                exit(EXIT_FAILURE);
-            execv(QEMUEXECUTABLE, qemu_argments);
-            //execv(QEMUEXECUTABLE, qemu_argv);
-        } else {
-            INIT_QEMU(allQemus[i],pid);
-            u8* _tcDir = (u8*) malloc(128);
-            sprintf(_tcDir, "/tmp/afltestcase/%d/", pid);
-            if(access(_tcDir, F_OK))
-                mkdir(_tcDir, 0777);
-            allQemus[i].testcaseDir = _tcDir;
-            if (dup2(fd[1], CTRLPIPE(pid) + 1) < 0
-                    || dup2(fd[0], CTRLPIPE(pid)) < 0)
-                PFATAL("dup2() failed");
-            allQemus[i].ctrl_pipe = CTRLPIPE(pid) + 1;
-            sleep(10); // why not sleep for a while.
+    qemu_floor = parallel_qemu_num;
+    allQemus = (QemuInstance*) calloc(MAX(parallel_qemu_num, parallel_qemu_max), sizeof(QemuInstance));
+    atexit(PARAL_QEMU(removeInputBufs));
+    while (i < parallel_qemu_num)
+        PARAL_QEMU(spawnQemu)(&allQemus[i++]);
+    window_start_us = PARAL_QEMU(now_us)();
+}
+
+/*
+ * Called on the ready handshake: FuzzyS2E creates the bitmap before it publishes
+ * that, so there is nothing to wait for.
+ */
+void PARAL_QEMU(attachTracebits) (QemuInstance* qemu)
+{
+    key_t shmkey;
+    u8 _shmfile[128];
+    sprintf(_shmfile, "/tmp/afltracebits/trace_%d", qemu->pid);
+    if ((shmkey = ftok(_shmfile, 1)) < 0)
+        PFATAL("ftok() on '%s' failed", _shmfile);
+    int shm_id = shmget(shmkey, (map_size + TRACE_DIRTY_SIZE(map_size)) * QEMUBATCH_MAX,
+                        IPC_CREAT | 0600);
+    if (shm_id < 0)
+        PFATAL("shmget() failed");
+
+    void * __tracebits = shmat(shm_id, NULL, 0);
+    if (__tracebits == (void*) -1)
+        PFATAL("shmat() failed");
+
+    qemu->trace_shm_id = shm_id;
+    qemu->trace_base = (u8*) __tracebits;
+    qemu->trace_bits = (u8*) __tracebits;
+    qemu->dirty_base = qemu->trace_base + map_size * QEMUBATCH_MAX;
+    qemu->dirty = qemu->dirty_base;
+}
+
+/*
+ * Whether the test in flight has made no progress for longer than it may take.
+ * Drilled states are counted as progress, as drilling runs for as long as the
+ * test forks.
+ */
+static u8 PARAL_QEMU(stalled)(QemuInstance* qemu, u64 now)
+{
+    if (qemu->stats) {
+        u64 mark = qemu->stats->drilled + qemu->stats->drill_skipped;
+        if (mark != qemu->drill_mark) {
+            qemu->drill_mark = mark;
+            qemu->alive_us = now;
         }
-        i++;
     }
-    // free arguments staffs
-    int index = 0;
-    for (; index < 32; index++) {
-        if (!qemu_argments[index])
-            break;
-        else
-            free(qemu_argments[index]);
+    return now - qemu->alive_us > qemu->hang_us;
+}
+
+void PARAL_QEMU(Supervise)(void)
+{
+    static u64 last_check_us;
+    u64 now = PARAL_QEMU(now_us)();
+    u8 i;
+
+    if (now - last_check_us < QEMURING_WAIT_MS * 1000)
+        return;
+    last_check_us = now;
+
+    for (i = 0; i < parallel_qemu_num; i++) {
+        QemuInstance* qemu = &allQemus[i];
+        const char* why = NULL;
+        u8 reaped = 0;
+
+        if (waitpid(qemu->pid, NULL, WNOHANG) == qemu->pid) {
+            why = "died";
+            reaped = 1;
+        } else if (qemu->busy && !qemu->trace_base &&
+                 now - qemu->spawn_us > QEMU_BOOT_TIMEOUT * 1000000ULL)
+            why = "did not boot";
+        else if (qemu->busy && qemu->trace_base && qemu->start_us &&
+                 PARAL_QEMU(stalled)(qemu, now))
+            why = "hung";
+
+        if (!why)
+            continue;
+
+        WARNF("Qemu %u %s, restarting it.", qemu->pid, why);
+        if (qemu->busy && qemu->start_us && !qemu->handled)
+            process_lost_qemu(qemu);
+        PARAL_QEMU(releaseQemu)(qemu, reaped);
+        PARAL_QEMU(spawnQemu)(qemu);
+        qemu_restarts++;
     }
 }
 
-void PARAL_QEMU(setupTracebits) (void)
+u8 PARAL_QEMU(Rescale)(QemuInstance* qemu)
 {
-    u8 i = 0;
-    assert(allQemus);
-    while (i < parallel_qemu_num) {
-        key_t shmkey;
-        u8* _shmfile = (u8*) malloc(128);
-        if(!_shmfile)
-            PFATAL("Cannot allocate memory for _shmfile");
-        sprintf(_shmfile, "/tmp/afltracebits/trace_%d", allQemus[i].pid);
-        printf("[+]%s\n", _shmfile);
-        //hack
-        while(1){
-            if (!access(_shmfile, F_OK)){
-                break;
-            }else{
-                sleep(1);
-            }
-        }
-        if ((shmkey = ftok(_shmfile, 1)) < 0) {
-            free(_shmfile);
-            printf("ftok error:%s\n", strerror(errno));
-            PFATAL("ftok() failed");
-        }
-        free(_shmfile);
-        int shm_id = shmget(shmkey, MAP_SIZE, IPC_CREAT | 0600);
-        if (shm_id < 0)
-            PFATAL("shmget() failed");
+    u64 now = PARAL_QEMU(now_us)();
+    u32 starved;
+    double load;
+    long cores;
+
+    if (!parallel_qemu_max || now - window_start_us < QEMU_SCALE_SEC * 1000000ULL)
+        return 0;
+
+    starved = wait_us * 100 / (now - window_start_us);
+    wait_us = 0;
+    window_start_us = now;
 
-        void * __tracebits = shmat(shm_id, NULL, 0);
-        if (__tracebits == (void*) -1)
-            PFATAL("shmat() failed");
+    if (getloadavg(&load, 1) != 1)
+        return 0;
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
 
-        allQemus[i].trace_bits = (u8*) __tracebits;
-        i++;
+    if (starved >= QEMU_SCALE_UP_PERC && parallel_qemu_num < parallel_qemu_max &&
+            load + 1 <= cores) {
+        PARAL_QEMU(spawnQemu)(&allQemus[parallel_qemu_num++]);
+        OKF("Waited for qemus %u%% of the time, scaled up to %u.", starved, parallel_qemu_num);
+        return 0;
     }
+
+    if ((starved <= QEMU_SCALE_DOWN_PERC || load > cores * 1.5) &&
+            parallel_qemu_num > qemu_floor) {
+        PARAL_QEMU(releaseQemu)(qemu, 0);
+        // keep the live qemus packed at the front
+        *qemu = allQemus[--parallel_qemu_num];
+        memset(&allQemus[parallel_qemu_num], 0, sizeof(QemuInstance));
+        OKF("Waited for qemus %u%% of the time, scaled down to %u.", starved, parallel_qemu_num);
+        return 1;
+    }
+
+    return 0;
 }
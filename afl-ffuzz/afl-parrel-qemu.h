@@ -5,14 +5,158 @@
 #define glue(x, y) x ## y
 #define PARAL_QEMU(name) glue(parallel_qemu_, name)
 
-// Qemu queue as a FIFO file
-#define QEMUQUEUE "/tmp/afl_qemu_queue"
+// Share memory ID of the completion ring
+#define READYSHMID 1234
 
-// Read 512 bytes from FIFO each time
-#define FIFOBUFFERSIZE 512
+/*
+ * Completion ring shared by all qemu instances (producers) and AFL (the only
+ * consumer). A qemu publishes one fixed-size record each time it becomes free
+ * and then blocks on its control pipe, so there is never more than one record
+ * per instance in flight and QEMURING_SLOTS only has to exceed the maximum
+ * number of parallel instances. AFL sleeps on the futex word instead of
+ * polling; producers bump it after publishing and wake AFL only if it sleeps.
+ * NOTE: the layout MUST be equal to what in FuzzyS2E.h.
+ */
+#define QEMURING_SLOTS 64
 
-// Share memory ID
-#define READYSHMID 1234
+// How long AFL sleeps on the ring before re-checking (ms)
+#define QEMURING_WAIT_MS 1000
+
+/*
+ * Supervisor of the qemu instances. All instances boot in parallel and count as
+ * ready once their handshake record arrives. One that dies, does not finish
+ * booting within QEMU_BOOT_TIMEOUT (s) or sits on a test for too long is killed
+ * and respawned in its slot; the test in flight is dropped. A test may take
+ * QEMU_HANG_MULT times exec_tmout per mutant, and never less than
+ * QEMU_HANG_TIMEOUT (s, AFL_QEMU_HANG_TMOUT overrides it); a qemu drilling the
+ * test restarts the clock every time it finishes a drilled state.
+ * With -P min:max, every QEMU_SCALE_SEC the instance count grows by one if AFL
+ * spent at least QEMU_SCALE_UP_PERC of the time waiting for a free qemu and
+ * the host has an idle core, or shrinks by one if AFL hardly ever waited or
+ * the host is overloaded.
+ */
+#define QEMU_BOOT_TIMEOUT       600
+#define QEMU_HANG_TIMEOUT       60
+#define QEMU_HANG_MULT          10
+#define QEMU_SCALE_SEC          60
+#define QEMU_SCALE_UP_PERC      50
+#define QEMU_SCALE_DOWN_PERC    5
+
+typedef struct qemuDoneRecord{
+    u32         pid;            /* Pid of the qemu which became free    */
+    u32         fault;          /* Fault type of the finished test      */
+    u64         exec_us;        /* Execution time measured by qemu (us) */
+}QemuDoneRecord;
+
+typedef struct qemuDoneSlot{
+    volatile u32    seq;        /* Published when equal to position + 1 */
+    u32             pad;
+    QemuDoneRecord  rec;
+}QemuDoneSlot;
+
+typedef struct qemuDoneRing{
+    volatile u32    head;       /* Next position claimed by a qemu      */
+    volatile u32    tail;       /* Next position consumed by AFL        */
+    volatile u32    futex;      /* Bumped on every publish              */
+    volatile u32    waiters;    /* Non-zero while AFL sleeps on futex   */
+    QemuDoneSlot    slots[QEMURING_SLOTS];
+}QemuDoneRing;
+
+/*
+ * Per-instance testcase input buffer. AFL fills the spare half and flips cur, and
+ * FuzzyS2E injects buf[cur] straight into guest memory, so no file is created.
+ * Testcases larger than INPUTSHM_SIZE still go through the testcase directory.
+ * NOTE: the layout MUST be equal to what in FuzzyS2E.h.
+ */
+#define INPUTSHM_SIZE   MAX_FILE
+#define INPUTSHM_INFILE 0xffffffff  /* len marker: read the testcase file  */
+
+/* Flags of a half. Calibration runs repeat the same input on purpose, so they
+   must reach the target even if the testcase filter has seen it before. */
+
+#define INPUTSHM_F_CALIBRATE  1
+
+/* Deterministic stages may ship up to QEMUBATCH_MAX mutants of the same length
+   in one go. Each qemu has as many trace maps, and reports every mutant in the
+   results array of its input buffer before one completion record. */
+
+#define QEMUBATCH_MAX   16
+
+/* FuzzyS2E marks the 64-byte lines of a trace map it touches in a side bitmap,
+   so that AFL only resets and scans those. The QEMUBATCH_MAX side bitmaps
+   follow the trace maps in the same SHM region. MUST BE EQUAL to what in
+   FuzzyS2E.h. */
+
+#define TRACE_LINE_SHIFT        6
+#define TRACE_LINE_SIZE         (1 << TRACE_LINE_SHIFT)
+#define TRACE_DIRTY_SIZE(_map)  ((_map) >> (TRACE_LINE_SHIFT + 3))
+
+typedef struct qemuBatchResult{
+    u32         fault;          /* Fault type of the mutant             */
+    u32         pad;
+    u64         exec_us;        /* Execution time of the mutant (us)    */
+}QemuBatchResult;
+
+typedef struct qemuInputHalf{
+    volatile u32    len;        /* Testcase length or INPUTSHM_INFILE   */
+    volatile u32    count;      /* Number of mutants, each len bytes    */
+    volatile u32    flags;      /* INPUTSHM_F_*                         */
+    u8              data[INPUTSHM_SIZE];
+}QemuInputHalf;
+
+typedef struct qemuInputBuf{
+    volatile u32    cur;        /* Half holding the latest testcase     */
+    volatile u32    seq;        /* Bumped every time a testcase is put  */
+    QemuInputHalf   buf[2];
+    QemuBatchResult results[QEMUBATCH_MAX];
+}QemuInputBuf;
+
+/* Per-qemu telemetry block, written by qemu (and the dispatch phase by AFL).
+   Latencies are in us, kept in log-linear buckets: each power of two is split
+   into 1 << QSTAT_SUBBITS buckets, so any value is known within 25%. */
+
+#define QSTAT_SUBBITS   2
+#define QSTAT_BUCKETS   (32 << QSTAT_SUBBITS)
+
+enum {
+  /* 00 */ QPHASE_WAIT,         /* Idle, waiting for AFL's testcase     */
+  /* 01 */ QPHASE_FILTER,       /* TestcaseFilter evaluation            */
+  /* 02 */ QPHASE_COPY,         /* Testcase copied into the guest       */
+  /* 03 */ QPHASE_EXEC,         /* Target execution                     */
+  /* 04 */ QPHASE_TELL,         /* Reporting the result to AFL          */
+  /* 05 */ QPHASE_SOLVE,        /* Drilled testcase generation          */
+  /* 06 */ QPHASE_DISPATCH,     /* AFL: dispatch to completion          */
+  QPHASE_COUNT
+};
+
+typedef struct qemuPhaseStat{
+    u64         count;
+    u64         total_us;
+    u64         max_us;
+    u64         hist[QSTAT_BUCKETS];
+}QemuPhaseStat;
+
+typedef struct qemuStats{
+    u64         testcases;      /* Testcases received from AFL          */
+    u64         redundant;      /* Testcases found redundant by filter  */
+    u64         drilled;        /* Testcases generated by drilling      */
+    u64         drill_skipped;  /* Drilled states dropped before solving*/
+    u64         edges;          /* Distinct edges seen (exact edge keys)*/
+    u64         collisions;     /* Edges that landed on a taken slot    */
+    QemuPhaseStat phase[QPHASE_COUNT];
+}QemuStats;
+
+/* Histogram bucket of a latency. MUST BE EQUAL to qstat_bucket() in FuzzyS2E.h,
+   which fills the histograms AFL reads percentiles from. */
+
+static inline u32 qstat_bucket(u64 us) {
+  u32 msb, idx;
+  if (us < (1 << QSTAT_SUBBITS)) return us;
+  msb = 63 - __builtin_clzll(us);
+  idx = ((msb - QSTAT_SUBBITS + 1) << QSTAT_SUBBITS) +
+        ((us >> (msb - QSTAT_SUBBITS)) & ((1 << QSTAT_SUBBITS) - 1));
+  return idx < QSTAT_BUCKETS ? idx : QSTAT_BUCKETS - 1;
+}
 
 // Every control pipe (Do we need this?)
 /*
@@ -28,7 +172,10 @@
  */
 typedef struct qemuInstance{
     u32         pid;            /* Pid of current qemu instance         */
-    u8*         trace_bits;     /* Trace bits                           */
+    u8*         trace_bits;     /* Trace bits of the test being handled */
+    u8*         trace_base;     /* QEMUBATCH_MAX trace maps             */
+    u8*         dirty;          /* Touched lines of trace_bits          */
+    u8*         dirty_base;     /* QEMUBATCH_MAX touched line bitmaps   */
     u32         ctrl_pipe;      /* Control pipe for qemu                */
     u8*         testcaseDir;    /* Directory for testcase               */
     u64         start_us;       /* start time of a test (us)            */
@@ -41,21 +188,57 @@ typedef struct qemuInstance{
     u8          fault;          /* Fault type                           */
     s32         mod_off;        /* Modified offset                      */
     u8          cover_new;      /* Whether found sth. new               */
+    u8          new_bits;       /* has_new_bits() result on virgin_bits */
+    u32         cksum;          /* Classified trace hash (calibration)  */
+    u8          busy;           /* Dispatched and not reported back yet */
+    QemuInputBuf* input_buf;    /* Shared testcase buffer (may be NULL) */
+    s32         input_shm_id;   /* ID of the input buffer SHM region    */
+    u32         batch_n;        /* Mutants in the test, 1 if no batch   */
+    s32         batch_off[QEMUBATCH_MAX]; /* Modified offset per mutant */
+    QemuStats*  stats;          /* Telemetry block (may be NULL)        */
+    s32         stats_shm_id;   /* ID of the telemetry SHM region       */
+    s32         trace_shm_id;   /* ID of the trace bits SHM region      */
+    u64         spawn_us;       /* Time the process was started (us)    */
+    u64         hang_us;        /* Time the test in flight may take (us)*/
+    u64         alive_us;       /* Last sign of progress on the test    */
+    u64         drill_mark;     /* Drilled states seen at alive_us      */
+    u8*         sync_party;     /* Peer fuzzer of a STAGE_SYNC test     */
+    u32         sync_case;      /* Peer queue id of a STAGE_SYNC test   */
 }QemuInstance;
 
-// Set up ready share memory for qemu and afl.
+// Set up the completion ring share memory for qemu and afl.
 void PARAL_QEMU(SetupSHM4Ready)(void);
 
-// Initial QEMU ready FIFO (NOTE: use FIFO to speed up efficiency).
+// Spawn all the qemu instances, without waiting for them to boot.
 void PARAL_QEMU(InitQemuQueue) (void);
 
-// Set up trace-bits bitmap for each qemu instance.
-void PARAL_QEMU(setupTracebits) (void);
+// Restart dead or hung qemus. Cheap to call often, it checks once a second.
+void PARAL_QEMU(Supervise) (void);
+
+// Scale the number of qemus given a free one. Returns 1 if it was retired.
+u8 PARAL_QEMU(Rescale) (QemuInstance* qemu);
+
+// Pop one completion record, sleeping at most timeout_ms. Returns 0 on timeout.
+u8 PARAL_QEMU(PopDone) (QemuDoneRecord* rec, u32 timeout_ms);
+
+// Record one latency sample of the given phase.
+void PARAL_QEMU(RecordPhase) (QemuStats* stats, u32 phase, u64 us);
+
+// Latency below which the given percentage of samples fall (us).
+u64 PARAL_QEMU(PhasePercentile) (QemuPhaseStat* ps, double pct);
+
+// Attach the trace-bits bitmap a qemu created before its ready handshake.
+void PARAL_QEMU(attachTracebits) (QemuInstance* qemu);
 
 extern void process_unhandled_qemus();
+extern void process_lost_qemu(QemuInstance* qemu);
 extern u8 isAfterWait;
 extern u8 currentQemuAfterWait;
 
+/*
+ * A fresh qemu counts as busy until its first record (the ready handshake
+ * written once FuzzyS2E is initialized) shows up in the completion ring.
+ */
 #define INIT_QEMU(_qemu, _pid)    \
         _qemu.pid = _pid;      \
         _qemu.start_us = 0;     \
@@ -66,19 +249,19 @@ extern u8 currentQemuAfterWait;
         _qemu.cur_stage = 18;   \
         _qemu.cover_new = 1;    \
         _qemu.mod_off = -1;     \
-        ReadArray[_pid] = 1
+        _qemu.batch_n = 1;      \
+        _qemu.trace_base = NULL;  \
+        _qemu.trace_bits = NULL;  \
+        _qemu.dirty_base = NULL;  \
+        _qemu.dirty = NULL;       \
+        _qemu.sync_party = NULL;  \
+        _qemu.alive_us = 0;       \
+        _qemu.drill_mark = 0;     \
+        _qemu.busy = 1
 
 // Wait for all the qemus until they are all free and collect their results
 #define WAIT_ALLQEMUS_FREE               \
       do {       \
-        int i = 0;                      \
-        while (i < parallel_qemu_num) { \
-            if(ReadArray[allQemus[i].pid]) \
-                i++;            \
-            else{               \
-                i = 0;          \
-            }                   \
-        }                   \
         process_unhandled_qemus();  \
         isAfterWait = 1;           \
         currentQemuAfterWait = 0;   \
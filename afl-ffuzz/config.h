@@ -64,6 +64,12 @@
 #define CAL_CYCLES          8
 #define CAL_CYCLES_LONG     40
 
+#ifdef CONFIG_S2E
+/* Calibration runs per test case in S2E mode; they go to different qemus: */
+
+#define CAL_CYCLES_S2E      3
+#endif
+
 /* Number of subsequent hangs before abandoning an input file: */
 
 #define HANG_LIMIT          250
@@ -182,6 +188,28 @@
 
 #define EFF_MAX_PERC        90
 
+#ifdef CONFIG_S2E
+/* Directory where TestcaseFilter publishes, for every input length, a bitmap
+   of the input bytes that feed symbolic branches (<len>.map): */
+
+#define OFFS_DIR            "/tmp/afl_offsets"
+
+/* How often havoc picks one of those bytes when mutating a single spot (%): */
+
+#define SIG_HAVOC_PERC      50
+
+/* Maximum number of symbex testcases imported per call, so that a drill
+   burst is interleaved with mutation work instead of stalling it: */
+
+#define SYMBEX_IMPORT_MAX   64
+
+/* Environment variable enabling the virgin map shared by all fuzzers in the
+   sync directory, which lets a fuzzer skip peer entries when no peer has seen
+   anything it hasn't: */
+
+#define SYNC_VIRGIN_ENV_VAR "AFL_SYNC_VIRGIN"
+#endif
+
 /* UI refresh frequency (Hz): */
 
 #define UI_TARGET_HZ        5
@@ -265,6 +293,14 @@
 /* Environment variable used to pass virgin SHM ID to the called program. */
 
 #define VIRGIN_SHM_ENV_VAR         "__AFL_VIRGIN_SHM_ID"
+
+/* Environment variable used to pass the SHM ID of drilled branches. */
+
+#define DRILL_SHM_ENV_VAR          "__AFL_DRILL_SHM_ID"
+
+/* Environment variable used to pass the coverage map size to the qemus. */
+
+#define MAP_SIZE_ENV_VAR           "__AFL_MAP_SIZE"
 #endif
 
 /* Other less interesting, internal-only variables. */
@@ -325,6 +361,15 @@
 #define MAP_SIZE_POW2       16
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
 
+#ifdef CONFIG_S2E
+
+/* The S2E target is not compiled against the map size, so it can be raised
+   at startup with AFL_MAP_SIZE, up to this much: */
+
+#define MAP_SIZE_MAX        (1 << 23)
+
+#endif /* CONFIG_S2E */
+
 /* Maximum allocator request size (keep well under INT_MAX): */
 
 #define MAX_ALLOC           0x40000000
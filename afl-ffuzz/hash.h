@@ -33,26 +33,22 @@
 
 #define ROL64(_x, _r)  ((((u64)(_x)) << (_r)) | (((u64)(_x)) >> (64 - (_r))))
 
-static inline u32 hash32(const void* key, u32 len, u32 seed) {
-
-  const u64* data = (u64*)key;
-  u64 h1 = seed ^ len;
+/* One round and the finalizer of hash32(), exposed so that callers that
+   already walk a map word by word can hash it on the way. */
 
-  len >>= 3;
+static inline u64 hash64_round(u64 h1, u64 k1) {
 
-  while (len--) {
+  k1 *= 0x87c37b91114253d5ULL;
+  k1  = ROL64(k1, 31);
+  k1 *= 0x4cf5ad432745937fULL;
 
-    u64 k1 = *data++;
+  h1 ^= k1;
+  h1  = ROL64(h1, 27);
+  return h1 * 5 + 0x52dce729;
 
-    k1 *= 0x87c37b91114253d5ULL;
-    k1  = ROL64(k1, 31);
-    k1 *= 0x4cf5ad432745937fULL;
+}
 
-    h1 ^= k1;
-    h1  = ROL64(h1, 27);
-    h1  = h1 * 5 + 0x52dce729;
-
-  }
+static inline u32 hash64_final(u64 h1) {
 
   h1 ^= h1 >> 33;
   h1 *= 0xff51afd7ed558ccdULL;
@@ -64,6 +60,19 @@ static inline u32 hash32(const void* key, u32 len, u32 seed) {
 
 }
 
+static inline u32 hash32(const void* key, u32 len, u32 seed) {
+
+  const u64* data = (u64*)key;
+  u64 h1 = seed ^ len;
+
+  len >>= 3;
+
+  while (len--) h1 = hash64_round(h1, *data++);
+
+  return hash64_final(h1);
+
+}
+
 #else 
 
 #define ROL32(_x, _r)  ((((u32)(_x)) << (_r)) | (((u32)(_x)) >> (32 - (_r))))
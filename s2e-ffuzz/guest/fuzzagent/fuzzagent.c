@@ -57,12 +57,14 @@
 #define FUZZS2EGUESTPIPE 284
 #define FUZZS2EGUESTPIPE_CHILD 384
 #define MAXARGNUM 16 // we support at most 16 arguments
+#define MAXTESTCASE (1024 * 1024) // MUST BE EQUAL to the input buffer size in afl
 const char *g_s2etools_dir = NULL;
 const char *g_target_file = NULL;
 const char *g_target_code = NULL;
 const char *g_target_args[MAXARGNUM] =
 { NULL };
 int needSymwrite = 0;
+static char g_testcase_buf[MAXTESTCASE];
 
 static void print_usage(const char *prog_name)
 {
@@ -213,6 +215,18 @@ static int copy_file(const char *directory, const char *guest_file)
 
     s2e_wait_fuzzer_testcase();
 
+    // Fast path: the test case is injected into our buffer straight from AFL's shared memory
+    int tc_len = s2e_get_fuzzer_testcase(g_testcase_buf, sizeof(g_testcase_buf));
+    if (tc_len >= 0) {
+        if (write(fd, g_testcase_buf, tc_len) != tc_len) {
+            fprintf(stderr, "can not write to file\n");
+            exit(1);
+        }
+        close(fd);
+        free(path);
+        return 0;
+    }
+
     int s2e_fd = s2e_open(guest_file);
     if (s2e_fd == -1) {
         fprintf(stderr, "s2e_open of %s failed\n", guest_file);
@@ -341,6 +355,7 @@ int main(int argc, const char **argv)
         while (s2e_version() == 0)
             /* nothing */;
         printf("... S2E mode detected\n");
+        memset(g_testcase_buf, 0, sizeof(g_testcase_buf)); // make the test case buffer resident
         // Now let get into the main loop
         while (1) {
             copy_file("/tmp/testcase", g_target_file);
@@ -498,6 +498,21 @@ static inline void s2e_wait_work_state(void)
     );
 }
 
+/** Copy fuzzer's current test case into buf (at most size bytes).
+ *
+ * Returns the length of the test case, or -1 if it is not available through
+ * shared memory and has to be read with s2e_open/s2e_read instead.
+ * NOTE: buf must be resident, it is not touched here because it may be large. */
+static inline int s2e_get_fuzzer_testcase(char *buf, int size)
+{
+    int res;
+    __asm__ __volatile__(
+            S2E_INSTRUCTION_COMPLEX(EA, 07)
+            : "=a" (res) : "a" (-1), "c" (buf), "d" (size) : "memory"
+    );
+    return res;
+}
+
 /** output the target pid to s2e */
 static inline void s2e_notify_target_pid(int pid)
 {
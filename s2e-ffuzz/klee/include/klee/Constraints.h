@@ -62,6 +62,8 @@ using boost::enable_shared_from_this;
 class ConditionNode;
 typedef shared_ptr<ConditionNode> ConditionNodeRef;
 
+class IndependentPartition;
+
 class ConditionNode: public enable_shared_from_this<ConditionNode> {
 public:
     const ConditionNodeRef parent() const {
@@ -73,6 +75,19 @@ public:
     size_t depth() const {
         return depth_;
     }
+    // Order-independent hash of the constraints from the root down to here
+    uint64_t hash() const {
+        return hash_;
+    }
+
+    // Independence partition of the constraints up to here, filled in on
+    // demand by the independent solver
+    const shared_ptr<const IndependentPartition> &partition() const {
+        return partition_;
+    }
+    void setPartition(const shared_ptr<const IndependentPartition> &partition) {
+        partition_ = partition;
+    }
 
 protected:
     // Use weak_ptr here to enable automatic deallocation of nodes when they're
@@ -80,10 +95,20 @@ protected:
     typedef std::map<ref<Expr>, weak_ptr<ConditionNode> > AdjancencyMap;
 
     ConditionNode() :
-            depth_(0) {
+            depth_(0), hash_(0) {
     }
     ConditionNode(const ConditionNodeRef parent, const ref<Expr> expr) :
-            parent_(parent), expr_(expr), depth_(parent->depth_ + 1) {
+            parent_(parent), expr_(expr), depth_(parent->depth_ + 1),
+            hash_(parent->hash_ + mixHash(expr->hash())) {
+    }
+
+    // Spread the expression hash over 64 bits, so that the sum of a few
+    // thousands of them stays well distributed
+    static uint64_t mixHash(uint64_t h) {
+        h += 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
     }
 
     ConditionNodeRef getOrCreate(const ref<Expr> expr) {
@@ -102,11 +127,13 @@ private:
     const ConditionNodeRef parent_;
     const ref<Expr> expr_;
     size_t depth_;
+    uint64_t hash_;
+    shared_ptr<const IndependentPartition> partition_;
 
     friend class ConstraintManager;
 
-    // TODO: At some point in the future, add support for multiple solver
-    // sessions, one attached to each branch in this condition tree.
+    // Solver sessions are attached to branches of this tree by the Z3
+    // session solver (-end-solver-increm=sessions).
 };
 
 
@@ -204,6 +231,12 @@ public:
         return head_->depth();
     }
 
+    // Same for all constraint sets with the same constraints, whatever their
+    // order, without walking them
+    uint64_t hash() const {
+        return head_->hash();
+    }
+
     std::set<ref<Expr> > getConstraintSet() const {
         std::set<ref<Expr> > result;
         result.insert(begin(), end());
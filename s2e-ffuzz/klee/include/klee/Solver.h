@@ -179,6 +179,9 @@ namespace klee {
       static Z3Solver *createResetSolver();
       static Z3Solver *createStackSolver();
       static Z3Solver *createAssumptionSolver();
+      static Z3Solver *createSessionSolver();
+      static Z3Solver *createPortfolioSolver();
+      static Z3Solver *createPortfolioSolver(const std::vector<std::string> &members);
 
   private:
       Z3Solver(SolverImpl *impl);
@@ -206,6 +209,16 @@ namespace klee {
   /// \param s - The underlying solver to use.
   Solver *createCachingSolver(Solver *s);
 
+  /// createSharedCachingSolver - Create a solver which caches validity
+  /// results and models in a file mapped by all the processes using
+  /// it, with bounded size. Returns s if the file cannot be mapped.
+  ///
+  /// \param s - The underlying solver to use.
+  /// \param path - The cache file, created if needed.
+  /// \param size - The size of the cache file in bytes.
+  Solver *createSharedCachingSolver(Solver *s, const std::string &path,
+                                    uint64_t size);
+
   /// createCexCachingSolver - Create a counterexample caching solver. This is a
   /// more sophisticated cache which records counterexamples for a constraint
   /// set and uses subset/superset relations among constraints to try and
@@ -16,6 +16,10 @@ namespace klee {
 namespace stats {
 
   extern Statistic cexCacheTime;
+  extern Statistic portfolioAssumptionWins;
+  extern Statistic portfolioResetWins;
+  extern Statistic portfolioRestarts;
+  extern Statistic portfolioStackWins;
   extern Statistic queries;
   extern Statistic queriesInvalid;
   extern Statistic queriesValid;
@@ -25,6 +29,8 @@ namespace stats {
   extern Statistic queryConstructs;
   extern Statistic queryCounterexamples;
   extern Statistic queryTime;
+  extern Statistic sharedCacheHits;
+  extern Statistic sharedCacheMisses;
 
 }
 }
@@ -57,7 +57,9 @@ cl::opt<EndSolverType> EndSolver("end-solver", cl::desc("End solver to use"),
 enum SolverIncrementalityType {
     INCREMENTAL_NONE,
     INCREMENTAL_STACK,
-    INCREMENTAL_ASSUMPTIONS
+    INCREMENTAL_ASSUMPTIONS,
+    INCREMENTAL_SESSIONS,
+    INCREMENTAL_PORTFOLIO
 };
 
 
@@ -67,6 +69,8 @@ cl::opt<SolverIncrementalityType> SolverIncrementality("end-solver-increm",
                 clEnumValN(INCREMENTAL_NONE, "none", "No incrementality"),
                 clEnumValN(INCREMENTAL_STACK, "stack", "Context stack incrementality"),
                 clEnumValN(INCREMENTAL_ASSUMPTIONS, "assumptions", "Assumption-based incrementality"),
+                clEnumValN(INCREMENTAL_SESSIONS, "sessions", "Context stacks kept for several condition tree branches"),
+                clEnumValN(INCREMENTAL_PORTFOLIO, "portfolio", "Members of -z3-portfolio in parallel, first answer wins"),
                 clEnumValEnd),
         cl::init(INCREMENTAL_NONE));
 
@@ -99,6 +103,16 @@ UseCache("use-cache",
          cl::init(true),
      cl::desc("Use validity caching"));
 
+cl::opt<std::string>
+SharedSolverCache("shared-solver-cache",
+                  cl::init(""),
+        cl::desc("File of a solver cache shared with the other instances using it (none by default)"));
+
+cl::opt<unsigned>
+SharedSolverCacheSize("shared-solver-cache-size",
+                      cl::init(64),
+        cl::desc("Size of the shared solver cache in MB"));
+
 cl::opt<bool>
 UseIndependentSolver("use-independent-solver",
                      cl::init(true),
@@ -130,6 +144,10 @@ Solver *DefaultSolverFactory::createEndSolver() {
             return Z3Solver::createStackSolver();
         case INCREMENTAL_ASSUMPTIONS:
             return Z3Solver::createAssumptionSolver();
+        case INCREMENTAL_SESSIONS:
+            return Z3Solver::createSessionSolver();
+        case INCREMENTAL_PORTFOLIO:
+            return Z3Solver::createPortfolioSolver();
         }
 #else
         assert(false && "Z3 support not compiled");
@@ -147,6 +165,12 @@ Solver *DefaultSolverFactory::decorateSolver(Solver *end_solver) {
             ih_->getOutputFilename("stp-queries.qlog"));
     }
 
+    // Last before the end solver, behind the cheaper private caches
+    if (!SharedSolverCache.empty()) {
+        solver = createSharedCachingSolver(solver, SharedSolverCache,
+                (uint64_t) SharedSolverCacheSize << 20);
+    }
+
     if (UseFastCexSolver)
         solver = createFastCexSolver(solver);
 
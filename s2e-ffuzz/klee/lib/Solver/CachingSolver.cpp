@@ -49,13 +49,9 @@ private:
 
     struct CacheEntryHash {
         unsigned operator()(const CacheEntry &ce) const {
-            unsigned result = ce.query->hash();
+            uint64_t h = ce.constraints.hash();
 
-            for (ConstraintManager::const_iterator it = ce.constraints.begin();
-                 it != ce.constraints.end(); ++it)
-                result ^= ce.constraints.toExpr((*it))->hash();
-
-            return result;
+            return ce.query->hash() ^ (unsigned) (h ^ (h >> 32));
         }
     };
 
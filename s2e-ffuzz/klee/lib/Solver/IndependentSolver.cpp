@@ -14,258 +14,284 @@
 #include "klee/SolverImpl.h"
 
 #include "klee/util/ExprUtil.h"
+#include "klee/Internal/ADT/ImmutableMap.h"
 
-#include <map>
+#include <boost/make_shared.hpp>
+
+#include <algorithm>
 #include <vector>
-#include <ostream>
-#include <iostream>
 
 using namespace klee;
 using namespace llvm;
 
-template<class T>
-class DenseSet {
-    typedef std::set<T> set_ty;
-    set_ty s;
-
+namespace klee {
+
+/// IndependentPartition - Union-find partition of the constraints of a path
+/// by the array bytes they read. Two constraints are in the same class iff
+/// they are connected by constraints reading common bytes, where reading an
+/// array at a symbolic index reads all of it.
+///
+/// Partitions are persistent: adding a constraint makes a new partition that
+/// shares most of its structure with the old one, so that every node of the
+/// condition tree can keep its own (see getPartition()).
+class IndependentPartition {
 public:
-    DenseSet() {}
+    typedef std::pair<const Array*, unsigned> Element;
 
-    void add(T x) {
-        s.insert(x);
-    }
-    void add(T start, T end) {
-        for (; start<end; start++)
-            s.insert(start);
-    }
+    // Element standing for all bytes of an array
+    static const unsigned WholeObject = ~0u;
 
-    // returns true iff set is changed by addition
-    bool add(const DenseSet &b) {
-        bool modified = false;
-        for (typename set_ty::const_iterator it = b.s.begin(), ie = b.s.end();
-             it != ie; ++it) {
-            if (modified || !s.count(*it)) {
-                modified = true;
-                s.insert(*it);
-            }
-        }
-        return modified;
-    }
+    IndependentPartition() {}
 
-    bool intersects(const DenseSet &b) {
-        for (typename set_ty::iterator it = s.begin(), ie = s.end();
-             it != ie; ++it)
-            if (b.s.count(*it))
-                return true;
-        return false;
-    }
+    /// Partition with one more constraint
+    IndependentPartition add(ref<Expr> e) const;
 
-    void print(llvm::raw_ostream &os) const {
-        bool first = true;
-        os << "{";
-        for (typename set_ty::iterator it = s.begin(), ie = s.end();
-             it != ie; ++it) {
-            if (first) {
-                first = false;
-            } else {
-                os << ",";
+    /// Constraints of the classes reading some byte that e reads
+    void getRequired(ref<Expr> e, std::vector< ref<Expr> > &result) const;
+
+private:
+    // Constraints of a class, concatenated in O(1)
+    struct Group;
+    typedef boost::shared_ptr<const Group> GroupRef;
+
+    struct Group {
+        Group(ref<Expr> _expr) : expr(_expr) {}
+        Group(GroupRef _left, GroupRef _right) : left(_left), right(_right) {}
+
+        // Groups grow one constraint at a time into left-deep chains, which
+        // nested destructors would free recursively. Unlink the children we
+        // own alone first, so that each of them dies without any.
+        ~Group() {
+            std::vector<GroupRef> pending;
+            unlink(left, pending);
+            unlink(right, pending);
+            while (!pending.empty()) {
+                GroupRef g;
+                g.swap(pending.back());
+                pending.pop_back();
+                if (g.use_count() == 1) {
+                    unlink(g->left, pending);
+                    unlink(g->right, pending);
+                }
             }
-            os << *it;
         }
-        os << "}";
+
+        static void unlink(GroupRef &g, std::vector<GroupRef> &pending) {
+            if (!g)
+                return;
+            pending.push_back(GroupRef());
+            pending.back().swap(g);
+        }
+
+        // Mutable only so that the destructor can unlink them
+        mutable GroupRef left, right;
+        ref<Expr> expr;
+    };
+
+    struct Class {
+        Class() : elements(0) {}
+        Class(size_t _elements, GroupRef _constraints)
+            : elements(_elements), constraints(_constraints) {}
+
+        size_t elements;
+        GroupRef constraints;
+    };
+
+    // Union by size, no path compression as the maps are shared
+    typedef ImmutableMap<Element, Element> ParentMap;
+    typedef ImmutableMap<Element, Class> ClassMap;
+
+    static void getElements(ref<Expr> e, std::vector<Element> &result);
+    static GroupRef concat(GroupRef a, GroupRef b);
+
+    bool contains(const Element &e) const {
+        return parents_.count(e) || classes_.count(e);
     }
+
+    Element find(Element e) const;
+    void arrayElements(const Array *array, std::vector<Element> &result) const;
+    void insert(const Element &e);
+    void unite(const Element &a, const Element &b);
+
+    ParentMap parents_;
+    ClassMap classes_;
 };
 
-template<class T>
-inline llvm::raw_ostream &operator<<(llvm::raw_ostream &os, const DenseSet<T> &dis) {
-    dis.print(os);
-    return os;
-}
 
-class IndependentElementSet {
-    typedef std::map<const Array*, DenseSet<unsigned> > elements_ty;
-    elements_ty elements;
-    std::set<const Array*> wholeObjects;
+void IndependentPartition::getElements(ref<Expr> e, std::vector<Element> &result) {
+    std::vector< ref<ReadExpr> > reads;
+    findReads(e, /* visitUpdates= */ true, reads);
+    for (unsigned i = 0; i != reads.size(); ++i) {
+        ReadExpr *re = reads[i].get();
+        const Array *array = re->getUpdates().getRoot();
 
-public:
-    IndependentElementSet() {}
-    IndependentElementSet(ref<Expr> e) {
-        std::vector< ref<ReadExpr> > reads;
-        findReads(e, /* visitUpdates= */ true, reads);
-        for (unsigned i = 0; i != reads.size(); ++i) {
-            ReadExpr *re = reads[i].get();
-            const Array *array = re->getUpdates().getRoot();
-
-            // Reads of a constant array don't alias.
-            if (re->getUpdates().getRoot()->isConstantArray() &&
-                    !re->getUpdates().getHead())
-                continue;
+        // Reads of a constant array don't alias.
+        if (array->isConstantArray() && !re->getUpdates().getHead())
+            continue;
 
-            if (!wholeObjects.count(array)) {
-                if (ConstantExpr *CE = dyn_cast<ConstantExpr>(re->getIndex())) {
-                    DenseSet<unsigned> &dis = elements[array];
-                    dis.add((unsigned) CE->getZExtValue(32));
-                } else {
-                    elements_ty::iterator it2 = elements.find(array);
-                    if (it2!=elements.end())
-                        elements.erase(it2);
-                    wholeObjects.insert(array);
-                }
-            }
+        if (ConstantExpr *CE = dyn_cast<ConstantExpr>(re->getIndex())) {
+            result.push_back(Element(array, (unsigned) CE->getZExtValue(32)));
+        } else {
+            result.push_back(Element(array, WholeObject));
         }
     }
-    IndependentElementSet(const IndependentElementSet &ies) :
-        elements(ies.elements),
-        wholeObjects(ies.wholeObjects) {}
-
-    IndependentElementSet &operator=(const IndependentElementSet &ies) {
-        elements = ies.elements;
-        wholeObjects = ies.wholeObjects;
-        return *this;
+}
+
+IndependentPartition::GroupRef IndependentPartition::concat(GroupRef a, GroupRef b) {
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    return GroupRef(new Group(a, b));
+}
+
+IndependentPartition::Element IndependentPartition::find(Element e) const {
+    while (const ParentMap::value_type *parent = parents_.lookup(e))
+        e = parent->second;
+    return e;
+}
+
+void IndependentPartition::arrayElements(const Array *array,
+                                         std::vector<Element> &result) const {
+    for (ParentMap::iterator it = parents_.lower_bound(Element(array, 0)),
+         ie = parents_.end(); it != ie && it->first.first == array; ++it)
+        result.push_back(it->first);
+    for (ClassMap::iterator it = classes_.lower_bound(Element(array, 0)),
+         ie = classes_.end(); it != ie && it->first.first == array; ++it)
+        result.push_back(it->first);
+}
+
+void IndependentPartition::insert(const Element &e) {
+    if (contains(e))
+        return;
+
+    const Element whole(e.first, WholeObject);
+    std::vector<Element> others;
+
+    if (e.second == WholeObject) {
+        arrayElements(e.first, others);
+    } else if (contains(whole)) {
+        others.push_back(whole);
     }
 
-    void print(llvm::raw_ostream &os) const {
-        os << "{";
-        bool first = true;
-        for (std::set<const Array*>::iterator it = wholeObjects.begin(),
-             ie = wholeObjects.end(); it != ie; ++it) {
-            const Array *array = *it;
+    classes_ = classes_.insert(std::make_pair(e, Class(1, GroupRef())));
 
-            if (first) {
-                first = false;
-            } else {
-                os << ", ";
-            }
+    for (unsigned i = 0; i != others.size(); ++i)
+        unite(e, others[i]);
+}
 
-            os << "MO" << array->getName();
-        }
-        for (elements_ty::const_iterator it = elements.begin(), ie = elements.end();
-             it != ie; ++it) {
-            const Array *array = it->first;
-            const DenseSet<unsigned> &dis = it->second;
+void IndependentPartition::unite(const Element &a, const Element &b) {
+    Element ra = find(a), rb = find(b);
+    if (ra == rb)
+        return;
 
-            if (first) {
-                first = false;
-            } else {
-                os << ", ";
-            }
+    Class ca = classes_.lookup(ra)->second;
+    Class cb = classes_.lookup(rb)->second;
+    if (ca.elements < cb.elements) {
+        std::swap(ra, rb);
+        std::swap(ca, cb);
+    }
 
-            os << "MO" << array->getName() << " : " << dis;
-        }
-        os << "}";
+    parents_ = parents_.insert(std::make_pair(rb, ra));
+    classes_ = classes_.remove(rb).replace(std::make_pair(ra,
+            Class(ca.elements + cb.elements, concat(ca.constraints, cb.constraints))));
+}
+
+IndependentPartition IndependentPartition::add(ref<Expr> e) const {
+    IndependentPartition result(*this);
+    std::vector<Element> elements;
+    getElements(e, elements);
+
+    // Nothing can depend on a constraint without symbolic reads
+    if (elements.empty())
+        return result;
+
+    for (unsigned i = 0; i != elements.size(); ++i) {
+        result.insert(elements[i]);
+        result.unite(elements[0], elements[i]);
     }
 
-    // more efficient when this is the smaller set
-    bool intersects(const IndependentElementSet &b) {
-        for (std::set<const Array*>::iterator it = wholeObjects.begin(),
-             ie = wholeObjects.end(); it != ie; ++it) {
-            const Array *array = *it;
-            if (b.wholeObjects.count(array) ||
-                    b.elements.find(array) != b.elements.end())
-                return true;
-        }
-        for (elements_ty::iterator it = elements.begin(), ie = elements.end();
-             it != ie; ++it) {
-            const Array *array = it->first;
-            if (b.wholeObjects.count(array))
-                return true;
-            elements_ty::const_iterator it2 = b.elements.find(array);
-            if (it2 != b.elements.end()) {
-                if (it->second.intersects(it2->second))
-                    return true;
-            }
+    Element root = result.find(elements[0]);
+    const Class &c = result.classes_.lookup(root)->second;
+    result.classes_ = result.classes_.replace(std::make_pair(root,
+            Class(c.elements, concat(c.constraints, GroupRef(new Group(e))))));
+
+    return result;
+}
+
+void IndependentPartition::getRequired(ref<Expr> e,
+                                       std::vector< ref<Expr> > &result) const {
+    std::vector<Element> elements, roots;
+    getElements(e, elements);
+
+    for (unsigned i = 0; i != elements.size(); ++i) {
+        const Element &el = elements[i];
+        const Element whole(el.first, WholeObject);
+
+        if (contains(el)) {
+            roots.push_back(find(el));
+        } else if (contains(whole)) {
+            roots.push_back(find(whole));
+        } else if (el.second == WholeObject) {
+            std::vector<Element> others;
+            arrayElements(el.first, others);
+            for (unsigned j = 0; j != others.size(); ++j)
+                roots.push_back(find(others[j]));
         }
-        return false;
     }
 
-    // returns true iff set is changed by addition
-    bool add(const IndependentElementSet &b) {
-        bool modified = false;
-        for (std::set<const Array*>::const_iterator it = b.wholeObjects.begin(),
-             ie = b.wholeObjects.end(); it != ie; ++it) {
-            const Array *array = *it;
-            elements_ty::iterator it2 = elements.find(array);
-            if (it2!=elements.end()) {
-                modified = true;
-                elements.erase(it2);
-                wholeObjects.insert(array);
+    std::sort(roots.begin(), roots.end());
+    roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+
+    std::vector<GroupRef> stack;
+    for (unsigned i = 0; i != roots.size(); ++i) {
+        stack.push_back(classes_.lookup(roots[i])->second.constraints);
+        while (!stack.empty()) {
+            GroupRef g = stack.back();
+            stack.pop_back();
+            if (!g)
+                continue;
+            if (g->left) {
+                stack.push_back(g->right);
+                stack.push_back(g->left);
             } else {
-                if (!wholeObjects.count(array)) {
-                    modified = true;
-                    wholeObjects.insert(array);
-                }
+                result.push_back(g->expr);
             }
         }
-        for (elements_ty::const_iterator it = b.elements.begin(),
-             ie = b.elements.end(); it != ie; ++it) {
-            const Array *array = it->first;
-            if (!wholeObjects.count(array)) {
-                elements_ty::iterator it2 = elements.find(array);
-                if (it2==elements.end()) {
-                    modified = true;
-                    elements.insert(*it);
-                } else {
-                    if (it2->second.add(it->second))
-                        modified = true;
-                }
-            }
-        }
-        return modified;
     }
-};
+}
 
-inline llvm::raw_ostream &operator<<(llvm::raw_ostream &os, const IndependentElementSet &ies) {
-    ies.print(os);
-    return os;
 }
 
-static
-IndependentElementSet getIndependentConstraints(const Query& query,
-                                                std::vector< ref<Expr> > &result) {
-    IndependentElementSet eltsClosure(query.expr);
-    std::vector< std::pair<ref<Expr>, IndependentElementSet> > worklist;
-
-    for (ConstraintManager::const_iterator it = query.constraints.begin(),
-         ie = query.constraints.end(); it != ie; ++it) {
-        ref<Expr> e = query.constraints.toExpr(*it);
-        worklist.push_back(std::make_pair(e, IndependentElementSet(e)));
+/// Partition of the constraints up to the given node, computed from the
+/// closest ancestor that has one and kept in the nodes on the way.
+static boost::shared_ptr<const IndependentPartition> getPartition(ConditionNodeRef node) {
+    std::vector<ConditionNodeRef> missing;
+    while (node && !node->partition()) {
+        missing.push_back(node);
+        node = node->parent();
     }
 
-    // XXX This should be more efficient (in terms of low level copy stuff).
-    bool done = false;
-    do {
-        done = true;
-        std::vector< std::pair<ref<Expr>, IndependentElementSet> > newWorklist;
-        for (std::vector< std::pair<ref<Expr>, IndependentElementSet> >::iterator
-             it = worklist.begin(), ie = worklist.end(); it != ie; ++it) {
-            if (it->second.intersects(eltsClosure)) {
-                if (eltsClosure.add(it->second))
-                    done = false;
-                result.push_back(it->first);
-            } else {
-                newWorklist.push_back(*it);
-            }
-        }
-        worklist.swap(newWorklist);
-    } while (!done);
-
-    if (0) {
-        std::set< ref<Expr> > reqset(result.begin(), result.end());
-        llvm::errs() << "--\n";
-        llvm::errs() << "Q: " << query.expr << "\n";
-        llvm::errs() << "\telts: " << IndependentElementSet(query.expr) << "\n";
-        int i = 0;
-        for (ConstraintManager::const_iterator it = query.constraints.begin(),
-             ie = query.constraints.end(); it != ie; ++it) {
-            ref<Expr> e = query.constraints.toExpr(*it);
-            llvm::errs() << "C" << i++ << ": " << e;
-            llvm::errs() << " " << (reqset.count(e) ? "(required)" : "(independent)") << "\n";
-            llvm::errs() << "\telts: " << IndependentElementSet(e) << "\n";
+    boost::shared_ptr<const IndependentPartition> partition =
+            node ? node->partition() : boost::make_shared<IndependentPartition>();
+
+    for (std::vector<ConditionNodeRef>::reverse_iterator it = missing.rbegin(),
+         ie = missing.rend(); it != ie; ++it) {
+        // The root does not hold a constraint
+        if ((*it)->parent()) {
+            partition = boost::make_shared<IndependentPartition>(
+                    partition->add((*it)->expr()));
         }
-        llvm::errs() << "elts closure: " << eltsClosure << "\n";
+        (*it)->setPartition(partition);
     }
 
-    return eltsClosure;
+    return partition;
+}
+
+static
+void getIndependentConstraints(const Query& query,
+                               std::vector< ref<Expr> > &result) {
+    getPartition(query.constraints.head())->getRequired(query.expr, result);
 }
 
 class IndependentSolver : public SolverImpl {
@@ -292,8 +318,7 @@ public:
 bool IndependentSolver::computeValidity(const Query& query,
                                         Solver::Validity &result) {
     std::vector< ref<Expr> > required;
-    IndependentElementSet eltsClosure =
-            getIndependentConstraints(query, required);
+    getIndependentConstraints(query, required);
     ConstraintManager tmp(required);
     return solver->impl->computeValidity(Query(tmp, query.expr),
                                          result);
@@ -301,8 +326,7 @@ bool IndependentSolver::computeValidity(const Query& query,
 
 bool IndependentSolver::computeTruth(const Query& query, bool &isValid) {
     std::vector< ref<Expr> > required;
-    IndependentElementSet eltsClosure =
-            getIndependentConstraints(query, required);
+    getIndependentConstraints(query, required);
     ConstraintManager tmp(required);
     return solver->impl->computeTruth(Query(tmp, query.expr),
                                       isValid);
@@ -310,8 +334,7 @@ bool IndependentSolver::computeTruth(const Query& query, bool &isValid) {
 
 bool IndependentSolver::computeValue(const Query& query, ref<Expr> &result) {
     std::vector< ref<Expr> > required;
-    IndependentElementSet eltsClosure =
-            getIndependentConstraints(query, required);
+    getIndependentConstraints(query, required);
     ConstraintManager tmp(required);
     return solver->impl->computeValue(Query(tmp, query.expr), result);
 }
@@ -322,6 +345,5 @@ Solver *klee::createIndependentSolver(Solver *s) {
 
 void klee::getIndependentConstraintsForQuery(const Query &query, std::vector< ref<Expr> > &required)
 {
-    IndependentElementSet eltsClosure =
-            getIndependentConstraints(query, required);
+    getIndependentConstraints(query, required);
 }
@@ -0,0 +1,561 @@
+//===-- SharedCachingSolver.cpp -------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "klee/Solver.h"
+
+#include "klee/Constraints.h"
+#include "klee/Expr.h"
+#include "klee/IncompleteSolver.h"
+#include "klee/SolverImpl.h"
+#include "klee/SolverStats.h"
+#include "klee/Common.h"
+#include "klee/util/ExprHashMap.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+#include <algorithm>
+
+using namespace klee;
+
+namespace {
+
+/// Results are keyed by a 128-bit structural hash of the query, built from
+/// array names and contents rather than pointers, so that it is the same in
+/// every process.
+struct QueryKey {
+    uint64_t a, b;
+
+    QueryKey() : a(0), b(0) {}
+    QueryKey(uint64_t _a, uint64_t _b) : a(_a), b(_b) {}
+
+    bool operator==(const QueryKey &k) const {
+        return a == k.a && b == k.b;
+    }
+};
+
+inline uint64_t mix64(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+inline void combine(QueryKey &k, uint64_t v) {
+    k.a = mix64(k.a ^ v) + 0x9e3779b97f4a7c15ULL;
+    k.b = mix64(k.b + v * 0xc2b2ae3d27d4eb4fULL) ^ 0x165667b19e3779f9ULL;
+}
+
+/// Layout of the cache file: a header followed by slotCount slots, grouped
+/// in buckets of CACHE_WAYS slots evicted by age, and by an arena of
+/// arenaSize bytes holding the models. Half of the file goes to each.
+#define CACHE_MAGIC     0x53324543414348ULL // "S2ECACH"
+#define CACHE_VERSION   3
+#define CACHE_WAYS      4
+
+struct CacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    volatile uint64_t clock;
+    uint64_t arenaSize;
+    volatile uint64_t arenaHead;
+    uint8_t pad[24];
+};
+
+/// Slots are guarded by a sequence lock: writers make seq odd while they
+/// update the slot, readers retry or give up when seq changed under them.
+/// The lock word also holds the pid of the last writer in its high half, so
+/// that a slot left locked by a writer that died can be taken over.
+/// A model is at arena position offset, and is gone once the arena head
+/// went more than arenaSize past it.
+struct CacheSlot {
+    volatile uint64_t seq;
+    uint64_t key[2];
+    volatile uint64_t stamp;
+    uint32_t kind;
+    uint32_t result;
+    uint32_t size;
+    uint32_t pad;
+    uint64_t offset;
+    uint64_t reserved;
+};
+
+inline uint64_t lockWord(pid_t writer, uint32_t count) {
+    return ((uint64_t) writer << 32) | count;
+}
+
+enum CacheKind {
+    CACHE_VALIDITY = 1,
+    CACHE_MODEL = 2
+};
+
+class SharedCache {
+public:
+    static SharedCache *open(const std::string &path, uint64_t size);
+    ~SharedCache();
+
+    bool lookup(const QueryKey &key, uint32_t kind, uint32_t &result,
+                std::vector<unsigned char> *data);
+    void insert(const QueryKey &key, uint32_t kind, uint32_t result,
+                const std::vector<unsigned char> *data);
+
+private:
+    SharedCache(CacheHeader *header, size_t mapSize)
+        : header_(header), slots_((CacheSlot*) (header + 1)),
+          arena_((uint8_t*) (slots_ + header->slotCount)), mapSize_(mapSize) {}
+
+    CacheSlot *bucket(const QueryKey &key) {
+        return slots_ + (key.a % (header_->slotCount / CACHE_WAYS)) * CACHE_WAYS;
+    }
+
+    uint64_t allocate(uint32_t size);
+
+    CacheHeader *header_;
+    CacheSlot *slots_;
+    uint8_t *arena_;
+    size_t mapSize_;
+};
+
+
+SharedCache *SharedCache::open(const std::string &path, uint64_t size) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return NULL;
+
+    // Only one process (re)initializes the file
+    flock(fd, LOCK_EX);
+
+    CacheHeader header;
+    struct stat st;
+    bool valid = !fstat(fd, &st) && st.st_size >= (off_t) sizeof(header) &&
+            pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            header.magic == CACHE_MAGIC && header.version == CACHE_VERSION &&
+            header.slotCount >= CACHE_WAYS && header.arenaSize &&
+            (uint64_t) st.st_size == sizeof(header) + (uint64_t) header.slotCount * sizeof(CacheSlot) +
+                                     header.arenaSize;
+
+    if (!valid) {
+        memset(&header, 0, sizeof(header));
+        header.magic = CACHE_MAGIC;
+        header.version = CACHE_VERSION;
+        header.slotCount = std::max<uint64_t>(size / 2 / sizeof(CacheSlot), CACHE_WAYS) / CACHE_WAYS * CACHE_WAYS;
+        header.arenaSize = std::max<uint64_t>(size / 2, 4096);
+
+        if (ftruncate(fd, 0) ||
+            ftruncate(fd, sizeof(header) + (uint64_t) header.slotCount * sizeof(CacheSlot) +
+                          header.arenaSize) ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            flock(fd, LOCK_UN);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    flock(fd, LOCK_UN);
+
+    size_t mapSize = sizeof(header) + (size_t) header.slotCount * sizeof(CacheSlot) + header.arenaSize;
+    void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    return new SharedCache((CacheHeader*) map, mapSize);
+}
+
+SharedCache::~SharedCache() {
+    munmap(header_, mapSize_);
+}
+
+bool SharedCache::lookup(const QueryKey &key, uint32_t kind, uint32_t &result,
+                         std::vector<unsigned char> *data) {
+    CacheSlot *slot = bucket(key);
+
+    for (unsigned w = 0; w < CACHE_WAYS; w++, slot++) {
+        uint64_t seq = slot->seq;
+        if ((seq & 1) || slot->key[0] != key.a || slot->key[1] != key.b || slot->kind != kind)
+            continue;
+        __sync_synchronize();
+
+        uint32_t res = slot->result, size = slot->size;
+        uint64_t stamp = slot->stamp;
+        uint64_t offset = slot->offset, start = offset % header_->arenaSize;
+        if (data) {
+            if (start + size > header_->arenaSize)
+                continue;
+            data->assign(arena_ + start, arena_ + start + size);
+        }
+
+        __sync_synchronize();
+        if (slot->seq != seq || slot->key[0] != key.a || slot->key[1] != key.b)
+            continue;
+        if (data && header_->arenaHead - offset > header_->arenaSize)
+            continue; // overwritten while we copied it
+
+        // Unless a writer got to the slot since
+        __sync_bool_compare_and_swap(&slot->stamp, stamp, header_->clock);
+        result = res;
+        return true;
+    }
+
+    return false;
+}
+
+/// Reserve size contiguous bytes of the arena, wrapping around rather than
+/// splitting them. Returns their position.
+uint64_t SharedCache::allocate(uint32_t size) {
+    uint64_t head, start;
+
+    do {
+        head = header_->arenaHead;
+        start = head;
+        if (start % header_->arenaSize + size > header_->arenaSize)
+            start += header_->arenaSize - start % header_->arenaSize;
+    } while (!__sync_bool_compare_and_swap(&header_->arenaHead, head, start + size));
+
+    return start;
+}
+
+void SharedCache::insert(const QueryKey &key, uint32_t kind, uint32_t result,
+                         const std::vector<unsigned char> *data) {
+    uint64_t offset = 0;
+    if (data && !data->empty()) {
+        if (data->size() > header_->arenaSize / 2)
+            return;
+        offset = allocate(data->size());
+        memcpy(arena_ + offset % header_->arenaSize, &(*data)[0], data->size());
+    }
+
+    // Same key first, else the oldest slot of the bucket
+    CacheSlot *slot = bucket(key), *victim = slot;
+    for (unsigned w = 0; w < CACHE_WAYS; w++, slot++) {
+        if (slot->key[0] == key.a && slot->key[1] == key.b && slot->kind == kind) {
+            victim = slot;
+            break;
+        }
+        if (slot->stamp < victim->stamp)
+            victim = slot;
+    }
+
+    // Someone else is writing it, drop our result. If the writer died while
+    // it held the lock, take the lock over: count + 2 keeps it odd.
+    uint64_t seq = victim->seq;
+    uint32_t count = (uint32_t) seq;
+    pid_t self = getpid();
+
+    if (count & 1) {
+        pid_t writer = seq >> 32;
+        if (!writer || !kill(writer, 0) || errno != ESRCH)
+            return;
+        if (!__sync_bool_compare_and_swap(&victim->seq, seq, lockWord(self, count + 2)))
+            return;
+        count++;
+    } else if (!__sync_bool_compare_and_swap(&victim->seq, seq, lockWord(self, count + 1))) {
+        return;
+    }
+    __sync_synchronize();
+
+    victim->kind = kind;
+    victim->key[0] = key.a;
+    victim->key[1] = key.b;
+    victim->result = result;
+    victim->size = data ? data->size() : 0;
+    victim->offset = offset;
+    victim->stamp = __sync_add_and_fetch(&header_->clock, 1);
+
+    __sync_synchronize();
+    victim->seq = lockWord(self, count + 2);
+}
+
+
+class SharedCachingSolver : public SolverImpl {
+private:
+    QueryKey hashExpr(const ref<Expr> &e);
+    QueryKey hashArray(const Array *array);
+    QueryKey hashConstraints(const ConstraintManager &constraints);
+    QueryKey validityKey(const Query &query, bool &negationUsed);
+
+    bool cacheLookup(const Query &query, IncompleteSolver::PartialValidity &result);
+    void cacheInsert(const Query &query, IncompleteSolver::PartialValidity result);
+
+    // Bound on the number of memoized expression hashes
+    enum { MaxMemoSize = 1 << 16 };
+
+    Solver *solver;
+    SharedCache *cache;
+    ExprHashMap<QueryKey> memo;
+
+public:
+    SharedCachingSolver(Solver *s, SharedCache *c) : solver(s), cache(c) {}
+    ~SharedCachingSolver() { delete cache; delete solver; }
+
+    bool computeValidity(const Query&, Solver::Validity &result);
+    bool computeTruth(const Query&, bool &isValid);
+    bool computeValue(const Query& query, ref<Expr> &result) {
+        return solver->impl->computeValue(query, result);
+    }
+    bool computeInitialValues(const Query& query,
+                              const std::vector<const Array*> &objects,
+                              std::vector< std::vector<unsigned char> > &values,
+                              bool &hasSolution);
+};
+
+
+QueryKey SharedCachingSolver::hashArray(const Array *array) {
+    QueryKey k(array->getSize(), ~(uint64_t) array->getSize());
+
+    const std::string &name = array->getName();
+    for (unsigned i = 0; i < name.size(); i++)
+        combine(k, (unsigned char) name[i]);
+
+    const std::vector< ref<ConstantExpr> > &values = array->getConstantValues();
+    for (unsigned i = 0; i < values.size(); i++)
+        combine(k, values[i]->getZExtValue());
+
+    return k;
+}
+
+QueryKey SharedCachingSolver::hashExpr(const ref<Expr> &e) {
+    ExprHashMap<QueryKey>::iterator it = memo.find(e);
+    if (it != memo.end())
+        return it->second;
+
+    QueryKey k(e->getKind(), e->getWidth());
+    combine(k, ((uint64_t) e->getKind() << 32) | e->getWidth());
+
+    if (ConstantExpr *ce = dyn_cast<ConstantExpr>(e)) {
+        const llvm::APInt &value = ce->getAPValue();
+        for (unsigned i = 0; i < value.getNumWords(); i++)
+            combine(k, value.getRawData()[i]);
+    } else if (ReadExpr *re = dyn_cast<ReadExpr>(e)) {
+        QueryKey ak = hashArray(re->getUpdates().getRoot());
+        combine(k, ak.a);
+        combine(k, ak.b);
+
+        for (const UpdateNode *un = re->getUpdates().getHead(); un; un = un->getNext()) {
+            QueryKey ik = hashExpr(un->getIndex()), vk = hashExpr(un->getValue());
+            combine(k, ik.a);
+            combine(k, ik.b);
+            combine(k, vk.a);
+            combine(k, vk.b);
+        }
+    } else if (ExtractExpr *ee = dyn_cast<ExtractExpr>(e)) {
+        combine(k, ee->getOffset());
+    }
+
+    for (unsigned i = 0; i < e->getNumKids(); i++) {
+        QueryKey kk = hashExpr(e->getKid(i));
+        combine(k, kk.a);
+        combine(k, kk.b);
+    }
+
+    if (memo.size() >= MaxMemoSize)
+        memo.clear();
+    memo.insert(std::make_pair(e, k));
+    return k;
+}
+
+/// Order-independent, like the constraint set
+QueryKey SharedCachingSolver::hashConstraints(const ConstraintManager &constraints) {
+    QueryKey k(constraints.size(), 0);
+
+    for (ConstraintManager::const_iterator it = constraints.begin(),
+         ie = constraints.end(); it != ie; ++it) {
+        QueryKey ck = hashExpr(*it);
+        k.a += mix64(ck.a);
+        k.b += mix64(ck.b);
+    }
+
+    return k;
+}
+
+/// Key of the query or of its negation, whichever is smaller, as in the
+/// in-memory caching solver.
+QueryKey SharedCachingSolver::validityKey(const Query &query, bool &negationUsed) {
+    QueryKey qk = hashExpr(query.expr);
+    QueryKey nk = hashExpr(Expr::createIsZero(query.expr));
+
+    negationUsed = nk.a < qk.a;
+
+    QueryKey k = hashConstraints(query.constraints);
+    combine(k, CACHE_VALIDITY);
+    combine(k, negationUsed ? nk.a : qk.a);
+    combine(k, negationUsed ? nk.b : qk.b);
+    return k;
+}
+
+bool SharedCachingSolver::cacheLookup(const Query &query,
+                                      IncompleteSolver::PartialValidity &result) {
+    bool negationUsed;
+    QueryKey key = validityKey(query, negationUsed);
+    uint32_t cached;
+
+    if (!cache->lookup(key, CACHE_VALIDITY, cached, NULL))
+        return false;
+
+    result = (IncompleteSolver::PartialValidity) (int32_t) cached;
+    if (negationUsed)
+        result = IncompleteSolver::negatePartialValidity(result);
+    return true;
+}
+
+void SharedCachingSolver::cacheInsert(const Query &query,
+                                      IncompleteSolver::PartialValidity result) {
+    bool negationUsed;
+    QueryKey key = validityKey(query, negationUsed);
+
+    if (negationUsed)
+        result = IncompleteSolver::negatePartialValidity(result);
+
+    cache->insert(key, CACHE_VALIDITY, (uint32_t) (int32_t) result, NULL);
+}
+
+bool SharedCachingSolver::computeValidity(const Query& query,
+                                          Solver::Validity &result) {
+    IncompleteSolver::PartialValidity cachedResult;
+
+    if (cacheLookup(query, cachedResult)) {
+        switch (cachedResult) {
+        case IncompleteSolver::MustBeTrue:
+            ++stats::sharedCacheHits;
+            result = Solver::True;
+            return true;
+        case IncompleteSolver::MustBeFalse:
+            ++stats::sharedCacheHits;
+            result = Solver::False;
+            return true;
+        case IncompleteSolver::TrueOrFalse:
+            ++stats::sharedCacheHits;
+            result = Solver::Unknown;
+            return true;
+        default:
+            break;
+        }
+    }
+
+    ++stats::sharedCacheMisses;
+
+    if (!solver->impl->computeValidity(query, result))
+        return false;
+
+    switch (result) {
+    case Solver::True:
+        cachedResult = IncompleteSolver::MustBeTrue; break;
+    case Solver::False:
+        cachedResult = IncompleteSolver::MustBeFalse; break;
+    default:
+        cachedResult = IncompleteSolver::TrueOrFalse; break;
+    }
+
+    cacheInsert(query, cachedResult);
+    return true;
+}
+
+bool SharedCachingSolver::computeTruth(const Query& query,
+                                       bool &isValid) {
+    IncompleteSolver::PartialValidity cachedResult;
+    bool cacheHit = cacheLookup(query, cachedResult);
+
+    // A cached MayBeTrue does not tell whether a false assignment exists
+    if (cacheHit && cachedResult != IncompleteSolver::MayBeTrue) {
+        ++stats::sharedCacheHits;
+        isValid = (cachedResult == IncompleteSolver::MustBeTrue);
+        return true;
+    }
+
+    ++stats::sharedCacheMisses;
+
+    if (!solver->impl->computeTruth(query, isValid))
+        return false;
+
+    if (isValid) {
+        cachedResult = IncompleteSolver::MustBeTrue;
+    } else if (cacheHit) {
+        cachedResult = IncompleteSolver::TrueOrFalse;
+    } else {
+        cachedResult = IncompleteSolver::MayBeFalse;
+    }
+
+    cacheInsert(query, cachedResult);
+    return true;
+}
+
+/// Models are kept in the arena, as long as no more than half of it.
+bool SharedCachingSolver::computeInitialValues(const Query& query,
+                                               const std::vector<const Array*> &objects,
+                                               std::vector< std::vector<unsigned char> > &values,
+                                               bool &hasSolution) {
+    QueryKey key = hashConstraints(query.constraints);
+    QueryKey qk = hashExpr(query.expr);
+    size_t total = 0;
+
+    combine(key, CACHE_MODEL);
+    combine(key, qk.a);
+    combine(key, qk.b);
+    for (unsigned i = 0; i < objects.size(); i++) {
+        QueryKey ak = hashArray(objects[i]);
+        combine(key, ak.a);
+        combine(key, ak.b);
+        total += objects[i]->getSize();
+    }
+
+    std::vector<unsigned char> data;
+    uint32_t cached;
+
+    if (cache->lookup(key, CACHE_MODEL, cached, &data) &&
+        data.size() == (cached ? total : 0)) {
+        ++stats::sharedCacheHits;
+
+        hasSolution = cached;
+        values.clear();
+        if (hasSolution) {
+            std::vector<unsigned char>::iterator it = data.begin();
+            for (unsigned i = 0; i < objects.size(); i++) {
+                values.push_back(std::vector<unsigned char>(it, it + objects[i]->getSize()));
+                it += objects[i]->getSize();
+            }
+        }
+        return true;
+    }
+
+    ++stats::sharedCacheMisses;
+
+    if (!solver->impl->computeInitialValues(query, objects, values, hasSolution))
+        return false;
+
+    data.clear();
+    if (hasSolution) {
+        for (unsigned i = 0; i < values.size(); i++)
+            data.insert(data.end(), values[i].begin(), values[i].end());
+    }
+    cache->insert(key, CACHE_MODEL, hasSolution, &data);
+
+    return true;
+}
+
+}
+
+///
+
+Solver *klee::createSharedCachingSolver(Solver *_solver, const std::string &path,
+                                        uint64_t size) {
+    SharedCache *cache = SharedCache::open(path, size);
+    if (!cache) {
+        klee_warning("Could not open the shared solver cache %s", path.c_str());
+        return _solver;
+    }
+
+    return new Solver(new SharedCachingSolver(_solver, cache));
+}
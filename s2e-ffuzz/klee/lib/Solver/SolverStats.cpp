@@ -12,6 +12,10 @@
 using namespace klee;
 
 Statistic stats::cexCacheTime("CexCacheTime", "CCtime");
+Statistic stats::portfolioAssumptionWins("PortfolioAssumptionWins", "PAwins");
+Statistic stats::portfolioResetWins("PortfolioResetWins", "PRwins");
+Statistic stats::portfolioRestarts("PortfolioRestarts", "PRestarts");
+Statistic stats::portfolioStackWins("PortfolioStackWins", "PSwins");
 Statistic stats::queries("Queries", "Q");
 Statistic stats::queriesInvalid("QueriesInvalid", "Qiv");
 Statistic stats::queriesValid("QueriesValid", "Qv");
@@ -21,3 +25,5 @@ Statistic stats::queryConstructTime("QueryConstructTime", "QBtime") ;
 Statistic stats::queryConstructs("QueriesConstructs", "QB");
 Statistic stats::queryCounterexamples("QueriesCEX", "Qcex");
 Statistic stats::queryTime("QueryTime", "Qtime");
+Statistic stats::sharedCacheHits("SharedCacheHits", "SChits");
+Statistic stats::sharedCacheMisses("SharedCacheMisses", "SCmisses");
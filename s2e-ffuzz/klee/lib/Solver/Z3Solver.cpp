@@ -53,8 +53,12 @@
 #include <z3++.h>
 
 #include <list>
+#include <algorithm>
 #include <iostream>
 
+#include <pthread.h>
+#include <stdlib.h>
+
 using namespace llvm;
 using boost::scoped_ptr;
 
@@ -79,6 +83,21 @@ cl::opt<unsigned> AssumptionResetThreshold("z3-assum-reset-thrs",
                                            cl::desc("Reset threshold for the number of Z3 assumptions"),
                                            cl::init(50));
 
+cl::opt<unsigned> SessionPoolSize("z3-session-pool-size",
+                                  cl::desc("Maximum number of Z3 stack sessions kept by the session solver"),
+                                  cl::init(8));
+
+cl::opt<unsigned> SessionSplitThreshold("z3-session-split-thrs",
+                                        cl::desc("Use another Z3 session rather than popping more than this "
+                                                 "number of constraints off the closest one"),
+                                        cl::init(16));
+
+cl::list<std::string> PortfolioMembers("z3-portfolio",
+                                       cl::CommaSeparated,
+                                       cl::desc("Members of the portfolio solver, each mode[:tactic][@timeout_ms] "
+                                                "with mode reset, stack or assumption "
+                                                "(default: reset,stack,assumption)"));
+
 cl::opt<bool> DebugSolverStack("z3-debug-solver-stack",
                                cl::desc("Print debug messages when solver stack is modified"),
                                cl::init(false));
@@ -100,14 +119,41 @@ public:
                               std::vector<std::vector<unsigned char> > &values,
                               bool &hasSolution);
 
+    // Check with a solver built from the given tactic rather than the
+    // default one, must be set before initializeSolver()
+    void setTactic(const std::string &tactic) {
+        tactic_ = tactic;
+    }
+
+    // Give up with unknown after the given time, in ms
+    void setTimeout(unsigned timeout) {
+        timeout_ = timeout;
+    }
+
     void initializeSolver();
 
 protected:
     virtual void createBuilderCache() = 0;
 
-    virtual z3::check_result check(const Query&) = 0;
+    // Assert the query, then check it. Only solve() may run concurrently
+    // with other solvers, as building the query touches the Expr reference
+    // counts and caches.
+    z3::check_result check(const Query &query) {
+        prepare(query);
+        return solve();
+    }
+    virtual void prepare(const Query&) = 0;
+    virtual z3::check_result solve() {
+        return solver_.check();
+    }
     virtual void postCheck(const Query&) = 0;
 
+    // Abort a check() running in another thread, thread-safe. The context
+    // stays cancelled after the check returns, so it cannot be used again.
+    void interrupt() {
+        context_.interrupt();
+    }
+
     void extractModel(const std::vector<const Array*> &objects,
                       std::vector<std::vector<unsigned char> > &values);
 
@@ -132,9 +178,14 @@ protected:
     scoped_ptr<Z3BuilderCache> builder_cache_;
     scoped_ptr<Z3Builder> builder_;
 
+    std::string tactic_;
+    unsigned timeout_;
+
 private:
     void configureSolver();
     void createBuilder();
+
+    friend class Z3PortfolioSolverImpl;
 };
 
 
@@ -143,12 +194,20 @@ public:
     Z3StackSolverImpl();
     virtual ~Z3StackSolverImpl();
 
+    // Number of path constraints currently asserted
+    size_t depth() const {
+        return last_constraints_->size();
+    }
+
+    // Number of asserted path constraints that the given branch shares
+    size_t sharedDepth(ConditionNodeRef head) const;
+
 protected:
     typedef std::list<ConditionNodeRef> ConditionNodeList;
 
     virtual void createBuilderCache();
 
-    virtual z3::check_result check(const Query&);
+    virtual void prepare(const Query&);
     virtual void postCheck(const Query&);
 
     scoped_ptr<ConditionNodeList> last_constraints_;
@@ -162,7 +221,7 @@ public:
 
 protected:
     virtual void createBuilderCache();
-    virtual z3::check_result check(const Query&);
+    virtual void prepare(const Query&);
     virtual void postCheck(const Query&);
 };
 
@@ -174,7 +233,8 @@ public:
 
 protected:
     virtual void createBuilderCache();
-    virtual z3::check_result check(const Query&);
+    virtual void prepare(const Query&);
+    virtual z3::check_result solve();
     virtual void postCheck(const Query&);
 
 private:
@@ -184,6 +244,92 @@ private:
 
     GuardMap guards_;
     uint64_t guard_counter_;
+    z3::expr_vector assumptions_;
+};
+
+
+// Runs several solvers on the same query in parallel, takes the first answer
+// and interrupts the others. Members differ by incrementality mode, and may
+// use their own tactic and timeout.
+class Z3PortfolioSolverImpl : public SolverImpl {
+public:
+    Z3PortfolioSolverImpl(const std::vector<std::string> &members);
+    virtual ~Z3PortfolioSolverImpl();
+
+    bool computeTruth(const Query&, bool &isValid);
+    bool computeValue(const Query&, ref<Expr> &result);
+    bool computeInitialValues(const Query &query,
+                              const std::vector<const Array*> &objects,
+                              std::vector<std::vector<unsigned char> > &values,
+                              bool &hasSolution);
+
+private:
+    enum Mode {
+        MODE_RESET,
+        MODE_STACK,
+        MODE_ASSUMPTION
+    };
+
+    struct Member {
+        Member(Z3PortfolioSolverImpl *_owner, int _index, Mode _mode,
+               const std::string &_tactic, unsigned _timeout, Statistic &_wins)
+            : owner(_owner), index(_index), mode(_mode), tactic(_tactic),
+              timeout(_timeout), impl(NULL), wins(_wins), result(z3::unknown),
+              started(false), solving(false), cancelled(false),
+              interrupted(false), done(false) {}
+
+        Z3PortfolioSolverImpl *owner;
+        int index;
+        Mode mode;
+        std::string tactic;
+        unsigned timeout;
+        Z3BaseSolverImpl *impl;
+        Statistic &wins;
+        z3::check_result result;
+        // Guarded by the owner's lock once the race has started
+        bool started, solving, cancelled, interrupted, done;
+        pthread_t thread;
+    };
+
+    void addMember(const std::string &spec);
+    void createSolver(Member *member);
+
+    static void *solveThread(void *member);
+
+    int race();
+
+    std::vector<Member*> members_;
+
+    pthread_mutex_t lock_;
+    pthread_cond_t done_;
+    int winner_;
+    unsigned running_;
+};
+
+
+// Keeps a pool of stack sessions, each left asserted along the branch of the
+// condition tree it last solved for. A query goes to the session sharing the
+// longest prefix with its branch, so that states bouncing between branches
+// do not pop and re-assert their constraints each time.
+class Z3SessionSolverImpl : public SolverImpl {
+public:
+    Z3SessionSolverImpl();
+    virtual ~Z3SessionSolverImpl();
+
+    bool computeTruth(const Query&, bool &isValid);
+    bool computeValue(const Query&, ref<Expr> &result);
+    bool computeInitialValues(const Query &query,
+                              const std::vector<const Array*> &objects,
+                              std::vector<std::vector<unsigned char> > &values,
+                              bool &hasSolution);
+
+private:
+    // Most recently used first
+    typedef std::list<Z3StackSolverImpl*> SessionList;
+
+    Z3StackSolverImpl *getSession(const Query &query);
+
+    SessionList sessions_;
 };
 
 
@@ -211,6 +357,25 @@ Z3Solver *Z3Solver::createAssumptionSolver() {
     return new Z3Solver(impl);
 }
 
+Z3Solver *Z3Solver::createSessionSolver() {
+    return new Z3Solver(new Z3SessionSolverImpl());
+}
+
+Z3Solver *Z3Solver::createPortfolioSolver() {
+    std::vector<std::string> members(PortfolioMembers.begin(), PortfolioMembers.end());
+    if (members.empty()) {
+        members.push_back("reset");
+        members.push_back("stack");
+        members.push_back("assumption");
+    }
+
+    return createPortfolioSolver(members);
+}
+
+Z3Solver *Z3Solver::createPortfolioSolver(const std::vector<std::string> &members) {
+    return new Z3Solver(new Z3PortfolioSolverImpl(members));
+}
+
 
 Z3Solver::Z3Solver(SolverImpl *impl)
     : Solver(impl) {
@@ -221,7 +386,8 @@ Z3Solver::Z3Solver(SolverImpl *impl)
 
 
 Z3BaseSolverImpl::Z3BaseSolverImpl()
-    : solver_(context_, "QF_ABV") {
+    : solver_(context_, "QF_ABV"),
+      timeout_(0) {
 }
 
 
@@ -320,11 +486,20 @@ bool Z3BaseSolverImpl::computeInitialValues(const Query &query,
 void Z3BaseSolverImpl::configureSolver() {
     (*klee_message_stream) << "[Z3] Initializing\n";
 
+    if (!tactic_.empty()) {
+        solver_ = z3::tactic(context_, tactic_.c_str()).mk_solver();
+    }
+
     Z3_param_descrs solver_params = Z3_solver_get_param_descrs(context_, solver_);
     Z3_param_descrs_inc_ref(context_, solver_params);
 
     z3::params params(context_);
-    params.set("array.extensional", false);
+    if (tactic_.empty()) {
+        params.set("array.extensional", false);
+    }
+    if (timeout_) {
+        params.set("timeout", timeout_);
+    }
     Z3_params_validate(context_, params, solver_params);
 
     solver_.set(params);
@@ -372,7 +547,7 @@ Z3StackSolverImpl::~Z3StackSolverImpl() {
 }
 
 
-z3::check_result Z3StackSolverImpl::check(const Query &query) {
+void Z3StackSolverImpl::prepare(const Query &query) {
     if (DebugSolverStack) {
         *klee_message_stream << "[Z3] query size " << query.constraints.size() << '\n';
     }
@@ -428,8 +603,6 @@ z3::check_result Z3StackSolverImpl::check(const Query &query) {
     // Note the negation, since we're checking for validity
     // (i.e., a counterexample)
     solver_.add(!builder_->construct(query.expr));
-
-    return solver_.check();
 }
 
 
@@ -438,6 +611,30 @@ void Z3StackSolverImpl::postCheck(const Query&) {
 }
 
 
+size_t Z3StackSolverImpl::sharedDepth(ConditionNodeRef head) const {
+    if (last_constraints_->empty()) {
+        return 0;
+    }
+
+    ConditionNodeRef last = last_constraints_->back();
+
+    while (last->depth() > head->depth()) {
+        last = last->parent();
+    }
+    while (head->depth() > last->depth()) {
+        head = head->parent();
+    }
+
+    // Branches of different condition trees only meet past their roots
+    while (last && last != head) {
+        last = last->parent();
+        head = head->parent();
+    }
+
+    return last ? last->depth() : 0;
+}
+
+
 void Z3StackSolverImpl::createBuilderCache() {
     switch (ArrayConsMode) {
     case Z3_ARRAY_ITE:
@@ -466,7 +663,7 @@ Z3ResetSolverImpl::~Z3ResetSolverImpl() {
 }
 
 
-z3::check_result Z3ResetSolverImpl::check(const Query &query) {
+void Z3ResetSolverImpl::prepare(const Query &query) {
     std::list<ConditionNodeRef> cur_constraints;
 
     for (ConditionNodeRef node = query.constraints.head(),
@@ -481,7 +678,6 @@ z3::check_result Z3ResetSolverImpl::check(const Query &query) {
     }
 
     solver_.add(!builder_->construct(query.expr));
-    return solver_.check();
 }
 
 
@@ -509,7 +705,8 @@ void Z3ResetSolverImpl::createBuilderCache() {
 
 Z3AssumptionSolverImpl::Z3AssumptionSolverImpl()
     : Z3BaseSolverImpl(),
-      guard_counter_(0) {
+      guard_counter_(0),
+      assumptions_(context_) {
 
 }
 
@@ -519,7 +716,7 @@ Z3AssumptionSolverImpl::~Z3AssumptionSolverImpl() {
 }
 
 
-z3::check_result Z3AssumptionSolverImpl::check(const Query &query) {
+void Z3AssumptionSolverImpl::prepare(const Query &query) {
     std::list<ConditionNodeRef> cur_constraints;
     for (ConditionNodeRef node = query.constraints.head(),
          root = query.constraints.root();
@@ -527,14 +724,18 @@ z3::check_result Z3AssumptionSolverImpl::check(const Query &query) {
         cur_constraints.push_front(node);
     }
 
-    z3::expr_vector assumptions(context_);
+    assumptions_ = z3::expr_vector(context_);
 
     for (std::list<ConditionNodeRef>::iterator it = cur_constraints.begin(),
          ie = cur_constraints.end(); it != ie; ++it) {
-        assumptions.push_back(getAssumption((*it)->expr()));
+        assumptions_.push_back(getAssumption((*it)->expr()));
     }
-    assumptions.push_back(getAssumption(Expr::createIsZero(query.expr)));
-    return solver_.check(assumptions);
+    assumptions_.push_back(getAssumption(Expr::createIsZero(query.expr)));
+}
+
+
+z3::check_result Z3AssumptionSolverImpl::solve() {
+    return solver_.check(assumptions_);
 }
 
 
@@ -582,5 +783,329 @@ void Z3AssumptionSolverImpl::createBuilderCache() {
     }
 }
 
+// Z3SessionSolverImpl /////////////////////////////////////////////////////////
+
+
+Z3SessionSolverImpl::Z3SessionSolverImpl() : SolverImpl() {
+
+}
+
+
+Z3SessionSolverImpl::~Z3SessionSolverImpl() {
+    for (SessionList::iterator it = sessions_.begin(), ie = sessions_.end();
+         it != ie; ++it) {
+        delete *it;
+    }
+}
+
+
+Z3StackSolverImpl *Z3SessionSolverImpl::getSession(const Query &query) {
+    ConditionNodeRef head = query.constraints.head();
+
+    SessionList::iterator best = sessions_.end();
+    size_t best_cost = 0, best_pops = 0;
+
+    // Cheapest session to move to the query branch, the most recent one on ties
+    for (SessionList::iterator it = sessions_.begin(), ie = sessions_.end();
+         it != ie; ++it) {
+        size_t shared = (*it)->sharedDepth(head);
+        size_t pops = (*it)->depth() - shared;
+        size_t cost = pops + head->depth() - shared;
+
+        if (best == sessions_.end() || cost < best_cost) {
+            best = it;
+            best_cost = cost;
+            best_pops = pops;
+        }
+    }
+
+    // Leave the branch of the closest session alone if we would have to
+    // discard too much of it
+    if (best == sessions_.end() || best_pops > SessionSplitThreshold) {
+        if (sessions_.size() < std::max(1u, (unsigned) SessionPoolSize)) {
+            Z3StackSolverImpl *session = new Z3StackSolverImpl();
+            session->initializeSolver();
+            sessions_.push_front(session);
+
+            if (DebugSolverStack) {
+                *klee_message_stream << "[Z3] new session " << sessions_.size() << '\n';
+            }
+
+            return session;
+        }
+
+        if (DebugSolverStack) {
+            *klee_message_stream << "[Z3] recycle session\n";
+        }
+
+        best = --sessions_.end();
+    }
+
+    sessions_.splice(sessions_.begin(), sessions_, best);
+    return sessions_.front();
+}
+
+
+bool Z3SessionSolverImpl::computeTruth(const Query &query, bool &isValid) {
+    return getSession(query)->computeTruth(query, isValid);
+}
+
+
+bool Z3SessionSolverImpl::computeValue(const Query &query, ref<Expr> &result) {
+    return getSession(query)->computeValue(query, result);
+}
+
+
+bool Z3SessionSolverImpl::computeInitialValues(const Query &query,
+                                               const std::vector<const Array*> &objects,
+                                               std::vector<std::vector<unsigned char> > &values,
+                                               bool &hasSolution) {
+    return getSession(query)->computeInitialValues(query, objects, values, hasSolution);
+}
+
+// Z3PortfolioSolverImpl ///////////////////////////////////////////////////////
+
+
+Z3PortfolioSolverImpl::Z3PortfolioSolverImpl(const std::vector<std::string> &members)
+    : SolverImpl(),
+      winner_(-1),
+      running_(0) {
+    for (unsigned i = 0; i < members.size(); ++i) {
+        addMember(members[i]);
+    }
+
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&done_, NULL);
+}
+
+
+Z3PortfolioSolverImpl::~Z3PortfolioSolverImpl() {
+    for (unsigned i = 0; i < members_.size(); ++i) {
+        delete members_[i]->impl;
+        delete members_[i];
+    }
+
+    pthread_cond_destroy(&done_);
+    pthread_mutex_destroy(&lock_);
+}
+
+
+// Parses mode[:tactic][@timeout_ms]. Wins are counted per mode.
+void Z3PortfolioSolverImpl::addMember(const std::string &spec) {
+    std::string mode = spec;
+    std::string tactic;
+    unsigned timeout = 0;
+
+    size_t pos = mode.find('@');
+    if (pos != std::string::npos) {
+        timeout = strtoul(mode.c_str() + pos + 1, NULL, 10);
+        mode.erase(pos);
+    }
+    pos = mode.find(':');
+    if (pos != std::string::npos) {
+        tactic = mode.substr(pos + 1);
+        mode.erase(pos);
+    }
+
+    Member *member;
+    if (mode == "reset") {
+        member = new Member(this, members_.size(), MODE_RESET, tactic, timeout,
+                            stats::portfolioResetWins);
+    } else if (mode == "stack") {
+        member = new Member(this, members_.size(), MODE_STACK, tactic, timeout,
+                            stats::portfolioStackWins);
+    } else if (mode == "assumption") {
+        member = new Member(this, members_.size(), MODE_ASSUMPTION, tactic, timeout,
+                            stats::portfolioAssumptionWins);
+    } else {
+        klee_error("Invalid Z3 portfolio member '%s'", spec.c_str());
+    }
+
+    createSolver(member);
+    members_.push_back(member);
+}
+
+
+void Z3PortfolioSolverImpl::createSolver(Member *member) {
+    delete member->impl;
+
+    switch (member->mode) {
+    case MODE_RESET:
+        member->impl = new Z3ResetSolverImpl();
+        break;
+    case MODE_STACK:
+        member->impl = new Z3StackSolverImpl();
+        break;
+    case MODE_ASSUMPTION:
+        member->impl = new Z3AssumptionSolverImpl();
+        break;
+    }
+
+    member->impl->setTactic(member->tactic);
+    member->impl->setTimeout(member->timeout);
+    member->impl->initializeSolver();
+}
+
+
+void *Z3PortfolioSolverImpl::solveThread(void *arg) {
+    Member *member = (Member*) arg;
+    Z3PortfolioSolverImpl *owner = member->owner;
+    z3::check_result result = z3::unknown;
+
+    // A member that starts after the race is decided skips it, so that
+    // interrupt() only ever hits a check() in progress
+    pthread_mutex_lock(&owner->lock_);
+    bool solving = !member->cancelled;
+    member->solving = solving;
+    pthread_mutex_unlock(&owner->lock_);
+
+    if (solving) {
+        result = member->impl->solve();
+    }
+
+    pthread_mutex_lock(&owner->lock_);
+    member->solving = false;
+    member->result = result;
+    member->done = true;
+    owner->running_--;
+    if (owner->winner_ < 0 && result != z3::unknown) {
+        owner->winner_ = member->index;
+    }
+    pthread_cond_signal(&owner->done_);
+    pthread_mutex_unlock(&owner->lock_);
+
+    return NULL;
+}
+
+
+// Checks the prepared query on all members and returns the index of the
+// first one to answer, or -1 if none could. The threads only live for the
+// query, so that S2E can fork between queries. Members interrupted in the
+// middle of their check are flagged, their context must be rebuilt.
+int Z3PortfolioSolverImpl::race() {
+    pthread_mutex_lock(&lock_);
+
+    winner_ = -1;
+    running_ = 0;
+    for (unsigned i = 0; i < members_.size(); ++i) {
+        Member *member = members_[i];
+        member->result = z3::unknown;
+        member->solving = false;
+        member->cancelled = false;
+        member->interrupted = false;
+        member->started = !pthread_create(&member->thread, NULL, solveThread, member);
+        member->done = !member->started;
+        if (member->started) {
+            running_++;
+        }
+    }
+
+    while (winner_ < 0 && running_ > 0) {
+        pthread_cond_wait(&done_, &lock_);
+    }
+
+    for (unsigned i = 0; i < members_.size(); ++i) {
+        Member *member = members_[i];
+        if (member->done) {
+            continue;
+        }
+
+        member->cancelled = true;
+        if (member->solving) {
+            member->impl->interrupt();
+            member->interrupted = true;
+        }
+    }
+
+    while (running_ > 0) {
+        pthread_cond_wait(&done_, &lock_);
+    }
+
+    int winner = winner_;
+    pthread_mutex_unlock(&lock_);
+
+    for (unsigned i = 0; i < members_.size(); ++i) {
+        if (members_[i]->started) {
+            pthread_join(members_[i]->thread, NULL);
+        }
+    }
+
+    return winner;
+}
+
+
+bool Z3PortfolioSolverImpl::computeTruth(const Query &query, bool &isValid) {
+    std::vector<const Array*> objects;
+    std::vector<std::vector<unsigned char> > values;
+    bool hasSolution;
+
+    if (!computeInitialValues(query, objects, values, hasSolution))
+        return false;
+
+    isValid = !hasSolution;
+    return true;
+}
+
+
+bool Z3PortfolioSolverImpl::computeValue(const Query &query, ref<Expr> &result) {
+    std::vector<const Array*> objects;
+    std::vector<std::vector<unsigned char> > values;
+    bool hasSolution;
+
+    findSymbolicObjects(query.expr, objects);
+    if (!computeInitialValues(query.withFalse(), objects, values, hasSolution))
+        return false;
+    assert(hasSolution && "state has invalid constraint set");
+
+    Assignment a(objects, values);
+    result = a.evaluate(query.expr);
+
+    return true;
+}
+
+
+bool Z3PortfolioSolverImpl::computeInitialValues(const Query &query,
+                                                 const std::vector<const Array*> &objects,
+                                                 std::vector<std::vector<unsigned char> > &values,
+                                                 bool &hasSolution) {
+    ++stats::queries;
+    ++stats::queryCounterexamples;
+
+    // Building a query is not thread-safe, so the members build theirs one
+    // after the other before the race starts. This costs the sum of their
+    // constructions, the reset member rebuilding the whole path each time.
+    for (unsigned i = 0; i < members_.size(); ++i) {
+        members_[i]->impl->prepare(query);
+    }
+
+    int winner = race();
+    bool success = winner >= 0;
+
+    if (success) {
+        Member *member = members_[winner];
+        ++member->wins;
+
+        hasSolution = member->result == z3::sat;
+        if (hasSolution) {
+            member->impl->extractModel(objects, values);
+            ++stats::queriesInvalid;
+        } else {
+            ++stats::queriesValid;
+        }
+    }
+
+    for (unsigned i = 0; i < members_.size(); ++i) {
+        Member *member = members_[i];
+        if (member->interrupted) {
+            createSolver(member);
+            ++stats::portfolioRestarts;
+        } else {
+            member->impl->postCheck(query);
+        }
+    }
+
+    return success;
+}
+
 
 }
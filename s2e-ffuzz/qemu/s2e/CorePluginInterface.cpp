@@ -100,6 +100,49 @@ void s2e_tcg_emit_custom_instruction(uint64_t arg)
     tcg_temp_free_i64(t0);
 }
 
+unsigned char *g_s2e_afl_area = NULL;
+unsigned char *g_s2e_afl_dirty = NULL;
+uint32_t (*g_s2e_afl_edge_slot)(uint64_t key) = NULL;
+
+void s2e_tcg_afl_edge_handler(uint64_t loc)
+{
+    if (g_s2e_afl_area) {
+        if (g_s2e_afl_edge_slot) {
+            loc = g_s2e_afl_edge_slot(loc);
+        }
+        g_s2e_afl_area[loc]++;
+        g_s2e_afl_dirty[loc >> 9] |= 1 << ((loc >> 6) & 7);
+    }
+}
+
+/* Same as afl_maybe_log, without any signal dispatch. The previous location
+   is kept in the CPU state, so that it is saved and forked with the state.
+   The bitmap is updated by a helper, because host memory cannot be accessed
+   directly when the block runs in KLEE. */
+void s2e_tcg_emit_afl_edge(uint32_t cur_loc, int exact)
+{
+    TCGv_ptr cpu_env = MAKE_TCGV_PTR(0);
+    TCGv_i64 t0 = tcg_temp_new_i64();
+
+    tcg_gen_ld32u_i64(t0, cpu_env, offsetof(CPUX86State, afl_prev_loc));
+    if (exact) {
+        tcg_gen_shli_i64(t0, t0, 32);
+        tcg_gen_ori_i64(t0, t0, cur_loc);
+    } else {
+        tcg_gen_xori_i64(t0, t0, cur_loc);
+    }
+
+    TCGArg args[1];
+    args[0] = GET_TCGV_I64(t0);
+    tcg_gen_helperN((void*) s2e_tcg_afl_edge_handler,
+                TCG_CALL_CONST, 2, TCG_CALL_DUMMY_ARG, 1, args);
+
+    tcg_gen_movi_i64(t0, exact ? cur_loc : cur_loc >> 1);
+    tcg_gen_st32_i64(t0, cpu_env, offsetof(CPUX86State, afl_prev_loc));
+
+    tcg_temp_free_i64(t0);
+}
+
 /* Instrument generated code to emit signal on execution */
 /* Next pc, when != -1, indicates with which value to update the program counter
    before calling the annotation. This is useful when instrumenting instructions
@@ -16,36 +16,72 @@
 
 namespace s2e {
 
+/**
+ * Three-level cache of host address -> T.
+ * Copies share the second and third levels, which are reference-counted and
+ * copied on the first put() that would modify a shared one. A forked state
+ * thus starts with its parent's warm cache, and an invalidation in one of
+ * them does not leak into the other.
+ */
 template <class T, unsigned OBJSIZE_BITS, unsigned PAGESIZE_BITS, unsigned SUPERPAGESIZE_BITS>
 class MemoryCache
 {
 private:
     struct ThirdLevel {
+        unsigned refCount;
         T level3[1<<(PAGESIZE_BITS-OBJSIZE_BITS)];
-        ThirdLevel() {
+        ThirdLevel() : refCount(1) {
             for (unsigned i=0; i<(1<<(PAGESIZE_BITS-OBJSIZE_BITS)); ++i) {
                 level3[i] = T();
             }
         }
+
+        ThirdLevel(const ThirdLevel &one) : refCount(1) {
+            for (unsigned i=0; i<(1<<(PAGESIZE_BITS-OBJSIZE_BITS)); ++i) {
+                level3[i] = one.level3[i];
+            }
+        }
+
+        void release() {
+            if (--refCount == 0) {
+                delete this;
+            }
+        }
     };
 
     struct SecondLevel {
+        unsigned refCount;
         ThirdLevel* level2[1<<(SUPERPAGESIZE_BITS-PAGESIZE_BITS)];
 
-        SecondLevel() {
+        SecondLevel() : refCount(1) {
             for (unsigned i=0; i<(1<<(SUPERPAGESIZE_BITS-PAGESIZE_BITS)); ++i) {
                 level2[i] = NULL;
             }
         }
 
+        SecondLevel(const SecondLevel &one) : refCount(1) {
+            for (unsigned i=0; i<(1<<(SUPERPAGESIZE_BITS-PAGESIZE_BITS)); ++i) {
+                level2[i] = one.level2[i];
+                if (level2[i]) {
+                    ++level2[i]->refCount;
+                }
+            }
+        }
+
         ~SecondLevel() {
             for (unsigned i=0; i<(1<<(SUPERPAGESIZE_BITS-PAGESIZE_BITS)); ++i) {
                 if (level2[i]) {
-                    delete level2[i];
+                    level2[i]->release();
                     level2[i] = NULL;
                 }
             }
         }
+
+        void release() {
+            if (--refCount == 0) {
+                delete this;
+            }
+        }
     };
 
     SecondLevel **m_level1;
@@ -76,15 +112,22 @@ public:
         resize();
     }
 
-    //XXX: Clone an empty cache for now
     MemoryCache(const MemoryCache &one) {
         m_hostAddrStart = one.m_hostAddrStart;
         m_size = one.m_size;
         resize();
+
+        for (unsigned i=0; i<m_pagecount; ++i) {
+            m_level1[i] = one.m_level1[i];
+            if (m_level1[i]) {
+                ++m_level1[i]->refCount;
+            }
+        }
     }
 
     ~MemoryCache() {
         flushCache();
+        delete [] m_level1;
     }
 
     inline uint64_t getSize() const {
@@ -98,7 +141,7 @@ public:
     inline void flushCache() {
         for (unsigned i=0; i<m_pagecount; ++i) {
             if (m_level1[i]) {
-                delete m_level1[i];
+                m_level1[i]->release();
                 m_level1[i] = NULL;
             }
         }
@@ -119,12 +162,22 @@ public:
         if (!(ptrLevel2 = m_level1[level1])) {
             ptrLevel2 = new SecondLevel();
             m_level1[level1] = ptrLevel2;
+        } else if (ptrLevel2->refCount > 1) {
+            SecondLevel *copy = new SecondLevel(*ptrLevel2);
+            ptrLevel2->release();
+            ptrLevel2 = copy;
+            m_level1[level1] = ptrLevel2;
         }
 
         ThirdLevel *ptrLevel3;
         if (!(ptrLevel3 = ptrLevel2->level2[level2])) {
             ptrLevel3 = new ThirdLevel();
             ptrLevel2->level2[level2] = ptrLevel3;
+        } else if (ptrLevel3->refCount > 1) {
+            ThirdLevel *copy = new ThirdLevel(*ptrLevel3);
+            ptrLevel3->release();
+            ptrLevel3 = copy;
+            ptrLevel2->level2[level2] = ptrLevel3;
         }
 
         assert(level3 < (1<<(PAGESIZE_BITS-OBJSIZE_BITS)));
@@ -0,0 +1,132 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2013, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Written by Bin Zhang <bin.zhang@epfl.ch>
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <iostream>
+
+#include "CaseGenerator.h"
+
+namespace s2e {
+namespace plugins {
+
+CaseGenerator::CaseGenerator(const std::string &destDir, unsigned workers) :
+        m_destDir(destDir), m_tmpDir(destDir + "/.tmp"), m_stop(false)
+{
+    if (::access(m_tmpDir.c_str(), F_OK))
+        mkdir(m_tmpDir.c_str(), 0777);
+
+    if (!workers)
+        workers = 1;
+    for (unsigned i = 0; i < workers; i++)
+        m_workers.push_back(std::thread(&CaseGenerator::worker, this));
+}
+
+CaseGenerator::~CaseGenerator()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    for (unsigned i = 0; i < m_workers.size(); i++)
+        m_workers[i].join();
+}
+
+void CaseGenerator::submit(const std::string &name, ConcreteInputs &inputs)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_jobs.push_back(Job());
+        m_jobs.back().name = name;
+        m_jobs.back().inputs.swap(inputs);
+    }
+    m_cond.notify_one();
+}
+
+void CaseGenerator::worker()
+{
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+            while (m_jobs.empty() && !m_stop)
+                m_cond.wait(guard);
+            if (m_jobs.empty()) // stopped and drained
+                return;
+            job.name.swap(m_jobs.front().name);
+            job.inputs.swap(m_jobs.front().inputs);
+            m_jobs.pop_front();
+        }
+        if (!writeCase(job))
+            std::cerr << "CaseGenerator: could not write testcase " << job.name << ": " << strerror(errno) << "\n";
+    }
+}
+
+bool CaseGenerator::writeCase(const Job &job)
+{
+    std::string tmpfilename = m_tmpDir + "/" + job.name;
+    std::string destfilename = m_destDir + "/" + job.name;
+
+    std::ofstream destfile;
+    destfile.open(tmpfilename.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!destfile)
+        return false;
+
+    ConcreteInputs::const_iterator it;
+    for (it = job.inputs.begin(); it != job.inputs.end(); ++it) {
+        const VarValuePair &vp = *it;
+        if (vp.first.find("dummy") != std::string::npos)
+            continue;
+        if (!vp.second.empty())
+            destfile.write((const char*) vp.second.data(), vp.second.size());
+    }
+    destfile.close();
+    if (!destfile) {
+        unlink(tmpfilename.c_str());
+        return false;
+    }
+
+    return !rename(tmpfilename.c_str(), destfilename.c_str());
+}
+
+} // namespace plugins
+} // namespace s2e
@@ -0,0 +1,90 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2013, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Written by Bin Zhang <bin.zhang@epfl.ch>
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+#ifndef CASEGENERATOR_H_
+#define CASEGENERATOR_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace s2e {
+namespace plugins {
+
+/*
+ * Writes drilled testcases to the directory AFL imports them from, on worker threads,
+ * so that the guest does not wait for file system. Every testcase is first written
+ * under a temporary name and then renamed, AFL never sees a partial file.
+ */
+class CaseGenerator
+{
+public:
+    typedef std::pair<std::string, std::vector<unsigned char> > VarValuePair;
+    typedef std::vector<VarValuePair> ConcreteInputs;
+
+    CaseGenerator(const std::string &destDir, unsigned workers);
+    ~CaseGenerator(); // writes out every pending testcase
+
+    // Takes over the content of inputs
+    void submit(const std::string &name, ConcreteInputs &inputs);
+
+private:
+    struct Job {
+        std::string name;
+        ConcreteInputs inputs;
+    };
+
+    void worker();
+    bool writeCase(const Job &job);
+
+    std::string m_destDir;
+    std::string m_tmpDir; // inside m_destDir, AFL skips directories
+
+    std::deque<Job> m_jobs;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    bool m_stop;
+    std::vector<std::thread> m_workers;
+};
+
+} // namespace plugins
+} // namespace s2e
+
+#endif /* CASEGENERATOR_H_ */
@@ -41,6 +41,8 @@ extern "C" {
 #include <exec-all.h>
 #include <sysemu.h>
 #include <sys/shm.h>
+
+extern struct CPUX86State *env;
 }
 #include <s2e/S2E.h>
 #include <s2e/S2EExecutor.h>
@@ -53,6 +55,7 @@ extern "C" {
 
 #include <algorithm>
 #include <fstream>
+#include <iterator>
 #include <vector>
 #include <inttypes.h>
 #include <stdio.h>
@@ -63,8 +66,15 @@ extern "C" {
 #include <unistd.h>    /*ssize_t*/
 #include <sys/types.h>
 #include <sys/stat.h>  /*mode_t*/
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sched.h>
 #include <stdlib.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 #include "FuzzyS2E.h"
 extern int errno;
 extern unsigned const_arr_id;
@@ -72,17 +82,65 @@ extern unsigned const_arr_id;
 namespace s2e {
 namespace plugins {
 
+// The instance the edge instrumentation resolves exact edges with
+static FuzzyS2E *g_fuzzyS2E = NULL;
+
+static uint32_t resolveEdgeSlot(uint64_t key)
+{
+    return g_fuzzyS2E->edgeSlot(key);
+}
+
+#ifdef __x86_64__
+// Trace lines may be scanned with AVX2
+static bool g_useAvx2 = false;
+
+/*
+ * Whether a trace line hits a tuple still virgin (0xff) in the global map, a vector at
+ * a time like AFL's bitmap scans.
+ */
+__attribute__((target("avx2")))
+static bool lineHasNewBitsAvx2(const uint8_t *cur, const uint8_t *vir)
+{
+    __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi8(-1);
+    for (unsigned i = 0; i < TRACE_LINE_SIZE; i += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*) (cur + i));
+        __m256i v = _mm256_loadu_si256((const __m256i*) (vir + i));
+        if (_mm256_movemask_epi8(_mm256_andnot_si256(_mm256_cmpeq_epi8(c, zero),
+                                                     _mm256_cmpeq_epi8(v, ones))))
+            return true;
+    }
+    return false;
+}
+
+static bool lineHasNewBitsSse2(const uint8_t *cur, const uint8_t *vir)
+{
+    __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi8(-1);
+    for (unsigned i = 0; i < TRACE_LINE_SIZE; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*) (cur + i));
+        __m128i v = _mm_loadu_si128((const __m128i*) (vir + i));
+        if (_mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(c, zero),
+                                               _mm_cmpeq_epi8(v, ones))))
+            return true;
+    }
+    return false;
+}
+#endif
+
 S2E_DEFINE_PLUGIN(FuzzyS2E, "FuzzyS2E plugin", "FuzzyS2E enables to play with fuzzing test.",
         "LinuxMonitor2", "HostFiles");
 
 
 FuzzyS2E::~FuzzyS2E()
 {
+    delete m_caseGenerator;
 }
 void FuzzyS2E::initialize()
 {
     bool ok = false;
     std::string cfgkey = getConfigKey();
+#ifdef __x86_64__
+    g_useAvx2 = __builtin_cpu_supports("avx2");
+#endif
     m_HostFiles = (HostFiles*)s2e()->getPlugin("HostFiles");
     m_verbose = s2e()->getConfig()->getBool(getConfigKey() + ".debugVerbose",
             false, &ok);
@@ -92,6 +150,19 @@ void FuzzyS2E::initialize()
     m_useDrill   = s2e()->getConfig()->getBool(getConfigKey() + ".useDrill", false, &ok);
     m_drillFreq  = s2e()->getConfig()->getInt(getConfigKey() + ".drillFreq", 100);
     m_exeTimeout  = s2e()->getConfig()->getInt(getConfigKey() + ".exeTimeout", 1000000);
+    m_forkNoQuery  = s2e()->getConfig()->getBool(getConfigKey() + ".forkWithoutQuery", false, &ok);
+    m_inlineEdges = s2e()->getConfig()->getBool(getConfigKey() + ".inlineEdges", false, &ok);
+    m_edgeIds = s2e()->getConfig()->getBool(getConfigKey() + ".edgeIds", false, &ok);
+    m_countCollisions = s2e()->getConfig()->getBool(getConfigKey() + ".countCollisions", false, &ok);
+
+    // AFL decides on the map size, every instance has to follow
+    const char *mapSize = getenv(MAP_SIZE_ENV_VAR);
+    if (mapSize)
+        m_mapSize = strtoul(mapSize, NULL, 10);
+    if (m_mapSize < AFL_BITMAP_SIZE || m_mapSize > AFL_BITMAP_SIZE_MAX || (m_mapSize & (m_mapSize - 1))) {
+        s2e()->getWarningsStream() << "FuzzyS2E: bad AFL map size " << m_mapSize << "\n";
+        exit(EXIT_FAILURE);
+    }
     if (m_killRState || m_useDrill)
         assert(m_needFilter && "Only work under testcase filter mode!");
     if (m_useDrill)
@@ -99,6 +170,10 @@ void FuzzyS2E::initialize()
     
     m_mainModule = s2e()->getConfig()->getString(cfgkey + ".mainModule", "MainModule", &ok);
     m_genTestcaseDir = s2e()->getConfig()->getString(cfgkey + ".genTestcaseDir", "SYMBEX", &ok);
+    if (m_useDrill) {
+        unsigned workers = s2e()->getConfig()->getInt(cfgkey + ".genWorkers", 1);
+        m_caseGenerator = new CaseGenerator(m_genTestcaseDir, workers);
+    }
     m_filename = s2e()->getConfig()->getString(cfgkey + ".filename", "test.case", &ok);
     
     if (m_needFilter) {
@@ -122,6 +197,8 @@ void FuzzyS2E::initialize()
                                         sigc::mem_fun(*this, &FuzzyS2E::onTranslateBlockStart));
     s2e()->getCorePlugin()->onCustomInstruction.connect(
                                         sigc::mem_fun(*this, &FuzzyS2E::onCustomInstruction));
+    if (m_inlineEdges)
+        s2e()->getCorePlugin()->onTimer.connect(sigc::mem_fun(*this, &FuzzyS2E::onTimer));
     if (m_useDrill) {
         s2e()->getCorePlugin()->onStateForkDecide.connect(sigc::mem_fun(*this, &FuzzyS2E::onStateForkDecide));
         s2e()->getCorePlugin()->onStateFork.connect(sigc::mem_fun(*this, &FuzzyS2E::onStateFork));
@@ -135,8 +212,6 @@ void FuzzyS2E::initialize()
     assert(m_aflBitmapSHM && "AFL's trace bits bitmap is NULL, why??");
     if(!initReadySHM())
         exit(EXIT_FAILURE);
-    if(!initQemuQueue())
-        exit(EXIT_FAILURE);
 
     std::stringstream testcase_strstream;
     testcase_strstream << "/tmp/afltestcase/" << m_QEMUPid;
@@ -147,8 +222,32 @@ void FuzzyS2E::initialize()
         exit(EXIT_FAILURE);
     testcase_strstream << "/" << m_filename;
     m_filename = testcase_strstream.str(); // construct full path name
+    // AFL may not have set them up yet, they are looked for again on the first testcase
+    initInputSHM();
+    initStatsSHM();
+    if (m_edgeIds && !initEdgeTable()) {
+        s2e()->getWarningsStream() << "FuzzyS2E: no edge id table, edges are hashed.\n";
+        m_edgeIds = false;
+    }
+    m_exactEdges = m_edgeIds || m_countCollisions;
+    if (m_exactEdges) {
+        if (!m_edgeIds)
+            m_slotOwner.resize(m_mapSize);
+        g_fuzzyS2E = this;
+        g_s2e_afl_edge_slot = resolveEdgeSlot;
+    }
+    if (m_useDrill) {
+        m_virginBits = attachGlobalMap(VIRGIN_SHM_ENV_VAR, 'a');
+        m_drillBits = attachGlobalMap(DRILL_SHM_ENV_VAR, 'd');
+        if (!m_virginBits || !m_drillBits)
+            s2e()->getWarningsStream() << "FuzzyS2E: no global coverage maps, drilled testcases are not shared.\n";
+    }
 
     s2e()->getExecutor()->setSearcher(this);
+
+    // after everything is initialized, tell AFL we are ready
+    assert(m_QEMUPid);
+    publishDone(FAULT_NONE, 0);
 }
 
 klee::ExecutionState& FuzzyS2E::selectState()
@@ -188,8 +287,17 @@ void FuzzyS2E::onTranslateBlockStart(ExecutionSignal* es,
     if (!tb || !m_mainPid) {
         return;
     }
-    if (m_LinuxMonitor2->getPid(state, pc) == m_mainPid)
+    if (m_LinuxMonitor2->getPid(state, pc) != m_mainPid)
+        return;
+    if (!m_inlineEdges) {
         es->connect(sigc::mem_fun(*this, &FuzzyS2E::slotExecuteBlockStart));
+        return;
+    }
+    if (m_LinuxMonitor2->isKernelAddress(pc) || !isMainImage(pc))
+        return;
+    s2e_tcg_emit_afl_edge(blockLocation(pc), m_exactEdges);
+    if (m_timeoutArmed)
+        es->connect(sigc::mem_fun(*this, &FuzzyS2E::slotCheckTimeout));
 }
 
 void FuzzyS2E::slotExecuteBlockStart(S2EExecutionState *state, uint64_t pc)
@@ -206,11 +314,46 @@ void FuzzyS2E::slotExecuteBlockStart(S2EExecutionState *state, uint64_t pc)
     if (!isMainImage(pc))
         return;
     DECLARE_PLUGINSTATE(FuzzyS2EState, state);
-    plgState->updateAFLBitmapSHM(m_aflBitmapSHM, pc);
+    if (m_exactEdges) {
+        uint32_t cur_location = blockLocation(pc);
+        uint32_t slot = edgeSlot(((uint64_t) plgState->m_prev_loc << 32) | cur_location);
+        curTraceBits()[slot]++;
+        markTraceDirty(curDirtyBits(), slot);
+        plgState->m_prev_loc = cur_location;
+    } else
+        plgState->updateAFLBitmapSHM(curTraceBits(), curDirtyBits(), aflLocation(pc));
     if (plgState->m_ExecTime->check() > m_exeTimeout)
         onWorkStateTimeout(state);
 }
 
+/*
+ * A state cannot be killed from the timer, so once the current test overruns,
+ * the target's blocks are retranslated with a check that does it.
+ */
+void FuzzyS2E::onTimer()
+{
+    S2EExecutionState *state = g_s2e_state;
+    if (m_timeoutArmed || !state || !state->getID())
+        return;
+    DECLARE_PLUGINSTATE(FuzzyS2EState, state);
+    if (plgState->m_ExecTime->check() <= m_exeTimeout)
+        return;
+    m_timeoutArmed = true;
+    tb_flush(env);
+}
+
+void FuzzyS2E::slotCheckTimeout(S2EExecutionState *state, uint64_t pc)
+{
+    DECLARE_PLUGINSTATE(FuzzyS2EState, state);
+    bool timedOut = state->getID() && plgState->m_ExecTime->check() > m_exeTimeout;
+    // Drop the check from the translated code again
+    m_timeoutArmed = false;
+    tb_flush(env);
+    if (timedOut)
+        onWorkStateTimeout(state);
+    throw CpuExitException();
+}
+
 void FuzzyS2E::onWorkStateTimeout(S2EExecutionState *state)
 {
     DECLARE_PLUGINSTATE(FuzzyS2EState, state);
@@ -281,61 +424,81 @@ void FuzzyS2E::onStateFork(S2EExecutionState*  originalState,
         plgState->pc_hits[originalState->getPc()] += 1;
     }
 
-    auto newit = newStates.begin();
-    for (; newit != newStates.end(); newit++) {
-        S2EExecutionState* _state = *newit;
+    /*
+     * If the path so far already brings new bits to the global virgin map, every branch
+     * here is worth drilling; otherwise only the first instance reaching a branch does it.
+     */
+    bool newPrefix = hasNewBits(curTraceBits(), curDirtyBits());
+    uint32_t edge = forkEdge(originalState);
+
+    for (unsigned i = 0; i < newStates.size(); i++) {
+        S2EExecutionState* _state = newStates[i];
         if (_state->getID() == oriID)
             continue;
         if (m_TestcaseFilter->checkRedundantFast(_state, plgState->pc_hits[originalState->getPc()])) {
             s2e()->getDebugStream() << "FuzzyS2E: This state will not generate an interesting testcase!\n";
+            if (m_Stats)
+                m_Stats->drill_skipped++;
+            s2e()->getExecutor()->terminateStateEarly(*_state, "Terminate for testcase generation!");
+            continue;
+        }
+        uint32_t direction = newConditions[i]->hash() & ((m_mapSize << 3) - 1);
+        if (!claimDrillEdge(edge ^ direction) && !newPrefix) {
+            s2e()->getDebugStream() << "FuzzyS2E: This branch has been drilled by another instance!\n";
+            if (m_Stats)
+                m_Stats->drill_skipped++;
             s2e()->getExecutor()->terminateStateEarly(*_state, "Terminate for testcase generation!");
             continue;
         }
 
         std::stringstream gen_testcase_strstream;
-        gen_testcase_strstream << m_genTestcaseDir << "/" << m_QEMUPid << "-" << _state->getID();
-        std::string gen_testcase = gen_testcase_strstream.str();
-        if (generateCaseFile(_state, gen_testcase))
-            s2e()->getDebugStream() << "FuzzyS2E: Successfully generate testcase for state-" << _state->getID() << ".\n";
+        gen_testcase_strstream << m_QEMUPid << "-" << _state->getID();
+        klee::WallTimer solveTimer;
+        if (generateCaseFile(_state, gen_testcase_strstream.str())) {
+            s2e()->getDebugStream() << "FuzzyS2E: Queued testcase for state-" << _state->getID() << ".\n";
+            if (m_Stats)
+                m_Stats->drilled++;
+        }
+        recordPhase(QPHASE_SOLVE, solveTimer.check());
         s2e()->getExecutor()->terminateStateEarly(*_state, "Terminate for testcase generation!");
     }
 }
 
+/*
+ * Get the solution of the state and hand it to the case generator, which writes it
+ * to m_genTestcaseDir. In concolic mode the fork has already solved the state, so
+ * the values are read from its concolics without touching the solver.
+ */
 bool FuzzyS2E::generateCaseFile(S2EExecutionState *state,
-        std::string destfilename)
+        std::string casename)
 {
-    //try to solve the constraint and write the result to destination file
     ConcreteInputs out;
-    //XXX: we have to create a new temple state, otherwise getting solution in half of a state may drive to crash
-    klee::ExecutionState* exploitState = new klee::ExecutionState(*state);
-    bool success = s2e()->getExecutor()->getSymbolicSolution(*exploitState, out);
+    const klee::Assignment::bindings_ty &bindings = state->concolics->bindings;
+
+    bool concolic = true;
+    for (unsigned i = 0; i < state->symbolics.size(); ++i) {
+        if (bindings.find(state->symbolics[i].second) == bindings.end()) {
+            concolic = false;
+            break;
+        }
+    }
+
+    bool success;
+    if (concolic) {
+        success = s2e()->getExecutor()->getSymbolicSolution(state->symbolics, *state->concolics, out);
+    } else {
+        double queryCost = 0;
+        success = s2e()->getExecutor()->getSymbolicSolution(s2e()->getExecutor()->getTimingSolver(*state),
+                                                            state->symbolics, state->constraints, out, queryCost);
+    }
 
     if (!success) {
         s2e()->getWarningsStream() << "Could not get symbolic solutions"
                 << '\n';
-        delete(exploitState);
         return false;
     }
 
-    std::ofstream destfile;
-    destfile.open (destfilename.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
-
-    ConcreteInputs::iterator it;
-    for (it = out.begin(); it != out.end(); ++it) {
-        const VarValuePair &vp = *it;
-        std::string varname = vp.first;
-        std::size_t found = varname.find("dummy");
-        if (found != std::string::npos)
-            continue;
-
-        unsigned wbuffer[1] = { 0 };
-        for (unsigned i = 0; i < vp.second.size(); ++i) {
-            wbuffer[0] = (unsigned) vp.second[i];
-            destfile.write((char*)wbuffer, 1);
-        }
-    }
-    destfile.close();
-    delete(exploitState);
+    m_caseGenerator->submit(casename, out);
     return true;
 }
 
@@ -363,7 +526,8 @@ bool FuzzyS2E::getAFLBitmapSHM()
         }
         int shm_id;
         try {
-            shm_id = shmget(shmkey, AFL_BITMAP_SIZE, IPC_CREAT | 0600);
+            shm_id = shmget(shmkey, (m_mapSize + TRACE_DIRTY_SIZE(m_mapSize)) * QEMUBATCH_MAX,
+                    IPC_CREAT | 0600);
             if (shm_id < 0) {
                 s2e()->getDebugStream() << "FuzzyS2E: shmget() error: "
                         << strerror(errno) << "\n";
@@ -389,55 +553,277 @@ bool FuzzyS2E::getAFLBitmapSHM()
     return true;
 }
 
-bool FuzzyS2E::initQemuQueue()
+bool FuzzyS2E::initReadySHM()
 {
-    int res;
-    if (access(QEMUQUEUE, F_OK) == -1) {
-        res = mkfifo(QEMUQUEUE, 0777);
-        if (res != 0) {
-            s2e()->getDebugStream() << "Could not create fifo " << QEMUQUEUE << ".\n";
-            return false;
-        }
+    void *shm = NULL;
+    int shmid;
+    shmid = shmget((key_t) READYSHMID, sizeof(QemuDoneRing), 0666);
+    if (shmid == -1) {
+        fprintf(stderr, "shmget failed\n");
+        return false;
     }
-    m_queueFd = open(QEMUQUEUE, O_WRONLY | O_NONBLOCK);
+    shm = shmat(shmid, (void*) 0, 0);
+    if (shm == (void*) -1) {
+        fprintf(stderr, "shmat failed\n");
+        return false;
+    }
+    m_DoneRing = (QemuDoneRing*) shm;
+    return true;
+}
 
-    if (m_queueFd == -1)
-    {
-        s2e()->getDebugStream() << "Could not open fifo " << QEMUQUEUE << ".\n";
+// Attach the testcase input buffer that AFL created for us, keyed by our testcase directory.
+bool FuzzyS2E::initInputSHM()
+{
+    key_t shmkey = ftok(m_testcaseDir.c_str(), 'i');
+    if (shmkey < 0) {
+        s2e()->getDebugStream() << "FuzzyS2E: ftok() error: " << strerror(errno) << "\n";
         return false;
     }
-    // after the queue is initialized, write OK to FIFO
-    assert(m_QEMUPid);
-    char buffer[FIFOBUFFERSIZE + 1];
-    memset(buffer, '\0', FIFOBUFFERSIZE + 1);
-    sprintf(buffer, "%d|%d|%lu", m_QEMUPid, FAULT_NONE, (uint64_t)0);
-    res = write(m_queueFd, buffer, FIFOBUFFERSIZE);
-    if (res == -1)
-    {
-        s2e()->getDebugStream() << "Write error on pipe\n";
-        exit(EXIT_FAILURE);
+    int shm_id = shmget(shmkey, sizeof(QemuInputBuf), 0600);
+    if (shm_id < 0) {
+        s2e()->getDebugStream() << "FuzzyS2E: shmget() error: " << strerror(errno) << "\n";
+        return false;
     }
+    void *shm = shmat(shm_id, NULL, 0);
+    if (shm == (void*) -1) {
+        s2e()->getDebugStream() << "FuzzyS2E: shmat() error: " << strerror(errno) << "\n";
+        return false;
+    }
+    m_InputBuf = (QemuInputBuf*) shm;
     return true;
 }
 
-bool FuzzyS2E::initReadySHM()
+// Attach the telemetry block AFL created for us, keyed by our testcase directory.
+bool FuzzyS2E::initStatsSHM()
 {
-    void *shm = NULL;
-    int shmid;
-    shmid = shmget((key_t) READYSHMID, sizeof(uint8_t)*65536, 0666);
-    if (shmid == -1) {
-        fprintf(stderr, "shmget failed\n");
+    key_t shmkey = ftok(m_testcaseDir.c_str(), 's');
+    if (shmkey < 0)
+        return false;
+    int shm_id = shmget(shmkey, sizeof(QemuStats), 0600);
+    if (shm_id < 0) {
+        s2e()->getDebugStream() << "FuzzyS2E: shmget() error: " << strerror(errno) << "\n";
         return false;
     }
-    shm = shmat(shmid, (void*) 0, 0);
+    void *shm = shmat(shm_id, NULL, 0);
     if (shm == (void*) -1) {
-        fprintf(stderr, "shmat failed\n");
+        s2e()->getDebugStream() << "FuzzyS2E: shmat() error: " << strerror(errno) << "\n";
         return false;
     }
-    m_ReadyArray = (uint8_t*) shm;
+    m_Stats = (QemuStats*) shm;
     return true;
 }
 
+/*
+ * Record one latency sample. Each power of two is split into 1 << QSTAT_SUBBITS
+ * buckets, like AFL's qstat_bucket().
+ */
+void FuzzyS2E::recordPhase(unsigned phase, uint64_t us)
+{
+    if (!m_Stats)
+        return;
+
+    QemuPhaseStat *ps = &m_Stats->phase[phase];
+    ps->count++;
+    ps->total_us += us;
+    if (us > ps->max_us)
+        ps->max_us = us;
+    ps->hist[qstat_bucket(us)]++;
+}
+
+/*
+ * Attach one of the maps AFL shares with every instance, by the id AFL exported or
+ * else by the key AFL created it with.
+ */
+volatile uint8_t* FuzzyS2E::attachGlobalMap(const char* envvar, int proj_id)
+{
+    int shm_id = -1;
+    const char* id_str = getenv(envvar);
+    if (id_str)
+        shm_id = atoi(id_str);
+    else {
+        key_t shmkey = ftok(VIRGINFILE, proj_id);
+        if (shmkey < 0) {
+            s2e()->getDebugStream() << "FuzzyS2E: ftok() error: " << strerror(errno) << "\n";
+            return NULL;
+        }
+        shm_id = shmget(shmkey, m_mapSize, 0600);
+    }
+    if (shm_id < 0) {
+        s2e()->getDebugStream() << "FuzzyS2E: shmget() error: " << strerror(errno) << "\n";
+        return NULL;
+    }
+    void *shm = shmat(shm_id, NULL, 0);
+    if (shm == (void*) -1) {
+        s2e()->getDebugStream() << "FuzzyS2E: shmat() error: " << strerror(errno) << "\n";
+        return NULL;
+    }
+    return (volatile uint8_t*) shm;
+}
+
+/*
+ * Like AFL's has_new_bits(), but only looks for new tuples and leaves the virgin map
+ * alone: AFL still has to see the new bits when it classifies the run. Only the lines
+ * marked in dirty are looked at, the rest of the trace is zero.
+ */
+bool FuzzyS2E::hasNewBits(const uint8_t* trace, const uint8_t* dirty) const
+{
+    if (!m_virginBits)
+        return false;
+
+#ifndef __x86_64__
+    const uint64_t* current = (const uint64_t*) trace;
+    const volatile uint64_t* virgin = (const volatile uint64_t*) m_virginBits;
+    const unsigned words = TRACE_LINE_SIZE >> 3;
+#endif
+
+    for (unsigned l = 0; l < (m_mapSize >> TRACE_LINE_SHIFT); l++) {
+        if (!(dirty[l >> 3] & (1 << (l & 7)))) {
+            /* Skip whole clean bytes of the side bitmap at once */
+            if (!dirty[l >> 3])
+                l |= 7;
+            continue;
+        }
+#ifdef __x86_64__
+        /* Other instances and AFL only ever clear virgin bits, a torn read is harmless */
+        const uint8_t *cur = trace + (l << TRACE_LINE_SHIFT);
+        const uint8_t *vir = (const uint8_t*) m_virginBits + (l << TRACE_LINE_SHIFT);
+        if (g_useAvx2 ? lineHasNewBitsAvx2(cur, vir) : lineHasNewBitsSse2(cur, vir))
+            return true;
+#else
+        for (unsigned i = l * words; i < (l + 1) * words; i++) {
+            uint64_t cur = current[i];
+            /* Pristine virgin bytes are 0xff, so a word without common bits has no new tuple */
+            if (!cur || !(cur & virgin[i]))
+                continue;
+            uint64_t vir = virgin[i];
+            for (unsigned b = 0; b < 8; b++) {
+                if (((cur >> (b << 3)) & 0xff) && ((vir >> (b << 3)) & 0xff) == 0xff)
+                    return true;
+            }
+        }
+#endif
+    }
+    return false;
+}
+
+/*
+ * Atomically clear the bit of the given branch in the shared drill map. Returns true
+ * if we are the first instance to do so.
+ */
+bool FuzzyS2E::claimDrillEdge(uint32_t edge)
+{
+    if (!m_drillBits)
+        return true;
+
+    edge &= (m_mapSize << 3) - 1;
+    volatile uint64_t* word = (volatile uint64_t*) m_drillBits + (edge >> 6);
+    uint64_t mask = 1ULL << (edge & 63);
+    return __sync_fetch_and_and(word, ~mask) & mask;
+}
+
+/*
+ * Get current testcase, from the input buffer if possible, otherwise by reading
+ * the testcase file once.
+ */
+const uint8_t* FuzzyS2E::getTestcase(uint32_t *size)
+{
+    if (m_InputBuf) {
+        QemuInputHalf *half = &m_InputBuf->buf[m_InputBuf->cur & 1];
+        if (half->len != INPUTSHM_INFILE) {
+            *size = half->len;
+            return half->data + m_batchPos * half->len;
+        }
+    }
+
+    std::ifstream infile(m_filename.c_str(), std::ios::in | std::ios::binary);
+    if (!infile) {
+        s2e()->getDebugStream() << "FuzzyS2E: could not open " << m_filename << "\n";
+        exit(-1);
+    }
+    m_fileInput.assign(std::istreambuf_iterator<char>(infile), std::istreambuf_iterator<char>());
+    *size = m_fileInput.size();
+    return m_fileInput.data();
+}
+
+/*
+ * Guest asks for the testcase: write it into the guest buffer with a single
+ * writeMemoryConcrete. Return -1 in EAX if the guest has to go through HostFiles;
+ * a testcase that AFL put in the input buffer is then dumped to the testcase file.
+ */
+void FuzzyS2E::injectTestcase(S2EExecutionState *state)
+{
+    klee::WallTimer copyTimer;
+    target_ulong bufAddr, bufSize;
+    target_ulong ret = (target_ulong) -1;
+
+    bool ok = true;
+    ok &= state->readCpuRegisterConcrete(CPU_OFFSET(regs[R_ECX]), &bufAddr, sizeof(target_ulong));
+    ok &= state->readCpuRegisterConcrete(CPU_OFFSET(regs[R_EDX]), &bufSize, sizeof(target_ulong));
+
+    if (ok && m_InputBuf) {
+        QemuInputHalf *half = &m_InputBuf->buf[m_InputBuf->cur & 1];
+        uint32_t len = half->len;
+        if (len != INPUTSHM_INFILE && len <= bufSize) {
+            if (state->writeMemoryConcrete(bufAddr, half->data + m_batchPos * len, len))
+                ret = len;
+            else
+                s2e()->getWarningsStream(state) << "FuzzyS2E: can not write testcase to guest buffer\n";
+        }
+        if (len != INPUTSHM_INFILE && ret == (target_ulong) -1) {
+            // AFL did not write the file, the guest would read a stale or missing one.
+            std::ofstream outfile(m_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            outfile.write((const char*) half->data + m_batchPos * len, len);
+            if (!outfile)
+                s2e()->getWarningsStream(state) << "FuzzyS2E: could not write " << m_filename << "\n";
+        }
+    }
+
+    state->writeCpuRegisterConcrete(CPU_OFFSET(regs[R_EAX]), &ret, sizeof(target_ulong));
+    recordPhase(QPHASE_COPY, copyTimer.check());
+}
+
+/*
+ * Publish a completion record to AFL. The slot is claimed with an atomic increment
+ * of the ring head; since this qemu has no other record in flight and the ring has
+ * more slots than qemu instances, the slot is always free. AFL is only woken up
+ * through the futex if it is actually sleeping on the ring.
+ */
+void FuzzyS2E::publishDone(uint32_t fault, uint64_t exec_us)
+{
+    assert(m_DoneRing && "Haven't seen completion ring yet?");
+    uint32_t pos = __sync_fetch_and_add(&m_DoneRing->head, 1);
+    QemuDoneSlot *slot = &m_DoneRing->slots[pos % QEMURING_SLOTS];
+    while (slot->seq != pos) // AFL has not consumed the previous lap yet
+        sched_yield();
+
+    slot->rec.pid = m_QEMUPid;
+    slot->rec.fault = fault;
+    slot->rec.exec_us = exec_us;
+    __sync_synchronize();
+    slot->seq = pos + 1;
+
+    __sync_fetch_and_add(&m_DoneRing->futex, 1);
+    if (m_DoneRing->waiters)
+        syscall(SYS_futex, &m_DoneRing->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+
+/*
+ * Report the result of the current test. Within a batch the result only goes to
+ * the results array, AFL is notified once the last mutant is done.
+ */
+void FuzzyS2E::finishTest(uint32_t fault, uint64_t exec_us)
+{
+    g_s2e_afl_area = NULL;
+    g_s2e_afl_dirty = NULL;
+    if (m_InputBuf) {
+        m_InputBuf->results[m_batchPos].fault = fault;
+        m_InputBuf->results[m_batchPos].exec_us = exec_us;
+    }
+    if (m_batchPos + 1 < m_batchCount)
+        return;
+    publishDone(fault, exec_us);
+}
 
 void FuzzyS2E::wait_afl_testcase(S2EExecutionState *state)
 {
@@ -447,7 +833,14 @@ void FuzzyS2E::wait_afl_testcase(S2EExecutionState *state)
     char tmp[4];
     char err[128];
     int len;
+    klee::WallTimer phaseTimer;
+    bool fromAFL;
 wait:
+    fromAFL = m_batchPos + 1 >= m_batchCount;
+    if (!fromAFL) {
+        m_batchPos++; // next mutant of the batch is already here
+        goto test;
+    }
     do{
         len = ::read(CTRLPIPE(m_QEMUPid), tmp, 4);
         if(len == -1){
@@ -464,9 +857,34 @@ wait:
         s2e()->getDebugStream() << "FuzzyS2E: we cannot read pipe, length is " << len << ", error is "<< err << "\n";
         exit(2); // we want block here, why not ?
     }
+    recordPhase(QPHASE_WAIT, phaseTimer.check());
+
+    /*
+     * AFL sets up our input buffer and telemetry block after it forked us, which
+     * may be after initialize() looked for them. It has by the time it sends a test.
+     */
+    if (!m_shmRetried) {
+        m_shmRetried = true;
+        if (!m_InputBuf && !initInputSHM())
+            s2e()->getWarningsStream() << "FuzzyS2E: no input share memory, testcases go through files.\n";
+        if (!m_Stats && !initStatsSHM())
+            s2e()->getWarningsStream() << "FuzzyS2E: no stats share memory, telemetry is off.\n";
+    }
+
+    m_batchPos = 0;
+    m_batchCount = 1;
+    if (m_InputBuf) {
+        QemuInputHalf *half = &m_InputBuf->buf[m_InputBuf->cur & 1];
+        if (half->len != INPUTSHM_INFILE && half->count > 1 && half->count <= QEMUBATCH_MAX)
+            m_batchCount = half->count;
+    }
+
+test:
+    if (m_Stats)
+        m_Stats->testcases++;
     if(m_needFilter){
 
-        if (m_useDrill && m_TestcaseFilter->getModeSwitched()) {
+        if (fromAFL && m_useDrill && m_TestcaseFilter->getModeSwitched()) {
             if (tmp[0] == 'n') {
                 assert(m_DrillFreqCounter && "Cannot reach zero!!!");
                 m_DrillFreqCounter -= 1;
@@ -475,17 +893,34 @@ wait:
                 m_DrillFreqCounter = m_drillFreq; // reset counter
         }
 
-        if (m_killRState && tmp[0] == 'n')
+        if (fromAFL && m_killRState && tmp[0] == 'n')
             m_TestcaseFilter->simpSigStates(m_lastID); //XXX
 
         bool next_symbex = false;
 
-        if (m_TestcaseFilter->isRedundant(m_filename.c_str(), &next_symbex)) {
+        // AFL repeats calibration runs on purpose, they must not be filtered out.
+        bool calibrating = m_InputBuf &&
+                (m_InputBuf->buf[m_InputBuf->cur & 1].flags & INPUTSHM_F_CALIBRATE);
+
+        uint32_t size = 0;
+        const uint8_t *input = getTestcase(&size);
+        klee::WallTimer filterTimer;
+        bool redundant = !calibrating && m_TestcaseFilter->isRedundant(input, size, &next_symbex);
+        recordPhase(QPHASE_FILTER, filterTimer.check());
+        if (redundant) {
             s2e()->getDebugStream() << "FuzzyS2E: capure a redundant testcase.\n";
+            if (m_Stats)
+                m_Stats->redundant++;
             report_redundant();// tell afl this is a redundant case and wait again
+            phaseTimer = klee::WallTimer();
             goto wait;
         }
     }
+    if (m_inlineEdges) {
+        g_s2e_afl_area = curTraceBits();
+        g_s2e_afl_dirty = curDirtyBits();
+        state->regs()->write<uint32_t>(CPU_OFFSET(afl_prev_loc), 0);
+    }
     cpu_enable_ticks();
 }
 
@@ -508,27 +943,13 @@ void FuzzyS2E::RemoveUnscheduleState(S2EExecutionState *state)
 
 void FuzzyS2E::report_redundant()
 {
-    char buffer[FIFOBUFFERSIZE + 1];
-    memset(buffer, '\0', FIFOBUFFERSIZE + 1);
-    sprintf(buffer, "%d|%d|%lu", m_QEMUPid, FAULT_REDUNDANT, uint64_t(0));
-    int res = write(m_queueFd, buffer, FIFOBUFFERSIZE);
-    if (res == -1)
-    {
-        s2e()->getDebugStream() << "Write error on pipe, qemu is going to die...\n";
-        s2e()->getDebugStream().flush();
-        exit(EXIT_FAILURE);
-    }
-    assert(m_queueFd > 0 && "Haven't seen qemu queue yet?");
-    m_ReadyArray[m_QEMUPid] = 1;
+    finishTest(FAULT_REDUNDANT, 0);
 }
 
-// Write OK signal to queue to notify AFL that guest is ready (message is qemu's pid).
+// Publish a completion record to notify AFL that guest is ready (record carries qemu's pid).
 void FuzzyS2E::tell_afl(S2EExecutionState *state, bool reserveState) // mark this as an atom procedure, i.e. should NOT be interrupted
 {
     DECLARE_PLUGINSTATE(FuzzyS2EState, state);
-    assert(m_queueFd > 0 && "Haven't seen qemu queue yet?");
-    char buffer[FIFOBUFFERSIZE + 1];
-    memset(buffer, '\0', FIFOBUFFERSIZE + 1);
     if(!plgState->m_ExecTime){
         s2e()->getDebugStream() << "Cannot get execute time ?\n";
         s2e()->getDebugStream().flush();
@@ -536,14 +957,8 @@ void FuzzyS2E::tell_afl(S2EExecutionState *state, bool reserveState) // mark thi
     }
     uint64_t m_ellapsetime = plgState->m_ExecTime->check();
     s2e()->getDebugStream() << "The testing lasts for " << m_ellapsetime << " microseconds.\n";
-    sprintf(buffer, "%d|%d|%lu", m_QEMUPid, plgState->m_fault, m_ellapsetime);
-    int res = write(m_queueFd, buffer, FIFOBUFFERSIZE);
-    if (res == -1)
-    {
-        s2e()->getDebugStream() << "Write error on pipe, qemu is going to die...\n";
-        s2e()->getDebugStream().flush();
-        exit(EXIT_FAILURE);
-    }
+    recordPhase(QPHASE_EXEC, m_ellapsetime);
+    klee::WallTimer tellTimer;
     bool merged = false;
     if (m_needFilter) {
         RemoveUnscheduleState(state);
@@ -551,8 +966,9 @@ void FuzzyS2E::tell_afl(S2EExecutionState *state, bool reserveState) // mark thi
             merged = m_TestcaseFilter->addSigState(state);
     }
     m_lastID = state->getID();
-    assert(!m_ReadyArray[m_QEMUPid] && "I'm free before? ");  //FIXME: bug here
-    m_ReadyArray[m_QEMUPid] = 1;
+    // AFL may hand out the next testcase as soon as it sees this, so publish last.
+    finishTest(plgState->m_fault, m_ellapsetime);
+    recordPhase(QPHASE_TELL, tellTimer.check());
     if (merged)
         s2e()->getExecutor()->terminateStateEarly(*state, "merged states!"); // kill merged state
 }
@@ -566,6 +982,15 @@ void FuzzyS2E::fork_work_state(S2EExecutionState *state)
 
     assert(!state->getID() && "Should come from initial state!");
 
+    if (m_forkNoQuery) {
+        S2EExecutionState *ws = s2e()->getExecutor()->cloneState(state);
+        state->setForking(oldForkStatus);
+        ws->setForking(m_needFilter && m_useDrill && m_TestcaseFilter->getModeSwitched() && !m_DrillFreqCounter);
+        if (m_needFilter)
+            const_arr_id = 0;
+        return;
+    }
+
     if (!m_has_dummy_symb) {
         std::vector<unsigned char> concreteValues;
         unsigned bytes = klee::Expr::getMinBytesForWidth(klee::Expr::Int32);
@@ -699,6 +1124,11 @@ void FuzzyS2E::onCustomInstruction(
             state->writeCpuRegisterConcrete(CPU_OFFSET(regs[R_EAX]), &need_info, sizeof(need_info));
             break;
         }
+        case 0x7: {
+            // Guest wants the testcase to be copied into its buffer
+            injectTestcase(state);
+            break;
+        }
         default: {
             s2e()->getWarningsStream(state) << "Invalid FuzzyS2E opcode "
                     << hexval(operand) << '\n';
@@ -785,18 +1215,157 @@ void FuzzyS2E::handleOpcodeInvocation(S2EExecutionState *state,
 /*
  * update bitmap. Taken from AFL
  */
-bool FuzzyS2EState::updateAFLBitmapSHM(unsigned char* AflBitmap,
-        uint32_t curBBpc)
+bool FuzzyS2EState::updateAFLBitmapSHM(unsigned char* AflBitmap, unsigned char* dirty,
+        uint32_t cur_location)
 {
-    uint32_t cur_location = (curBBpc >> 4) ^ (curBBpc << 8);
-    cur_location &= AFL_BITMAP_SIZE - 1;
-    if (cur_location >= AFL_BITMAP_SIZE)
-        return false;
     AflBitmap[cur_location ^ m_prev_loc]++;
+    markTraceDirty(dirty, cur_location ^ m_prev_loc);
     m_prev_loc = cur_location >> 1;
     return true;
 }
 
+/*
+ * Location of the block at pc as the edge instrumentation sees it. Exact edges
+ * use the offset of the block in the main module, plus one as 0 stands for the
+ * start of the test.
+ */
+uint32_t FuzzyS2E::blockLocation(uint64_t pc) const
+{
+    if (m_exactEdges)
+        return pc - m_mainModuleDes.LoadBase + 1;
+    return aflLocation(pc);
+}
+
+/*
+ * AFL's slot of an exact edge, i.e. where it would have been counted without
+ * exact edges.
+ */
+uint32_t FuzzyS2E::hashEdge(uint64_t key) const
+{
+    uint32_t prev = key >> 32;
+    uint32_t cur = (uint32_t) key;
+    uint32_t slot = aflLocation(m_mainModuleDes.LoadBase + cur - 1);
+    if (prev)
+        slot ^= aflLocation(m_mainModuleDes.LoadBase + prev - 1) >> 1;
+    return slot;
+}
+
+/*
+ * Slot of an exact edge in AFL's bitmap, resolved once per instance. With edge
+ * ids no two edges share a slot until the ids run out; edges past that point,
+ * or whose id never got published, are hashed and all count as collisions.
+ * Otherwise the edge is hashed, and it
+ * collides if another edge got to its slot first.
+ */
+uint32_t FuzzyS2E::edgeSlot(uint64_t key)
+{
+    EdgeSlots::const_iterator it = m_edgeSlots.find(key);
+    if (it != m_edgeSlots.end())
+        return it->second;
+
+    bool collision;
+    uint32_t slot;
+    if (m_edgeIds) {
+        slot = claimEdgeId(key);
+        collision = slot >= m_mapSize;
+        if (collision)
+            slot = hashEdge(key);
+    } else {
+        slot = hashEdge(key);
+        collision = m_slotOwner[slot] && m_slotOwner[slot] != key;
+        if (!m_slotOwner[slot])
+            m_slotOwner[slot] = key;
+    }
+
+    m_edgeSlots[key] = slot;
+    if (m_Stats) {
+        m_Stats->edges = m_edgeSlots.size();
+        m_Stats->collisions += collision;
+    }
+    return slot;
+}
+
+/*
+ * Id of an edge in the shared table, numbering it if no instance has seen it yet.
+ * Returns m_mapSize if the table is full, or if the instance that claimed the key
+ * does not publish its id in time: it may have been killed in between, and the
+ * id would never come.
+ */
+uint32_t FuzzyS2E::claimEdgeId(uint64_t key)
+{
+    uint32_t mask = m_edgeTableSlots - 1;
+    uint32_t i = (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+    for (uint32_t n = 0; n <= mask; n++, i = (i + 1) & mask) {
+        EdgeIdSlot *slot = &m_edgeTable->slots[i];
+        uint64_t k = slot->key;
+        if (!k && !(k = __sync_val_compare_and_swap(&slot->key, 0, key))) {
+            uint32_t id = __sync_fetch_and_add(&m_edgeTable->next_id, 1);
+            slot->id = id + 1;
+            return id < m_mapSize ? id : m_mapSize;
+        }
+        if (k == key) {
+            for (unsigned spin = 0; !slot->id; spin++) { // another instance is numbering it
+                if (spin == EDGEID_SPIN_MAX)
+                    return m_mapSize;
+                sched_yield();
+            }
+            return slot->id - 1 < m_mapSize ? slot->id - 1 : m_mapSize;
+        }
+    }
+    return m_mapSize;
+}
+
+/*
+ * Attach the edge id table, created by the first instance. AFL drops the table
+ * of a previous run on startup.
+ */
+bool FuzzyS2E::initEdgeTable()
+{
+    key_t shmkey = ftok(VIRGINFILE, 'e');
+    if (shmkey < 0) {
+        s2e()->getDebugStream() << "FuzzyS2E: ftok() error: " << strerror(errno) << "\n";
+        return false;
+    }
+    m_edgeTableSlots = m_mapSize << 1;
+    int shm_id = shmget(shmkey, sizeof(EdgeIdTable) + m_edgeTableSlots * sizeof(EdgeIdSlot),
+                        IPC_CREAT | 0600);
+    if (shm_id < 0) {
+        s2e()->getDebugStream() << "FuzzyS2E: shmget() error: " << strerror(errno) << "\n";
+        return false;
+    }
+    void *shm = shmat(shm_id, NULL, 0);
+    if (shm == (void*) -1) {
+        s2e()->getDebugStream() << "FuzzyS2E: shmat() error: " << strerror(errno) << "\n";
+        return false;
+    }
+    m_edgeTable = (EdgeIdTable*) shm;
+    return true;
+}
+
+/*
+ * Identifier of the branch being forked on, for the drill map.
+ */
+uint32_t FuzzyS2E::forkEdge(S2EExecutionState *state)
+{
+    uint32_t prev = prevLoc(state);
+    if (!m_exactEdges)
+        return aflLocation(state->getPc()) ^ prev;
+    uint64_t key = ((uint64_t) prev << 32) | blockLocation(state->getPc());
+    return (key * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+/*
+ * Previous location of the current test, where the edge instrumentation keeps it.
+ */
+uint32_t FuzzyS2E::prevLoc(S2EExecutionState *state)
+{
+    if (m_inlineEdges)
+        return state->regs()->read<uint32_t>(CPU_OFFSET(afl_prev_loc));
+    DECLARE_PLUGINSTATE(FuzzyS2EState, state);
+    return plgState->m_prev_loc;
+}
+
 FuzzyS2EState::FuzzyS2EState()
 {
     m_plugin = NULL;
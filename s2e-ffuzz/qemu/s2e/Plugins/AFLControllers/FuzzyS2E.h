@@ -47,12 +47,14 @@
 #include <s2e/Plugins/HostFiles.h>
 #include <s2e/Plugins/OSMonitor.h>
 #include <s2e/Plugins/Linux/LinuxMonitor2.h>
+#include "CaseGenerator.h"
 
 #include <s2e/S2EExecutor.h>
 #include <s2e/ConfigFile.h>
 #include <klee/Searcher.h>
 #include <vector>
 #include <set>
+#include <unordered_map>
 #include "klee/util/ExprEvaluator.h"
 #include <llvm/Support/TimeValue.h>
 #include <llvm/Support/FileSystem.h>
@@ -118,7 +120,8 @@ public:
     virtual PluginState *clone() const;
     static PluginState *factory(Plugin *p, S2EExecutionState *s);
 
-    inline bool updateAFLBitmapSHM(unsigned char* bitmap, uint32_t pc);
+    inline bool updateAFLBitmapSHM(unsigned char* bitmap, unsigned char* dirty,
+            uint32_t cur_location);
 
 
     friend class FuzzyS2E;
@@ -128,17 +131,161 @@ public:
  * Duplicated code from AFL.
  */
 
-#define AFL_BITMAP_SIZE (1 << 16)
+// Default and largest size of AFL's bitmap, AFL passes the one in use in MAP_SIZE_ENV_VAR
+#define AFL_BITMAP_SIZE     (1 << 16)
+#define AFL_BITMAP_SIZE_MAX (1 << 23)
+#define MAP_SIZE_ENV_VAR    "__AFL_MAP_SIZE"
 
-// QEMU instances queue (as a file)
-#define QEMUQUEUE "/tmp/afl_qemu_queue"
-#define FIFOBUFFERSIZE 512
 // Test cases directory
 #define TESTCASEDIR "/tmp/afltracebits/"
 // Every control pipe
 #define CTRLPIPE(_x) (_x + 226)
-// Share memory ID
+// Share memory ID of the completion ring
 #define READYSHMID 1234
+// Global virgin map maintained by AFL, and the map of branches drilled by any instance
+#define VIRGIN_SHM_ENV_VAR "__AFL_VIRGIN_SHM_ID"
+#define DRILL_SHM_ENV_VAR  "__AFL_DRILL_SHM_ID"
+#define VIRGINFILE         "/tmp/aflvirgin"
+
+/*
+ * Edge numbering shared by all instances (edgeIds mode), so that an edge has the
+ * same slot in every instance's bitmap. Open addressing on the exact edge key;
+ * the first instance to claim a slot's key publishes id + 1 in it. Others wait
+ * for the id for at most EDGEID_SPIN_MAX yields, then hash the edge instead.
+ */
+#define EDGEID_SPIN_MAX 1000
+
+struct EdgeIdSlot {
+    volatile uint64_t key;
+    volatile uint32_t id;
+    uint32_t pad;
+};
+
+struct EdgeIdTable {
+    volatile uint32_t next_id;
+    uint32_t pad;
+    EdgeIdSlot slots[0];
+};
+
+/*
+ * Completion ring shared with AFL. Every qemu publishes one record each time it
+ * becomes free, AFL consumes them. MUST BE EQUAL to what in afl-parrel-qemu.h.
+ */
+#define QEMURING_SLOTS 64
+
+struct QemuDoneRecord {
+    uint32_t pid;
+    uint32_t fault;
+    uint64_t exec_us;
+};
+
+struct QemuDoneSlot {
+    volatile uint32_t seq;  // published when equal to position + 1
+    uint32_t pad;
+    QemuDoneRecord rec;
+};
+
+struct QemuDoneRing {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t futex;
+    volatile uint32_t waiters;
+    QemuDoneSlot slots[QEMURING_SLOTS];
+};
+
+/*
+ * Per-instance testcase input buffer filled by AFL (double-buffered, cur is the
+ * latest half). MUST BE EQUAL to what in afl-parrel-qemu.h.
+ */
+#define INPUTSHM_SIZE   (1 << 20)
+#define INPUTSHM_INFILE 0xffffffff  // testcase is too large, read the file instead
+#define INPUTSHM_F_CALIBRATE  1     // calibration run, execute it even if the filter knows it
+
+/*
+ * A half may hold a batch of count mutants of len bytes each. Mutant i is traced
+ * into the i-th bitmap and reported in results[i]; AFL gets one completion record
+ * after the last one.
+ */
+#define QEMUBATCH_MAX   16
+
+/*
+ * Each trace map is paired with a bitmap of the 64-byte lines touched by the test,
+ * so that AFL only resets and scans those. The side bitmaps follow the QEMUBATCH_MAX
+ * trace maps in the same SHM. MUST BE EQUAL to AFL's afl-parrel-qemu.h
+ */
+#define TRACE_LINE_SHIFT        6
+#define TRACE_LINE_SIZE         (1 << TRACE_LINE_SHIFT)
+#define TRACE_DIRTY_SIZE(_map)  ((_map) >> (TRACE_LINE_SHIFT + 3))
+
+static inline void markTraceDirty(unsigned char* dirty, uint32_t slot)
+{
+    dirty[slot >> (TRACE_LINE_SHIFT + 3)] |= 1 << ((slot >> TRACE_LINE_SHIFT) & 7);
+}
+
+struct QemuBatchResult {
+    uint32_t fault;
+    uint32_t pad;
+    uint64_t exec_us;
+};
+
+struct QemuInputHalf {
+    volatile uint32_t len;
+    volatile uint32_t count;
+    volatile uint32_t flags;
+    uint8_t data[INPUTSHM_SIZE];
+};
+
+struct QemuInputBuf {
+    volatile uint32_t cur;
+    volatile uint32_t seq;
+    QemuInputHalf buf[2];
+    QemuBatchResult results[QEMUBATCH_MAX];
+};
+
+/*
+ * Per-instance telemetry block read by AFL, latencies in log-linear buckets.
+ * MUST BE EQUAL to what in afl-parrel-qemu.h.
+ */
+#define QSTAT_SUBBITS   2
+#define QSTAT_BUCKETS   (32 << QSTAT_SUBBITS)
+
+enum {
+  /* 00 */ QPHASE_WAIT,     // Idle, waiting for AFL's testcase
+  /* 01 */ QPHASE_FILTER,   // TestcaseFilter evaluation
+  /* 02 */ QPHASE_COPY,     // Testcase copied into the guest
+  /* 03 */ QPHASE_EXEC,     // Target execution
+  /* 04 */ QPHASE_TELL,     // Reporting the result to AFL
+  /* 05 */ QPHASE_SOLVE,    // Drilled testcase generation
+  /* 06 */ QPHASE_DISPATCH, // Written by AFL
+  QPHASE_COUNT
+};
+
+struct QemuPhaseStat {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t hist[QSTAT_BUCKETS];
+};
+
+struct QemuStats {
+    uint64_t testcases;
+    uint64_t redundant;
+    uint64_t drilled;
+    uint64_t drill_skipped;
+    uint64_t edges;
+    uint64_t collisions;
+    QemuPhaseStat phase[QPHASE_COUNT];
+};
+
+// Histogram bucket of a latency, MUST BE EQUAL to qstat_bucket() in afl-parrel-qemu.h
+static inline uint32_t qstat_bucket(uint64_t us) {
+    uint32_t msb, idx;
+    if (us < (1 << QSTAT_SUBBITS)) return us;
+    msb = 63 - __builtin_clzll(us);
+    idx = ((msb - QSTAT_SUBBITS + 1) << QSTAT_SUBBITS) +
+          ((us >> (msb - QSTAT_SUBBITS)) & ((1 << QSTAT_SUBBITS) - 1));
+    return idx < QSTAT_BUCKETS ? idx : QSTAT_BUCKETS - 1;
+}
 
 enum {
   /* 00 */ FAULT_NONE,
@@ -161,8 +308,28 @@ private:
             uint64_t operand
             );
     bool getAFLBitmapSHM();
-    bool initQemuQueue();
     bool initReadySHM();
+    void publishDone(uint32_t fault, uint64_t exec_us);
+    void finishTest(uint32_t fault, uint64_t exec_us);
+    unsigned char* curTraceBits() { return m_aflBitmapSHM + m_batchPos * m_mapSize; }
+    unsigned char* curDirtyBits() {
+        return m_aflBitmapSHM + QEMUBATCH_MAX * m_mapSize + m_batchPos * TRACE_DIRTY_SIZE(m_mapSize);
+    }
+    uint32_t aflLocation(uint32_t pc) const { return ((pc >> 4) ^ (pc << 8)) & (m_mapSize - 1); }
+    uint32_t blockLocation(uint64_t pc) const;
+    uint32_t hashEdge(uint64_t key) const;
+    uint32_t claimEdgeId(uint64_t key);
+    bool initEdgeTable();
+    bool initInputSHM();
+    bool initStatsSHM();
+    void recordPhase(unsigned phase, uint64_t us);
+    volatile uint8_t* attachGlobalMap(const char* envvar, int proj_id);
+    bool hasNewBits(const uint8_t* trace, const uint8_t* dirty) const;
+    bool claimDrillEdge(uint32_t edge);
+    uint32_t prevLoc(S2EExecutionState *state);
+    uint32_t forkEdge(S2EExecutionState *state);
+    const uint8_t* getTestcase(uint32_t *size);
+    void injectTestcase(S2EExecutionState *state);
 
     void wait_afl_testcase(S2EExecutionState *state);
     void tell_afl(S2EExecutionState *state, bool ReserveState = true);
@@ -170,7 +337,7 @@ private:
     void wait_work_state(S2EExecutionState *state);
     void report_redundant(void);
     void RemoveUnscheduleState(S2EExecutionState *state);
-    bool generateCaseFile(S2EExecutionState *state, std::string destfilename);
+    bool generateCaseFile(S2EExecutionState *state, std::string casename);
     void handleModuleLoad(S2EExecutionState *state, const S2E_FUZZYS2EMONITOR_MODULE_LOAD &m);
     void handleOpcodeInvocation(S2EExecutionState *state,
                                 uint64_t guestDataPtr,
@@ -195,8 +362,8 @@ public:
     typedef std::set<klee::ExecutionState*, SortById> States;
 
     typedef std::set<std::string> StringSet;
-    typedef std::pair<std::string, std::vector<unsigned char> > VarValuePair;
-    typedef std::vector<VarValuePair> ConcreteInputs;
+    typedef CaseGenerator::VarValuePair VarValuePair;
+    typedef CaseGenerator::ConcreteInputs ConcreteInputs;
 
 
     std::vector<klee::ExecutionState*> m_schedule_states;
@@ -219,6 +386,33 @@ private:
     uint32_t            m_DrillFreqCounter;
     bool                m_has_dummy_symb;
     klee::ref<klee::Expr> m_dummy_symb;
+    /*
+     * Fork work states from the seed state without a solver query: clone it as-is
+     * instead of forking on the dummy symbolic variable. The work state is still
+     * created and deleted on every testcase, memory is not snapshot and restored.
+     */
+    bool                m_forkNoQuery;
+    /*
+     * Emit the AFL edge update straight into the translated code of the target,
+     * and check the execution timeout from the periodic timer.
+     */
+    bool                m_inlineEdges;
+    bool                m_timeoutArmed; // blocks of the target check the timeout
+    /*
+     * Exact edges are keyed by the offsets of both blocks in the main module
+     * rather than hashed at once. With edge ids, they are numbered on first sight
+     * and get a slot of their own; otherwise they are hashed like AFL does, and
+     * only looked at to count the collisions.
+     */
+    bool                m_edgeIds;
+    bool                m_countCollisions;
+    bool                m_exactEdges;
+    uint32_t            m_mapSize;        // size of AFL's bitmap, negotiated at startup
+    EdgeIdTable*        m_edgeTable;      // NULL if edges are not numbered
+    uint32_t            m_edgeTableSlots;
+    typedef std::unordered_map<uint64_t, uint32_t> EdgeSlots;
+    EdgeSlots           m_edgeSlots;      // slot of every exact edge seen so far
+    std::vector<uint64_t> m_slotOwner;    // first edge hashed to each slot
     uint64_t            m_exeTimeout;
     bool                m_parsedModInfo;
     ModuleDescriptor    m_mainModuleDes;
@@ -227,22 +421,29 @@ public:
     /**
      * schdualer
      */
-    unsigned char* m_aflBitmapSHM; //AFL's trace bits bitmap
+    unsigned char* m_aflBitmapSHM; //AFL's trace bits bitmaps, one per mutant of a batch
     bool m_findBitMapSHM; //whether we have find trace bits bitmap
 
     std::string m_genTestcaseDir;   //Drill initial directory
+    CaseGenerator* m_caseGenerator; //writes drilled testcases into m_genTestcaseDir
     std::string m_testcaseDir;
     std::string m_filename;
     // AFL end
     std::string m_mainModule;	//main module name (i.e. target binary)
     uint64_t m_mainPid;         //main process PID
-    unsigned char m_caseGenetated[AFL_BITMAP_SIZE]; // branches we have generated case
+    volatile uint8_t* m_virginBits; // AFL's virgin bits, shared by all instances (NULL if unavailable)
+    volatile uint8_t* m_drillBits;  // branches some instance has generated case for, 0xff is virgin
 
     int m_shmID;
     uint32_t m_QEMUPid;
     uint32_t m_PPid;
-    int m_queueFd;
-    uint8_t* m_ReadyArray;
+    QemuDoneRing* m_DoneRing;
+    QemuInputBuf* m_InputBuf;        // NULL if testcases only come as files
+    bool m_shmRetried;               // Looked for AFL's SHM again on the first testcase
+    QemuStats* m_Stats;              // NULL if AFL does not collect telemetry
+    uint32_t m_batchPos;             // mutant of the current batch under test
+    uint32_t m_batchCount;           // mutants in the current batch
+    std::vector<uint8_t> m_fileInput; // testcase read from file as a fallback
     uint64_t m_lastID;
 
     bool m_verbose; //verbose debug output
@@ -261,11 +462,28 @@ public:
         m_shmID = 0;
         m_mainPid = 0;
         m_QEMUPid = 0;
-        m_queueFd = -1;
+        m_DoneRing = NULL;
+        m_InputBuf = NULL;
+        m_shmRetried = false;
+        m_Stats = NULL;
+        m_batchPos = 0;
+        m_batchCount = 1;
+        m_virginBits = NULL;
+        m_drillBits = NULL;
+        m_caseGenerator = NULL;
         m_aflBitmapSHM = 0;
         m_findBitMapSHM = false;
         m_verbose = false;
         m_has_dummy_symb = false;
+        m_forkNoQuery = false;
+        m_inlineEdges = false;
+        m_timeoutArmed = false;
+        m_edgeIds = false;
+        m_countCollisions = false;
+        m_exactEdges = false;
+        m_mapSize = AFL_BITMAP_SIZE;
+        m_edgeTable = NULL;
+        m_edgeTableSlots = 0;
         m_parsedModInfo = false;
     }
     virtual ~FuzzyS2E();
@@ -273,6 +491,9 @@ public:
 
     void onTranslateBlockStart(ExecutionSignal*, S2EExecutionState*, TranslationBlock*, uint64_t);
     void slotExecuteBlockStart(S2EExecutionState* state, uint64_t pc);
+    void slotCheckTimeout(S2EExecutionState* state, uint64_t pc);
+    void onTimer();
+    uint32_t edgeSlot(uint64_t key);
 
     void onSegmentFault(S2EExecutionState*, uint64_t, uint64_t);
     void onDividebyZero(S2EExecutionState*, uint64_t, uint64_t, bool);
@@ -128,19 +128,33 @@ bool TestcaseFilter::addSigState(S2EExecutionState* state) {
         return true;
     }
 
+    uint32_t inputsize = state->getInputSize();
+
+    /* Same path constraints as a significant state already, without walking them */
+    uint64_t pchash = pcHash(state);
+    auto PHit = m_pcHashes.find(inputsize);
+    if (PHit != m_pcHashes.end() && PHit->second.count(pchash)) {
+        s2e()->getDebugStream()<< "TestcaseFilter: found need merged states, len is " << inputsize << ".\n";
+        m_sigID_ConInMainImage.erase(state->getID());
+        return true;
+    }
+
     s2e()->getDebugStream() << "TestcaseFilter: adding state[" << state->getID() << "] to significant states, its"
             "constraints are: \n";
 
     std::set<klee::ref<klee::Expr> > PC = state->constraints.getConstraintSet();
-    std::set<uint64_t> hashes;
+    ConHashes hashes;
+    hashes.reserve(PC.size());
     auto pcit = PC.begin();
     for (; pcit != PC.end(); pcit++) {
         klee::ref<klee::Expr> tmp = (*pcit);
         tmp.get()->print(s2e()->getDebugStream());
         unsigned hashval = tmp.get()->hash();
         s2e()->getDebugStream() << "\nIts hash is " << hashval << "\n";
-        hashes.insert(hashval);
+        hashes.push_back(hashval);
     }
+    std::sort(hashes.begin(), hashes.end());
+    hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
 
     auto hsit = hashes.begin();
     s2e()->getDebugStream() << "-----------------------------------------------------\n";
@@ -149,23 +163,16 @@ bool TestcaseFilter::addSigState(S2EExecutionState* state) {
     }
     s2e()->getDebugStream() << "-----------------------------------------------------\n";
 
-    uint32_t inputsize = state->getInputSize();
-
-    auto ssit = m_sigID_States.begin();
-    for (; ssit != m_sigID_States.end(); ssit++) {
-        S2EExecutionState* current = static_cast<S2EExecutionState*>(ssit->second);
-        if (current->getInputSize() != inputsize)
-            continue;
-        std::set<uint64_t> currentHashes = m_sigID_ConHash[current->getID()];
-        if (currentHashes == hashes){
-            s2e()->getDebugStream()<< "TestcaseFilter: found need merged states, len is " << inputsize << ".\n";
-            m_sigID_ConInMainImage.erase(state->getID());
-            return true;
-        }
+    if (findMergeable(inputsize, hashes)) {
+        s2e()->getDebugStream()<< "TestcaseFilter: found need merged states, len is " << inputsize << ".\n";
+        m_sigID_ConInMainImage.erase(state->getID());
+        return true;
     }
 
-
+    indexSigState(state->getID(), inputsize, hashes);
     m_sigID_ConHash.insert(std::make_pair(state->getID(), hashes)); // Use hash value to evaluate expression quickly
+    m_sigID_PCHash.insert(std::make_pair(state->getID(), pchash));
+    m_pcHashes[inputsize][pchash]++;
     m_sigID_HD.insert(std::make_pair(state->getID(), 0)); // initial hot degree to zero
     m_sigID_States.insert(std::make_pair(state->getID(), state));
 
@@ -209,74 +216,152 @@ void TestcaseFilter::onDisabledFork(S2EExecutionState* originalState, klee::ref<
     }
 }
 
-bool TestcaseFilter::filterSplitedStateFast(S2EExecutionState* state,
-                                            std::set<uint64_t>& vH_T,
-                                            std::set<uint64_t>& vH_F,
-                                            bool& redundant)
+/*
+ * Only states sharing the first hash of the new state can be equal to it, so the inverted
+ * index gives the candidates directly.
+ */
+bool TestcaseFilter::findMergeable(uint32_t inputsize, const ConHashes &hashes)
 {
-    std::set<uint64_t> currentHashes = m_sigID_ConHash[state->getID()];
+    if (hashes.empty()) {
+        auto ISit = m_input_states.find(inputsize);
+        if (ISit == m_input_states.end())
+            return false;
+        for (auto it = ISit->second.begin(); it != ISit->second.end(); it++) {
+            if (m_sigID_ConHash[(*it)->getID()].empty())
+                return true;
+        }
+        return false;
+    }
 
+    auto CHIit = m_conHashIndex.find(inputsize);
+    if (CHIit == m_conHashIndex.end())
+        return false;
+    auto IDsit = CHIit->second.find(hashes[0]);
+    if (IDsit == CHIit->second.end())
+        return false;
+    for (auto idit = IDsit->second.begin(); idit != IDsit->second.end(); idit++) {
+        if (m_sigID_ConHash[*idit] == hashes)
+            return true;
+    }
+    return false;
+}
 
-    auto Fit = vH_F.begin();
+void TestcaseFilter::indexSigState(uint64_t id, uint32_t inputsize, const ConHashes &hashes)
+{
+    ConHash_IDs &index = m_conHashIndex[inputsize];
+    for (auto hsit = hashes.begin(); hsit != hashes.end(); hsit++)
+        index[*hsit].push_back(id);
+}
 
-    // Verify false first
-    for (; Fit != vH_F.end(); Fit++) {
-        if (currentHashes.find(*Fit) != currentHashes.end())
-            return true;
+void TestcaseFilter::unindexSigState(uint64_t id, uint32_t inputsize)
+{
+    ConHash_IDs &index = m_conHashIndex[inputsize];
+    const ConHashes &hashes = m_sigID_ConHash[id];
+    for (auto hsit = hashes.begin(); hsit != hashes.end(); hsit++) {
+        auto IDsit = index.find(*hsit);
+        if (IDsit == index.end())
+            continue;
+        std::vector<uint64_t> &ids = IDsit->second;
+        auto idit = std::find(ids.begin(), ids.end(), id);
+        if (idit != ids.end()) {
+            *idit = ids.back();
+            ids.pop_back();
+        }
+        if (ids.empty())
+            index.erase(IDsit);
     }
 
-    // then move on to verify true
-    auto Tit = currentHashes.begin();
-    for (; Tit != currentHashes.end(); Tit++) {
-        if (vH_T.find(*Tit) == vH_T.end()){
-            redundant = false;
-            return false;
+    auto PHit = m_sigID_PCHash.find(id);
+    if (PHit != m_sigID_PCHash.end()) {
+        std::unordered_map<uint64_t, uint32_t> &pchashes = m_pcHashes[inputsize];
+        auto it = pchashes.find(PHit->second);
+        if (it != pchashes.end() && !--it->second)
+            pchashes.erase(it);
+        m_sigID_PCHash.erase(PHit);
+    }
+}
+
+/*
+ * Record the value of a main image constraint and propagate it to every significant
+ * state containing it: a FALSE refutes the state, a TRUE brings it one step closer
+ * to being fully verified.
+ */
+void TestcaseFilter::markVerified(const ConHash_IDs &index, uint64_t hash, bool isTrue, Verification &ver)
+{
+    ver.verdicts[hash] = isTrue;
+    auto IDsit = index.find(hash);
+    if (IDsit == index.end())
+        return;
+    for (auto idit = IDsit->second.begin(); idit != IDsit->second.end(); idit++) {
+        if (!isTrue) {
+            ver.refuted.insert(*idit);
+            continue;
         }
+        auto rit = ver.remaining.find(*idit);
+        if (rit == ver.remaining.end())
+            rit = ver.remaining.insert(std::make_pair(*idit, (uint32_t) m_sigID_ConHash[*idit].size())).first;
+        rit->second--;
     }
+}
+
+bool TestcaseFilter::filterSplitedStateFast(S2EExecutionState* state,
+                                            const Verification& ver,
+                                            bool& redundant)
+{
+    uint64_t id = state->getID();
 
+    // Verify false first
+    if (ver.refuted.count(id))
+        return true;
 
-    redundant = true;
+    // then move on to verify true
+    auto rit = ver.remaining.find(id);
+    if (rit != ver.remaining.end())
+        redundant = !rit->second;
+    else
+        redundant = m_sigID_ConHash[id].empty();
     return false;
 }
 
 
 //TODO: Break this function into smaller ones.
-bool TestcaseFilter::isRedundant(const char* filename, bool* need_symbex)
+bool TestcaseFilter::isRedundant(const uint8_t* input, uint32_t filesize, bool* need_symbex)
 {
     if(!m_sigID_States.size())
         return false;
-    int fd = open(filename, O_RDWR);
-    if (fd < 0) {
-        g_s2e->getDebugStream() << "TestcaseFilter: could not open " <<  filename << "\n";
-        char err[128];
-        sprintf(err, "errno.%d is: %s/n", errno, strerror(errno));
-        s2e()->getDebugStream() << err << "\n";
-        exit(-1);
-    }
-    off_t filesize = lseek(fd, 0, SEEK_END); // get size
-    if(filesize < 0){
-        g_s2e->getDebugStream() << "Bad file\n";
-        close(fd);
-        exit(-1);
-    }
 
     bool redundant = false;
     uint64_t actVerified = 0;
     klee::WallTimer* timer = new klee::WallTimer();
 
-    std::set<uint64_t> verHashes_T; // for verified TRUE
-    std::set<uint64_t> verHashes_F; // for verified FALSE
-
-
-    std::set<S2EExecutionState*> allSameLenState = m_input_states[filesize];
+    Verification ver;
+    static const ConHash_IDs noIndex;
+    auto CHIit = m_conHashIndex.find(filesize);
+    const ConHash_IDs &index = CHIit == m_conHashIndex.end() ? noIndex : CHIit->second;
+
+    /*
+     * One assignment is shared by all candidates: it binds every candidate's arrays,
+     * so its expression cache (keyed by Expr::hash()) keeps sub-expression results
+     * across constraints and across states. A candidate whose constant arrays are
+     * bound to other values in it is evaluated on an assignment of its own, and
+     * neither uses nor records verdicts, which only hold for the shared one.
+     */
+    klee::Assignment batch;
+    klee::CachedAssignmentEvaluator evaluator(batch);
+    std::vector<unsigned char> inputData(input, input + filesize);
+
+    static const std::set<S2EExecutionState*> noStates;
+    auto ISit = m_input_states.find(filesize);
+    const std::set<S2EExecutionState*> &allSameLenState = ISit == m_input_states.end() ? noStates : ISit->second;
 
     auto it = allSameLenState.begin();
 
     for (; it != allSameLenState.end(); it++) {
         S2EExecutionState* current = (*it);
+        bool shared = bindCandidate(batch, current, inputData);
 
         bool testRedundant = false;
-        if (filterSplitedStateFast(current, verHashes_T, verHashes_F, testRedundant)){
+        if (shared && filterSplitedStateFast(current, ver, testRedundant)){
             s2e()->getDebugStream() << "find false hash, continue.\n";
             continue;
         }
@@ -290,42 +375,18 @@ bool TestcaseFilter::isRedundant(const char* filename, bool* need_symbex)
 
         actVerified++;
 
-        std::vector<const klee::Array*> symbObjects;
-        std::vector<std::vector<unsigned char> > concreteObjects;
-        auto bindit = current->concolics->bindings.begin();
-
-        for (; bindit != current->concolics->bindings.end(); bindit++) {
-            const klee::Array* arr = (*bindit).first;
-            symbObjects.push_back(arr);
-            if (strstr(arr->getName().c_str(), "const_arr") || strstr(arr->getName().c_str(), "dummy")) {
-                concreteObjects.push_back((*bindit).second);
-            }
-            else {
-                std::vector<unsigned char> concreteData;
-                for (unsigned i = 0; i< filesize; ++i) {
-                    uint8_t byte = 0;
-                    lseek(fd, i, SEEK_SET);
-                    if (::read(fd, &byte, 1) <= 0) {
-                        close(fd);
-                        s2e()->getDebugStream() << "TestcaseFilter: Significant testcase because could bit readfile.\n";
-                        return false;
-                    }
-                    concreteData.push_back(byte);
-                }
-                concreteObjects.push_back(concreteData);
-            }
-        }
-        current->concolics->clear();
-        for (unsigned i = 0; i < symbObjects.size(); ++i) {
-            current->concolics->add(symbObjects[i], concreteObjects[i]);
-        }
+        klee::Assignment own;
+        klee::CachedAssignmentEvaluator ownEvaluator(own);
+        if (!shared)
+            bindCandidate(own, current, inputData);
+        klee::CachedAssignmentEvaluator &eval = shared ? evaluator : ownEvaluator;
 
-        std::set<klee::ref<klee::Expr> > PC = m_sigID_ConInMainImage[current->getID()];
         auto CMIit = m_sigID_ConInMainImage.find(current->getID());
         if(CMIit == m_sigID_ConInMainImage.end()) {
             s2e()->getDebugStream() << "TestcaseFilter: cannot find state: " << current->getID() << " in m_sigID_ConInMainImage\n";
             exit(-1);
         }
+        const PathConstraint &PC = CMIit->second;
 
         if (!PC.size()){
             s2e()->getDebugStream() << "TestcaseFilter: verifying state: " << current->getID() << " has no pc\n";
@@ -334,18 +395,20 @@ bool TestcaseFilter::isRedundant(const char* filename, bool* need_symbex)
         for (; pcit != PC.end(); pcit++) {
             /* Fast check whether we have evaluated this expression before */
             uint64_t hash = (*pcit).get()->hash();
-            if (verHashes_T.find(hash) != verHashes_T.end())
-                continue;
-            if (verHashes_F.find(hash) != verHashes_F.end())
+            auto vit = shared ? ver.verdicts.find(hash) : ver.verdicts.end();
+            if (vit != ver.verdicts.end()) {
+                if (vit->second)
+                    continue;
                 break;
+            }
 
-            klee::ref<klee::Expr> evalResult = current->concolics->evaluate(*pcit);
+            klee::ref<klee::Expr> evalResult = eval.visit(*pcit);
             klee::ConstantExpr *ce = dyn_cast<klee::ConstantExpr>(evalResult);
             if (!ce) {
                 s2e()->getDebugStream() << "Could not evaluate the following expression to a constant.\n";
                 evalResult.get()->print(s2e()->getDebugStream());
                 s2e()->getDebugStream() << "\n";
-                close(fd);
+                delete timer;
                 bool ret = (bool)(rand() % 5);
                 if (ret) {
                     s2e()->getDebugStream() << "Verified to same path as state " << current->getID() << "\n";
@@ -354,13 +417,12 @@ bool TestcaseFilter::isRedundant(const char* filename, bool* need_symbex)
                 return (ret);
             }
             bool conditionIsTrue = ce->isTrue();
-            if (conditionIsTrue) {
-                verHashes_T.insert(hash);
+            if (shared)
+                markVerified(index, hash, conditionIsTrue, ver);
+            if (conditionIsTrue)
                 continue;
-            } else {
-                verHashes_F.insert(hash);
+            else
                 break;
-            }
         }
 
         redundant = pcit == PC.end();
@@ -388,12 +450,46 @@ cleanup:
     s2e()->getDebugStream() << "TestcaseFilter: Currently has " << m_sigID_States.size() << " states need to verify and " << allSameLenState.size() << " same"
                                                                                                                         " file-len states.\n";
     s2e()->getDebugStream() << "TestcaseFilter: Evaluation has tried for " << actVerified << "states, and costs " << ellapseTime << " us\n";
-    close(fd);
     delete timer;
     return redundant;
 }
 
 
+/*
+ * Bind a candidate's symbolic input arrays to the testcase and its other arrays (constant
+ * arrays, dummy variable) to its own concolic values. The state itself is left untouched.
+ * Returns false, binding nothing, if an array is already bound to other values: constant
+ * arrays and the dummy variable are shared between states forked from the same one, but
+ * their concolic values need not agree.
+ */
+bool TestcaseFilter::bindCandidate(klee::Assignment &batch, S2EExecutionState *state,
+                                   const std::vector<unsigned char> &input)
+{
+    const klee::Assignment::bindings_ty &bindings = state->concolics->bindings;
+
+    for (auto bindit = bindings.begin(); bindit != bindings.end(); bindit++) {
+        const klee::Array* arr = (*bindit).first;
+        auto bit = batch.bindings.find(arr);
+        if (bit == batch.bindings.end())
+            continue;
+        if (strstr(arr->getName().c_str(), "const_arr") || strstr(arr->getName().c_str(), "dummy")) {
+            if ((*bit).second != (*bindit).second)
+                return false;
+        }
+    }
+
+    for (auto bindit = bindings.begin(); bindit != bindings.end(); bindit++) {
+        const klee::Array* arr = (*bindit).first;
+        if (batch.bindings.count(arr))
+            continue;
+        if (strstr(arr->getName().c_str(), "const_arr") || strstr(arr->getName().c_str(), "dummy"))
+            batch.add(arr, (*bindit).second);
+        else
+            batch.add(arr, input);
+    }
+    return true;
+}
+
 void TestcaseFilter::simpSigStates(uint64_t id)
 {
 
@@ -523,14 +619,9 @@ bool TestcaseFilter::checkRedundantFast(S2EExecutionState* _state, uint64_t hitc
         return true;
 
 
-    std::set<S2EExecutionState* > allSamelenStates = m_input_states[_state->getInputSize()];
-
-    auto it = allSamelenStates.begin();
-    for (; it != allSamelenStates.end(); it++) {
-        S2EExecutionState* _tmp = *it;
-        if (m_sigID_ConHash[_tmp->getID()].find(lastHS) != m_sigID_ConHash[_tmp->getID()].end())
-            return true;
-    }
+    auto CHIit = m_conHashIndex.find(_state->getInputSize());
+    if (CHIit != m_conHashIndex.end() && CHIit->second.count(lastHS))
+        return true;
 
     m_drill_ConHash[_state->getInputSize()].insert(lastHS);
 
@@ -557,10 +648,12 @@ bool TestcaseFilter::updateHotStates()
         return touched;
     // clean ups, remove the state and determine whether need to symbex again.
 
+    S2EExecutionState* unhotState = m_sigID_States[touchedID];
+    unindexSigState(touchedID, unhotState->getInputSize());
+
     m_sigID_ConHash.erase(touchedID);
     m_sigID_HD.erase(touchedID);
 
-    S2EExecutionState* unhotState = m_sigID_States[touchedID];
     std::set<S2EExecutionState*> allSameLenState = m_input_states[unhotState->getInputSize()];
     allSameLenState.erase(allSameLenState.find(unhotState));
     m_input_states[unhotState->getInputSize()] = allSameLenState;
@@ -603,28 +696,34 @@ void TestcaseFilter::CollectSignificantOffs(S2EExecutionState* state)
     if (!sigOffset.size())
         return;
 
+    // One bit per input byte, OR-ed into what previous states found so the
+    // map AFL reads only ever grows.
+    uint32_t inputSize = state->getInputSize();
+    std::vector<uint8_t> map((inputSize + 7) / 8, 0);
+
     std::stringstream offs_strstream;
-    offs_strstream << OFFSDIR << "/" << state->getInputSize() << ".off";
+    offs_strstream << OFFSDIR << "/" << inputSize << ".map";
 
-    int fd = open(offs_strstream.str().c_str(), O_WRONLY | O_CREAT, 0666);
+    int fd = open(offs_strstream.str().c_str(), O_RDWR | O_CREAT, 0666);
     if (fd < 0) {
         s2e()->getDebugStream() << "TestcaseFilter: Cannot open offset file: " << offs_strstream.str() << " to write collected offsets.\n";
         char err[128];
         sprintf(err, "errno.%d is: %s/n", errno, strerror(errno));
         s2e()->getDebugStream() << err << "\n";
-        close(fd);
         exit(-1);
     }
     writew_lock(fd);
+    if (0 > pread(fd, &map[0], map.size(), 0))
+        exit(-1);
     auto offit = sigOffset.begin();
     for (; offit != sigOffset.end(); offit++) {
-        char off_str[32];
-        memset(off_str, 0, sizeof(off_str));
-        sprintf(off_str, "%d-", *offit);
+        if (*offit >= inputSize)
+            continue;
         s2e()->getDebugStream() << "TestcaseFilter: Writing " << *offit << "\n";
-        if (0 > write(fd, off_str, strlen(off_str)))
-            exit(-1);
+        map[*offit >> 3] |= 1 << (*offit & 7);
     }
+    if (0 > pwrite(fd, &map[0], map.size(), 0))
+        exit(-1);
     unlock(fd);
     close(fd);
 }
@@ -51,6 +51,8 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include "klee/util/ExprEvaluator.h"
 #include <llvm/Support/TimeValue.h>
 #include <llvm/Support/FileSystem.h>
@@ -61,6 +63,7 @@
 #include "klee/Expr.h"
 #include "klee/Internal/ADT/TreeStream.h"
 #include "klee/Internal/Support/Timer.h"
+#include "klee/util/Assignment.h"
 
 #include "InputEndDetector.h"
 
@@ -122,7 +125,11 @@ private:
 
     typedef std::set< SizePathConstraint*, SortBySymSize >TouchedPaths;
     typedef std::map <uint64_t, PathConstraint > ID_PC;
-    typedef std::map <uint64_t, std::set<uint64_t> > ID_ConHash;
+    typedef std::vector<uint64_t> ConHashes; // sorted and unique constraint hashes
+    typedef std::map <uint64_t, ConHashes > ID_ConHash;
+    typedef std::unordered_map <uint64_t, std::vector<uint64_t> > ConHash_IDs; // constraint hash -> state ids
+    typedef std::map <uint32_t, ConHash_IDs> InputSize_ConHashIndex;
+    typedef std::map <uint32_t, std::unordered_map<uint64_t, uint32_t> > InputSize_PCHashes; // path constraint hash -> count
     typedef std::map <uint64_t, uint32_t> ID_HotDegree;
     typedef std::map <uint64_t, S2EExecutionState*> ID_State;
     typedef std::map <uint32_t, std::set<S2EExecutionState* > > InputSize_States;
@@ -132,6 +139,9 @@ private:
 
     InputSize_States    m_input_states;
     ID_ConHash          m_sigID_ConHash;
+    InputSize_ConHashIndex m_conHashIndex; // inverted index of m_sigID_ConHash per input size
+    std::map <uint64_t, uint64_t> m_sigID_PCHash; // cumulative path constraint hash of each state
+    InputSize_PCHashes  m_pcHashes;
     ID_PC               m_sigID_ConInMainImage; // only collect the constraint in main image
     std::map <uint32_t, std::set<uint64_t> > m_drill_ConHash;
     std::map <uint32_t, std::set<LoopBucket*> > m_dril_inputsizeLB;
@@ -156,12 +166,28 @@ private:
     uint64_t m_mainImageEnd;
 
 
+    /* Verification progress of the significant states against one testcase */
+    struct Verification {
+        std::unordered_map<uint64_t, bool> verdicts;      // constraint hash -> evaluated value
+        std::unordered_map<uint64_t, uint32_t> remaining; // state id -> constraints not verified TRUE yet
+        std::unordered_set<uint64_t> refuted;             // states with a constraint verified FALSE
+    };
+
 private:
 
     void CollectSignificantOffs(S2EExecutionState *state);
 
+    void indexSigState(uint64_t id, uint32_t inputsize, const ConHashes &hashes);
+    void unindexSigState(uint64_t id, uint32_t inputsize);
+    bool findMergeable(uint32_t inputsize, const ConHashes &hashes);
+    void markVerified(const ConHash_IDs &index, uint64_t hash, bool isTrue, Verification &ver);
+
     void findInputBytes(klee::ref<klee::Expr>, std::set<uint32_t>&);
 
+    static uint64_t pcHash(S2EExecutionState *state) {
+        return state->constraints.hash() ^ (state->constraints.size() * 0x9e3779b97f4a7c15ULL);
+    }
+
     void addTouchedPath(int size, PathConstraint pc) {
         SizePathConstraint* addpc = new SizePathConstraint(size, pc);
         m_touched_symSize_PC.insert(addpc);
@@ -170,10 +196,12 @@ private:
     bool updateHotStates(void);
 
     bool filterSplitedStateFast(S2EExecutionState*,
-                                    std::set<uint64_t>&,
-                                    std::set<uint64_t>&,
+                                    const Verification&,
                                     bool&);
 
+    bool bindCandidate(klee::Assignment &batch, S2EExecutionState *state,
+                       const std::vector<unsigned char> &input);
+
     void onDisabledFork(S2EExecutionState* originalState, klee::ref<klee::Expr> & Condition);
 
 public:
@@ -198,7 +226,7 @@ public:
     /* Kill last states that added into sigStates because fuzzer told us it didn't touch any new path */
     void simpSigStates(uint64_t);
 
-    bool isRedundant(const char* filename, bool*);
+    bool isRedundant(const uint8_t* input, uint32_t size, bool*);
 
     /* When drilling, check whether this branch has been touched before */
     bool checkRedundantFast(S2EExecutionState*, uint64_t hitcount);
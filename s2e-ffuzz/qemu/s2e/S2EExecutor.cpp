@@ -2490,6 +2490,41 @@ S2EExecutor::StatePair S2EExecutor::forkCondition(S2EExecutionState *state, klee
     return sp;
 }
 
+/// \brief Clone state
+///
+/// Make an exact copy of the active state, with the same constraints and
+/// concolic values. Unlike forkCondition, no solver query is issued and
+/// no fork notification is sent. The clone shares all memory objects with
+/// the original state copy-on-write and resumes from the same point.
+///
+/// \param state current state, must be running symbolically
+/// \return the clone
+///
+S2EExecutionState *S2EExecutor::cloneState(S2EExecutionState *state)
+{
+    assert(state->m_active && !state->m_runningConcrete);
+
+    notifyBranch(*state);
+
+    S2EExecutionState *clone = static_cast<S2EExecutionState*>(state->branch());
+    addedStates.insert(clone);
+    clone->concolics->bindings = state->concolics->bindings;
+
+    state->ptreeNode->data = 0;
+    std::pair<PTree::Node*, PTree::Node*> res = processTree->split(state->ptreeNode, clone, state);
+    clone->ptreeNode = res.first;
+    state->ptreeNode = res.second;
+
+    m_s2e->getInfoStream(state) << "Cloning state " << state->getID()
+            << " at pc = " << hexval(state->getPc())
+            << " into state " << clone->getID() << '\n';
+
+    clone->m_needFinalizeTBExec = true;
+    clone->m_active = false;
+
+    return clone;
+}
+
 /// \brief Fork state for each value
 ///
 /// For every value from \p values: fork a new state with constraint
@@ -2965,6 +3000,7 @@ void s2e_initialize_execution(int execute_always_klee)
     //XXX: move it to better place (signal handler for this?)
     tcg_register_helper((void*)&s2e_tcg_execution_handler, "s2e_tcg_execution_handler");
     tcg_register_helper((void*)&s2e_tcg_custom_instruction_handler, "s2e_tcg_custom_instruction_handler");
+    tcg_register_helper_with_reg_mask((void*)&s2e_tcg_afl_edge_handler, "s2e_tcg_afl_edge_handler", 0, 0, 0);
 }
 
 void s2e_register_cpu(CPUX86State *cpu_env)
@@ -180,6 +180,9 @@ public:
     StatePair forkCondition(S2EExecutionState *state, klee::ref<klee::Expr> condition,
             bool keepConditionTrueInCurrentState = false, bool addCondition = true);
 
+    /** Clone the active state without any fork condition */
+    S2EExecutionState *cloneState(S2EExecutionState *state);
+
     std::vector<klee::ExecutionState*> forkValues(S2EExecutionState *state, bool isSeedState,
             klee::ref<klee::Expr> expr, const std::vector<klee::ref<klee::Expr>> &values);
 
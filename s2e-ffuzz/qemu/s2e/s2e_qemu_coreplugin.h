@@ -36,6 +36,19 @@ void s2e_tcg_custom_instruction_handler(uint64_t arg);
 /** Called by the translator when a custom instruction is detected */
 void s2e_tcg_emit_custom_instruction(uint64_t arg);
 
+/** AFL bitmap updated by the edge instrumentation, NULL to drop edges */
+extern unsigned char *g_s2e_afl_area;
+/** One bit per 64-byte line of g_s2e_afl_area touched, set along with it */
+extern unsigned char *g_s2e_afl_dirty;
+/** Maps exact edge keys to bitmap slots, see s2e_tcg_emit_afl_edge() */
+extern uint32_t (*g_s2e_afl_edge_slot)(uint64_t key);
+void s2e_tcg_afl_edge_handler(uint64_t loc);
+
+/** Emit AFL edge coverage for a block at location cur_loc. Exact edges
+    are keyed (prev_loc << 32 | cur_loc) and go through g_s2e_afl_edge_slot
+    instead of being hashed as prev_loc ^ cur_loc. */
+void s2e_tcg_emit_afl_edge(uint32_t cur_loc, int exact);
+
 /** Called by the translator when an int xxx instruction is detected */
 void s2e_on_translate_soft_interrupt_start(
         void *context,
@@ -810,6 +810,10 @@ typedef struct CPUX86State {
 
     TPRAccess tpr_access_type;
 
+    /* Previous AFL edge location, updated by the code that
+       s2e_tcg_emit_afl_edge() inserts at the start of blocks */
+    uint32_t afl_prev_loc;
+
 #ifdef S2E_ENABLE_PRECISE_EXCEPTION_DEBUGGING
     target_ulong s2e_eip;
 #endif
@@ -67,12 +67,41 @@ extern "C" {
 
 #include <llvm/ADT/DenseMap.h>
 
+#if defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#endif
+
+#include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 //#undef NDEBUG
 #define USE_GEPS
 
+#if defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+namespace {
+    llvm::cl::opt<std::string>
+    TbCacheDir("tb-cache-dir",
+            llvm::cl::desc("Directory where translated TBs are kept as bitcode, "
+                           "shared by all S2E instances and across runs"),
+            llvm::cl::init(""));
+
+    llvm::cl::opt<unsigned>
+    TbCacheSize("tb-cache-size",
+            llvm::cl::desc("Size in MB the TB cache directory is trimmed to, "
+                           "least recently used TBs first (0: unbounded)"),
+            llvm::cl::init(1024));
+}
+#endif
+
 extern "C" {
     TCGLLVMContext* tcg_llvm_ctx = 0;
 
@@ -120,6 +149,11 @@ struct TCGLLVMContextPrivate {
     /* Count of generated translation blocks */
     int m_tbCount;
 
+#if defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+    /* Bytes this instance added to the TB cache since it was last trimmed */
+    uint64_t m_tbCacheAdded;
+#endif
+
     /* XXX: The following members are "local" to generateCode method */
 
     /* TCGContext for current translation block */
@@ -293,6 +327,14 @@ public:
 
     Function *createTbFunction(const std::string &name);
     void generateCode(TCGContext *s, TranslationBlock *tb);
+
+#if defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+    /* Persistent TB cache */
+    std::string getCachedTbPath(TranslationBlock *tb, const std::string &name);
+    bool loadCachedTb(const std::string &path, const std::string &name);
+    void saveCachedTb(const std::string &path);
+    void trimTbCache();
+#endif
 };
 
 TCGLLVMContextPrivate::TCGLLVMContextPrivate(LLVMContext& context)
@@ -337,6 +379,10 @@ TCGLLVMContextPrivate::TCGLLVMContextPrivate(LLVMContext& context)
     m_cpuState = NULL;
     m_eip = NULL;
     m_ccop = NULL;
+
+#if defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+    m_tbCacheAdded = 0;
+#endif
 }
 
 TCGLLVMContextPrivate::~TCGLLVMContextPrivate()
@@ -1424,6 +1470,232 @@ std::string TCGLLVMContextPrivate::generateName(TranslationBlock *tb)
     return fName.str();
 }
 
+#if defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    while (size--) {
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * The cache key is the TCG op stream the TB translates to, which captures the
+ * guest code bytes and the CPU flags they were translated under, plus the
+ * precise pc table. Helper calls and goto_tb embed host addresses, which are
+ * hashed along, so a different build or load address misses the cache
+ * instead of picking up stale code.
+ */
+std::string TCGLLVMContextPrivate::getCachedTbPath(TranslationBlock *tb,
+                                                   const std::string &name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t runtime = (uint64_t) &tcg_llvm_runtime;
+
+    const TCGArg *args = gen_opparam_buf;
+    for (const uint16_t *opc = gen_opc_buf; *opc != INDEX_op_end; ++opc) {
+        const TCGOpDef &def = tcg_op_defs[*opc];
+        int nb_args = def.nb_args;
+
+        if (*opc == INDEX_op_call) {
+            nb_args = (args[0] >> 16) + (args[0] & 0xffff) + def.nb_cargs + 1;
+        } else if (*opc == INDEX_op_nopn) {
+            nb_args = args[0];
+        }
+
+        hash = fnv1a(hash, opc, sizeof(*opc));
+        hash = fnv1a(hash, args, nb_args * sizeof(*args));
+        args += nb_args;
+    }
+
+    hash = fnv1a(hash, tb->precise_pcs, tb->precise_entries * sizeof(*tb->precise_pcs));
+    hash = fnv1a(hash, &runtime, sizeof(runtime));
+
+    std::ostringstream path;
+    path << TbCacheDir << "/" << name << "-" << std::hex << hash << ".bc";
+    return path.str();
+}
+
+/**
+ * Link the TB function stored in path into the module. The file is mmapped,
+ * so instances reading the same entries share the page cache. Its mtime is
+ * bumped, which is what trimTbCache() evicts by.
+ */
+bool TCGLLVMContextPrivate::loadCachedTb(const std::string &path,
+                                         const std::string &name)
+{
+    ErrorOr<std::unique_ptr<MemoryBuffer> > buffer = MemoryBuffer::getFile(path);
+    if (!buffer) {
+        return false;
+    }
+
+    utimes(path.c_str(), NULL);
+
+    ErrorOr<std::unique_ptr<Module> > module =
+            parseBitcodeFile((*buffer)->getMemBufferRef(), m_context);
+    if (!module) {
+        return false;
+    }
+
+    /* Helpers missing from the module are called straight into QEMU,
+       register their address like INDEX_op_call does */
+    for (Function &f : **module) {
+        StringRef fname = f.getName();
+        if (!f.isDeclaration() || !fname.startswith("helper_") ||
+                m_module->getFunction(fname)) {
+            continue;
+        }
+
+        for (int i = 0; i < m_tcgContext->nb_helpers; ++i) {
+            if (fname.substr(7) == m_tcgContext->helpers[i].name) {
+                sys::DynamicLibrary::AddSymbol(fname, (void*) m_tcgContext->helpers[i].func);
+                break;
+            }
+        }
+    }
+
+    if (Linker::linkModules(*m_module, std::move(*module))) {
+        return false;
+    }
+
+    return m_module->getFunction(name) != NULL;
+}
+
+static Value *declareGlobal(Module *dst, GlobalValue *gv)
+{
+    if (Function *f = dyn_cast<Function>(gv)) {
+        Function *decl = Function::Create(f->getFunctionType(),
+                Function::ExternalLinkage, f->getName(), dst);
+        decl->setAttributes(f->getAttributes());
+        return decl;
+    }
+
+    GlobalVariable *g = cast<GlobalVariable>(gv);
+    return new GlobalVariable(*dst, g->getValueType(), g->isConstant(),
+            GlobalValue::ExternalLinkage, NULL, g->getName());
+}
+
+static void declareGlobals(Module *dst, Value *v, ValueToValueMapTy &vmap)
+{
+    if (GlobalValue *gv = dyn_cast<GlobalValue>(v)) {
+        if (!vmap.count(gv)) {
+            vmap[gv] = declareGlobal(dst, gv);
+        }
+    } else if (ConstantExpr *ce = dyn_cast<ConstantExpr>(v)) {
+        for (Value *op : ce->operands()) {
+            declareGlobals(dst, op, vmap);
+        }
+    }
+}
+
+/**
+ * Write the current TB function to path, alone in a module with declarations
+ * of whatever it references. Written under a temporary name and renamed, so
+ * concurrent instances never read a partial file.
+ */
+void TCGLLVMContextPrivate::saveCachedTb(const std::string &path)
+{
+    Module module(m_tbFunction->getName(), m_context);
+    module.setDataLayout(m_module->getDataLayout());
+    module.setTargetTriple(m_module->getTargetTriple());
+
+    ValueToValueMapTy vmap;
+    for (BasicBlock &bb : *m_tbFunction) {
+        for (Instruction &inst : bb) {
+            for (Value *op : inst.operands()) {
+                declareGlobals(&module, op, vmap);
+            }
+        }
+    }
+
+    Function *f = Function::Create(m_tbFunction->getFunctionType(),
+            m_tbFunction->getLinkage(), m_tbFunction->getName(), &module);
+
+    Function::arg_iterator dst = f->arg_begin();
+    for (Argument &arg : m_tbFunction->args()) {
+        vmap[&arg] = &*dst++;
+    }
+
+    SmallVector<ReturnInst*, 8> returns;
+    CloneFunctionInto(f, m_tbFunction, vmap, true, returns);
+
+    std::stringstream tmp;
+    tmp << path << "." << getpid();
+
+    std::error_code error;
+    llvm::raw_fd_ostream os(tmp.str(), error, llvm::sys::fs::F_None);
+    if (error) {
+        return;
+    }
+
+    WriteBitcodeToFile(&module, os);
+    uint64_t size = os.tell();
+    os.close();
+
+    if (os.has_error()) {
+        os.clear_error();
+        llvm::sys::fs::remove(tmp.str());
+        return;
+    }
+
+    llvm::sys::fs::rename(tmp.str(), path);
+
+    /* Scanning the directory is expensive, only do it once this instance
+       could have filled a good part of the slack */
+    m_tbCacheAdded += size;
+    if (TbCacheSize && m_tbCacheAdded > ((uint64_t) TbCacheSize << 20) / 16) {
+        m_tbCacheAdded = 0;
+        trimTbCache();
+    }
+}
+
+/**
+ * Delete the least recently used TBs until the cache directory is back under
+ * 7/8 of its size cap. Concurrent instances may trim at the same time, which
+ * only deletes a few more entries.
+ */
+void TCGLLVMContextPrivate::trimTbCache()
+{
+    DIR *dir = opendir(TbCacheDir.c_str());
+    if (!dir) {
+        return;
+    }
+
+    std::vector<std::pair<time_t, std::pair<off_t, std::string> > > entries;
+    uint64_t total = 0;
+
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        std::string name = de->d_name;
+        if (name.size() < 3 || name.compare(name.size() - 3, 3, ".bc")) {
+            continue;
+        }
+
+        std::string path = TbCacheDir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st)) {
+            continue;
+        }
+
+        entries.push_back(std::make_pair(st.st_mtime, std::make_pair(st.st_size, path)));
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    uint64_t cap = (uint64_t) TbCacheSize << 20;
+    if (total <= cap) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end());
+    for (unsigned i = 0; i < entries.size() && total > cap / 8 * 7; ++i) {
+        unlink(entries[i].second.second.c_str());
+        total -= entries[i].second.first;
+    }
+}
+#endif
+
 Function *TCGLLVMContextPrivate::createTbFunction(const std::string &name)
 {
     FunctionType *tbFunctionType = tbType();
@@ -1457,6 +1729,19 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
         return;
     }
 
+    m_tcgContext = s;
+
+#if defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+    std::string cachedTbPath;
+    if (!TbCacheDir.empty() && !tb->instrumented) {
+        cachedTbPath = getCachedTbPath(tb, name);
+        if (loadCachedTb(cachedTbPath, name)) {
+            tb->llvm_function = m_module->getFunction(name);
+            return;
+        }
+    }
+#endif
+
     m_tbFunction = createTbFunction(name);
     m_tbFunction->addFnAttr(Attribute::AlwaysInline);
 
@@ -1464,8 +1749,6 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
             "entry", m_tbFunction);
     m_builder.SetInsertPoint(basicBlock);
 
-    m_tcgContext = s;
-
     /* Prepare globals and temps information */
     initGlobalsAndLocalTemps();
 
@@ -1602,6 +1885,15 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
 
     tb->llvm_function = m_tbFunction;
 
+#if defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+    /* KLEE adds TBs to its module as they are, so cached TBs are optimized
+       first: a hit then saves both the translation and the optimization */
+    if (!cachedTbPath.empty()) {
+        m_functionPassManager->run(*m_tbFunction);
+        saveCachedTb(cachedTbPath);
+    }
+#endif
+
     if(qemu_loglevel_mask(CPU_LOG_LLVM_IR)) {
         std::string fcnString;
         llvm::raw_string_ostream s(fcnString);
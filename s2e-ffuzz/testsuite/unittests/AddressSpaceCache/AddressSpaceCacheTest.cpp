@@ -146,4 +146,30 @@ TEST_F(AddressSpaceCacheTest, TestGetBaseObject) {
     ASSERT_EQ(baseOs1, smallOs[0]);
 }
 
+TEST_F(AddressSpaceCacheTest, TestWarmClone) {
+
+    const unsigned START = 0x3000;
+
+    for (unsigned i = 0; i < PAGE_COUNT; ++i) {
+        m_cache->get(i * TARGET_PAGE_SIZE);
+    }
+
+    AddressSpaceCache clone(*m_cache);
+
+    std::vector<MemoryObject*> smallMo;
+    std::vector<ObjectState*> smallOs;
+
+    Split(START, smallMo, smallOs);
+
+    /* The clone still has the entry it inherited, the split only
+       invalidated the original's copy */
+    ObjectPair op = clone.get(START);
+    ASSERT_EQ(op.first, m_mo[START / TARGET_PAGE_SIZE]);
+    ASSERT_EQ(op.second, m_os[START / TARGET_PAGE_SIZE]);
+
+    op = m_cache->get(START);
+    ASSERT_EQ(op.first, smallMo[0]);
+    ASSERT_EQ(op.second, smallOs[0]);
+}
+
 }
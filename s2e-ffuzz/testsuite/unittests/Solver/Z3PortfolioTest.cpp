@@ -0,0 +1,111 @@
+#include <klee/Common.h>
+#include <klee/Constraints.h>
+#include <klee/Expr.h>
+#include <klee/Solver.h>
+#include <klee/SolverStats.h>
+
+#include <llvm/Support/raw_ostream.h>
+
+#include <gtest/gtest.h>
+
+using namespace testing;
+using namespace klee;
+
+namespace {
+
+// x * y == n with 1 < x, y < 4096. Showing that a 16-bit prime has no such
+// factors keeps Z3 busy for a good fraction of a second, long enough for the
+// losers of a race to be inside their check when the winner answers.
+class Z3PortfolioTest : public Test {
+protected:
+    Z3PortfolioTest() : array("factors", 4) {
+        klee_message_stream = &llvm::nulls();
+
+        x = ZExtExpr::create(read16(0), Expr::Int32);
+        y = ZExtExpr::create(read16(2), Expr::Int32);
+    }
+
+    ref<Expr> read16(unsigned offset) {
+        UpdateList ul(&array, 0);
+        return ConcatExpr::create(ReadExpr::create(ul, ConstantExpr::alloc(offset + 1, Expr::Int32)),
+                                  ReadExpr::create(ul, ConstantExpr::alloc(offset, Expr::Int32)));
+    }
+
+    void addBounds(ConstraintManager &cm) {
+        cm.addConstraint(UltExpr::create(ConstantExpr::alloc(1, Expr::Int32), x));
+        cm.addConstraint(UltExpr::create(ConstantExpr::alloc(1, Expr::Int32), y));
+        cm.addConstraint(UltExpr::create(x, ConstantExpr::alloc(4096, Expr::Int32)));
+        cm.addConstraint(UltExpr::create(y, ConstantExpr::alloc(4096, Expr::Int32)));
+    }
+
+    ref<Expr> isProduct(uint32_t n) {
+        return EqExpr::create(MulExpr::create(x, y), ConstantExpr::alloc(n, Expr::Int32));
+    }
+
+    static uint64_t wins() {
+        return stats::portfolioResetWins + stats::portfolioStackWins +
+               stats::portfolioAssumptionWins;
+    }
+
+    Array array;
+    ref<Expr> x, y;
+};
+
+TEST_F(Z3PortfolioTest, LosersAnswerNextQuery) {
+    std::vector<std::string> members;
+    members.push_back("reset");
+    members.push_back("stack");
+    members.push_back("assumption");
+
+    Solver *solver = Z3Solver::createPortfolioSolver(members);
+    uint64_t wins0 = wins();
+
+    // One member wins, the others are interrupted in their check
+    uint64_t restarts = stats::portfolioRestarts;
+    ConstraintManager cm1;
+    addBounds(cm1);
+
+    bool result = true;
+    ASSERT_TRUE(solver->mayBeTrue(Query(cm1, isProduct(65521)), result));
+    EXPECT_FALSE(result);
+    EXPECT_GT(stats::portfolioRestarts - restarts, 0u);
+
+    // The interrupted members take part again: some of them have to be
+    // interrupted once more rather than bail out with unknown
+    restarts = stats::portfolioRestarts;
+    ConstraintManager cm2;
+    addBounds(cm2);
+    cm2.addConstraint(isProduct(4093 * 4091));
+
+    std::vector<const Array*> objects(1, &array);
+    std::vector<std::vector<unsigned char> > values;
+    ASSERT_TRUE(solver->getInitialValues(Query(cm2, ConstantExpr::alloc(0, Expr::Bool)),
+                                         objects, values));
+    ASSERT_EQ(1u, values.size());
+    ASSERT_EQ(4u, values[0].size());
+
+    uint32_t vx = values[0][0] | (values[0][1] << 8);
+    uint32_t vy = values[0][2] | (values[0][3] << 8);
+    EXPECT_EQ(4093u * 4091u, vx * vy);
+    EXPECT_GT(stats::portfolioRestarts - restarts, 0u);
+
+    EXPECT_EQ(2u, wins() - wins0);
+
+    delete solver;
+}
+
+TEST_F(Z3PortfolioTest, MemberTimeout) {
+    // The only member gives up before it can tell, the query fails
+    std::vector<std::string> members(1, "reset@1");
+    Solver *solver = Z3Solver::createPortfolioSolver(members);
+
+    ConstraintManager cm;
+    addBounds(cm);
+
+    bool result;
+    EXPECT_FALSE(solver->mayBeTrue(Query(cm, isProduct(65521)), result));
+
+    delete solver;
+}
+
+}